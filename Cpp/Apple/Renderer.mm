@@ -230,9 +230,9 @@ static int frameCounter = 0;
     }
     else
     {
-        int rayCount;
-        DrawTest(curT, totalCounter, kBackbufferWidth, kBackbufferHeight, _backbufferPixels, rayCount, g_TestFlags);
-        rayCounter += rayCount;
+        RayStats stats;
+        DrawTest(curT, totalCounter, kBackbufferWidth, kBackbufferHeight, _backbufferPixels, stats, g_TestFlags);
+        rayCounter += stats.TotalRays();
     }
     
     uint64_t time2 = mach_absolute_time();
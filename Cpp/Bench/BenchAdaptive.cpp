@@ -0,0 +1,89 @@
+// Compares progressive rendering with uniform vs adaptive sampling (kFlagAdaptive), by how fast
+// the image error goes down. Error is RMSE against a reference rendered with many more frames.
+//
+// Usage: BenchAdaptive [frames] [width] [height] [referenceFrames]
+
+#include "../Source/Config.h"
+#include "../Source/Test.h"
+#include "BenchUtil.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+static double ComputeRMSE(const std::vector<float>& a, const std::vector<float>& b)
+{
+    double sum = 0;
+    for (size_t i = 0; i < a.size(); i += 4)
+        for (int c = 0; c < 3; ++c)
+            sum += (a[i + c] - b[i + c]) * (a[i + c] - b[i + c]);
+    return sqrt(sum / (a.size() / 4 * 3));
+}
+
+struct Step
+{
+    double seconds;
+    long long rays;
+    double rmse;
+};
+
+static std::vector<Step> Render(int frames, int width, int height, unsigned flags, const std::vector<float>* reference, std::vector<float>& backbuffer)
+{
+    std::vector<Step> steps;
+    Step step = {};
+    for (int frame = 0; frame < frames; ++frame)
+    {
+        RayStats stats;
+        double t0 = GetTimeSeconds();
+        DrawTest(0.0f, frame, width, height, backbuffer.data(), stats, flags);
+        step.seconds += GetTimeSeconds() - t0;
+        step.rays += stats.TotalRays();
+        if (reference)
+            step.rmse = ComputeRMSE(backbuffer, *reference);
+        steps.push_back(step);
+    }
+    return steps;
+}
+
+int main(int argc, char** argv)
+{
+    int frames = argc > 1 ? atoi(argv[1]) : 64;
+    int width = argc > 2 ? atoi(argv[2]) : 320;
+    int height = argc > 3 ? atoi(argv[3]) : 180;
+    int refFrames = argc > 4 ? atoi(argv[4]) : 512;
+
+    InitializeTest();
+    UpdateTest(0.0f, 0, width, height, kFlagProgressive);
+    std::vector<float> reference(width * height * 4), backbuffer(width * height * 4);
+    printf("rendering %i frame reference at %ix%i...\n", refFrames, width, height);
+    Render(refFrames, width, height, kFlagProgressive, NULL, reference);
+
+    std::vector<Step> uniform = Render(frames, width, height, kFlagProgressive, &reference, backbuffer);
+    std::vector<Step> adaptive = Render(frames, width, height, kFlagProgressive | kFlagAdaptive, &reference, backbuffer);
+
+    printf("frame   uniform: ms      Mrays   RMSE      adaptive: ms      Mrays   RMSE\n");
+    for (int f = 1; f <= frames; f *= 2)
+    {
+        const Step& u = uniform[f - 1];
+        const Step& a = adaptive[f - 1];
+        printf("%5i   %12.1f %8.2f %9.6f   %13.1f %8.2f %9.6f\n", f, u.seconds * 1000.0, u.rays * 1.0e-6, u.rmse, a.seconds * 1000.0, a.rays * 1.0e-6, a.rmse);
+    }
+
+    // time to reach the error that uniform sampling has at the end
+    double target = uniform[frames - 1].rmse;
+    printf("time to RMSE %.6f:", target);
+    const std::vector<Step>* runs[] = { &uniform, &adaptive };
+    for (const std::vector<Step>* run : runs)
+    {
+        double t = -1;
+        for (const Step& s : *run)
+            if (s.rmse <= target) { t = s.seconds; break; }
+        if (t < 0)
+            printf("  not reached");
+        else
+            printf("  %.1f ms", t * 1000.0);
+    }
+    printf("  (uniform, adaptive)\n");
+    ShutdownTest();
+    return 0;
+}
@@ -0,0 +1,383 @@
+// Image quality regression check: renders the scene progressively with a given configuration,
+// and measures how the error against a high sample count reference goes down over (wall clock) time.
+// Rays/second alone can't tell whether a faster change also converges slower, or adds bias.
+//
+// The reference is rendered once (uniform & random sampling, many frames) and cached in the build folder;
+// delete it (or pass --rebuild-reference) after changes that intentionally change the image.
+// Reference frames use different random seeds than the measured ones, so errors are not correlated.
+//
+// Usage: BenchConvergence [options]
+//   --frames=N         progressive frames to render (default 64)
+//   --size=WxH         resolution (default 320x180)
+//   --threads=N        worker thread count (default: one per CPU core)
+//   --flags=a,b,...    extra flags: wavefront, adaptive, or none (progressive is always on)
+//   --roulette=N       Russian roulette after N bounces, -1 for none (default DO_RUSSIAN_ROULETTE_DEPTH)
+//   --lights=MODE[:K]  light sampling from diffuse hits: all (default; every light), or K (default 1) lights picked
+//                      by power, solidangle or bvh (see SetLightSampling)
+//   --mis=MODE         multiple importance sampling of lights: off, balance or power (default DO_MIS_HEURISTIC)
+//   --sampler=MODE     pixel, lens & bounce samples: random or sobol (default DO_SAMPLER); compare the two at equal frames
+//   --denoise[=N]      measure the error of the denoised image (DenoiseTest with N passes, default DO_DENOISE_PASSES)
+//                      after each frame; its time is included
+//   --kernels=LEVEL    base, sse4.1, avx2, avx512 (default: best the CPU can do)
+//   --ref-frames=N     frames in the reference (default 1024)
+//   --reference=FILE   reference PFM file (default build/reference_WxH_N.pfm); rendered if it does not exist
+//   --rebuild-reference
+//   --curve=FILE.csv   write error over time curve: seconds, frame, rays, RMSE, relMSE for each frame
+// Checks; if any fails, exit code is 1:
+//   --max-rmse=X       RMSE after all frames at most X
+//   --max-relmse=X     relative MSE after all frames at most X
+//   --min-slope=X      MSE should go down like 1/frames (slope 1.0) for an unbiased renderer; slope from frames
+//                      N/4 to N at least X (e.g. 0.7) catches bias or error that stops going down
+//   --baseline=FILE.csv  curve written by an earlier run (on the same machine!); time to reach the final relMSE
+//   --max-slowdown=X     of the baseline must be at most (1+X) times the baseline time (default 0.1); if this run
+//                        does not get there, the time is extrapolated assuming MSE ~ 1/time
+
+#include "../Source/Config.h"
+#include "../Source/Test.h"
+#include "../Source/Kernels.h"
+#include "BenchUtil.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// frame indices of the reference start from here, to get different random numbers
+static const int kReferenceFrameOffset = 1 << 20;
+
+struct Step
+{
+    double seconds;
+    int frame;
+    long long rays;
+    double rmse;
+    double relMSE;
+};
+
+struct Options
+{
+    int frames = 64;
+    int width = 320, height = 180;
+    int threads = 0;
+    unsigned flags = 0;
+    const char* kernels = NULL;
+    int roulette = DO_RUSSIAN_ROULETTE_DEPTH;
+    LightSampling lights = kLightSamplingAll;
+    int lightSamples = 1;
+    MisHeuristic mis = (MisHeuristic)DO_MIS_HEURISTIC;
+    Sampler sampler = (Sampler)DO_SAMPLER;
+    int denoisePasses = -1; // -1: no denoising
+    int refFrames = 1024;
+    std::string reference;
+    bool rebuildReference = false;
+    const char* curve = NULL;
+    double maxRMSE = -1, maxRelMSE = -1, minSlope = -1;
+    const char* baseline = NULL;
+    double maxSlowdown = 0.1;
+};
+
+// Relative MSE: squared error divided by squared reference value (plus a small bias for dark pixels)
+static void ComputeErrors(const std::vector<float>& image, const std::vector<float>& reference, double& outRMSE, double& outRelMSE)
+{
+    double sum = 0, sumRel = 0;
+    for (size_t i = 0; i < image.size(); i += 4)
+    {
+        for (int c = 0; c < 3; ++c)
+        {
+            double d = image[i + c] - reference[i + c];
+            double r = reference[i + c];
+            sum += d * d;
+            sumRel += d * d / (r * r + 0.01);
+        }
+    }
+    double count = double(image.size() / 4 * 3);
+    outRMSE = sqrt(sum / count);
+    outRelMSE = sumRel / count;
+}
+
+static bool WritePFM(const char* path, const std::vector<float>& image, int width, int height)
+{
+    FILE* f = fopen(path, "wb");
+    if (!f)
+        return false;
+    fprintf(f, "PF\n%i %i\n-1.0\n", width, height);
+    for (size_t i = 0; i < image.size(); i += 4)
+        fwrite(&image[i], sizeof(float), 3, f);
+    return fclose(f) == 0;
+}
+
+static bool ReadPFM(const char* path, std::vector<float>& image, int width, int height)
+{
+    FILE* f = fopen(path, "rb");
+    if (!f)
+        return false;
+    int w = 0, h = 0;
+    float scale = 0;
+    bool ok = fscanf(f, "PF %i %i %f", &w, &h, &scale) == 3 && fgetc(f) == '\n' && w == width && h == height && scale < 0;
+    for (size_t i = 0; ok && i < image.size(); i += 4)
+    {
+        ok = fread(&image[i], sizeof(float), 3, f) == 3;
+        image[i + 3] = 0;
+    }
+    fclose(f);
+    return ok;
+}
+
+// Average of many non-progressive frames, accumulated in doubles; with the simplest (no Russian roulette,
+// all lights sampled, random numbers) settings, just in case
+static void RenderReference(const Options& opt, std::vector<float>& reference)
+{
+    SetRussianRoulette(-1);
+    SetLightSampling(kLightSamplingAll, 1);
+    SetSampler(kSamplerRandom);
+    std::vector<float> frame(reference.size());
+    std::vector<double> sum(reference.size(), 0.0);
+    for (int i = 0; i < opt.refFrames; ++i)
+    {
+        RayStats stats;
+        DrawTest(0.0f, kReferenceFrameOffset + i, opt.width, opt.height, frame.data(), stats, 0);
+        for (size_t j = 0; j < sum.size(); ++j)
+            sum[j] += frame[j];
+    }
+    for (size_t j = 0; j < sum.size(); ++j)
+        reference[j] = float(sum[j] / opt.refFrames);
+}
+
+static std::vector<Step> ReadCurve(const char* path)
+{
+    std::vector<Step> steps;
+    FILE* f = fopen(path, "rb");
+    if (!f)
+        return steps;
+    char line[256];
+    while (fgets(line, sizeof(line), f))
+    {
+        Step s;
+        if (sscanf(line, "%lf,%i,%lld,%lf,%lf", &s.seconds, &s.frame, &s.rays, &s.rmse, &s.relMSE) == 5)
+            steps.push_back(s);
+    }
+    fclose(f);
+    return steps;
+}
+
+// Time (interpolated between frames) at which error first reaches relMSE; negative if never
+static double TimeToRelMSE(const std::vector<Step>& steps, double relMSE)
+{
+    for (size_t i = 0; i < steps.size(); ++i)
+    {
+        if (steps[i].relMSE > relMSE)
+            continue;
+        if (i == 0)
+            return steps[0].seconds;
+        const Step& a = steps[i - 1];
+        const Step& b = steps[i];
+        double t = (a.relMSE - relMSE) / (a.relMSE - b.relMSE);
+        return a.seconds + (b.seconds - a.seconds) * t;
+    }
+    return -1;
+}
+
+int main(int argc, char** argv)
+{
+    Options opt;
+    for (int i = 1; i < argc; ++i)
+    {
+        const char* arg = argv[i];
+        bool ok = true;
+        if (strncmp(arg, "--frames=", 9) == 0)
+            opt.frames = atoi(arg + 9);
+        else if (strncmp(arg, "--size=", 7) == 0)
+            ok = sscanf(arg + 7, "%ix%i", &opt.width, &opt.height) == 2;
+        else if (strncmp(arg, "--threads=", 10) == 0)
+            opt.threads = atoi(arg + 10);
+        else if (strncmp(arg, "--flags=", 8) == 0)
+        {
+            opt.flags = (strstr(arg, "wavefront") ? kFlagWavefront : 0) | (strstr(arg, "adaptive") ? kFlagAdaptive : 0);
+            ok = opt.flags != 0 || strcmp(arg + 8, "none") == 0;
+        }
+        else if (strncmp(arg, "--kernels=", 10) == 0)
+            opt.kernels = arg + 10;
+        else if (strncmp(arg, "--roulette=", 11) == 0)
+            opt.roulette = atoi(arg + 11);
+        else if (strncmp(arg, "--lights=", 9) == 0)
+        {
+            char mode[32] = "";
+            opt.lightSamples = 1;
+            ok = sscanf(arg + 9, "%31[a-z]:%i", mode, &opt.lightSamples) >= 1;
+            if (strcmp(mode, "all") == 0) opt.lights = kLightSamplingAll;
+            else if (strcmp(mode, "power") == 0) opt.lights = kLightSamplingPower;
+            else if (strcmp(mode, "solidangle") == 0) opt.lights = kLightSamplingSolidAngle;
+            else if (strcmp(mode, "bvh") == 0) opt.lights = kLightSamplingBvh;
+            else ok = false;
+        }
+        else if (strncmp(arg, "--mis=", 6) == 0)
+        {
+            if (strcmp(arg + 6, "off") == 0) opt.mis = kMisOff;
+            else if (strcmp(arg + 6, "balance") == 0) opt.mis = kMisBalance;
+            else if (strcmp(arg + 6, "power") == 0) opt.mis = kMisPower;
+            else ok = false;
+        }
+        else if (strncmp(arg, "--sampler=", 10) == 0)
+        {
+            if (strcmp(arg + 10, "random") == 0) opt.sampler = kSamplerRandom;
+            else if (strcmp(arg + 10, "sobol") == 0) opt.sampler = kSamplerSobol;
+            else ok = false;
+        }
+        else if (strcmp(arg, "--denoise") == 0)
+            opt.denoisePasses = DO_DENOISE_PASSES;
+        else if (strncmp(arg, "--denoise=", 10) == 0)
+            opt.denoisePasses = atoi(arg + 10);
+        else if (strncmp(arg, "--ref-frames=", 13) == 0)
+            opt.refFrames = atoi(arg + 13);
+        else if (strncmp(arg, "--reference=", 12) == 0)
+            opt.reference = arg + 12;
+        else if (strcmp(arg, "--rebuild-reference") == 0)
+            opt.rebuildReference = true;
+        else if (strncmp(arg, "--curve=", 8) == 0)
+            opt.curve = arg + 8;
+        else if (strncmp(arg, "--max-rmse=", 11) == 0)
+            opt.maxRMSE = atof(arg + 11);
+        else if (strncmp(arg, "--max-relmse=", 13) == 0)
+            opt.maxRelMSE = atof(arg + 13);
+        else if (strncmp(arg, "--min-slope=", 12) == 0)
+            opt.minSlope = atof(arg + 12);
+        else if (strncmp(arg, "--baseline=", 11) == 0)
+            opt.baseline = arg + 11;
+        else if (strncmp(arg, "--max-slowdown=", 15) == 0)
+            opt.maxSlowdown = atof(arg + 15);
+        else
+            ok = false;
+        if (!ok || opt.frames < 4 || opt.width < 1 || opt.height < 1 || opt.threads < 0 || opt.refFrames < 1)
+        {
+            fprintf(stderr, "Invalid argument '%s'; see the top of BenchConvergence.cpp for usage\n", arg);
+            return 1;
+        }
+    }
+    if (opt.reference.empty())
+        opt.reference = "build/reference_" + std::to_string(opt.width) + "x" + std::to_string(opt.height) + "_" + std::to_string(opt.refFrames) + ".pfm";
+
+    InitializeTest(opt.threads);
+    UpdateTest(0.0f, 0, opt.width, opt.height, kFlagProgressive);
+
+    std::vector<float> reference(opt.width * opt.height * 4), backbuffer(opt.width * opt.height * 4);
+    if (opt.rebuildReference || !ReadPFM(opt.reference.c_str(), reference, opt.width, opt.height))
+    {
+        printf("rendering %i frame reference at %ix%i into %s...\n", opt.refFrames, opt.width, opt.height, opt.reference.c_str());
+        double t0 = GetTimeSeconds();
+        RenderReference(opt, reference);
+        printf("  done in %.1fs\n", GetTimeSeconds() - t0);
+        if (!WritePFM(opt.reference.c_str(), reference, opt.width, opt.height))
+            fprintf(stderr, "Failed to write '%s'\n", opt.reference.c_str());
+    }
+
+    // the configuration being measured
+    if (opt.kernels)
+        SelectKernels(opt.kernels);
+    SetRussianRoulette(opt.roulette);
+    SetLightSampling(opt.lights, opt.lightSamples);
+    SetMisHeuristic(opt.mis);
+    SetSampler(opt.sampler);
+    unsigned flags = kFlagProgressive | opt.flags;
+    if (opt.denoisePasses >= 0)
+        flags |= kFlagAOVs;
+    std::vector<float> denoised(opt.denoisePasses >= 0 ? backbuffer.size() : 0);
+    std::vector<Step> steps;
+    Step step = {};
+    for (int frame = 0; frame < opt.frames; ++frame)
+    {
+        RayStats stats;
+        double t0 = GetTimeSeconds();
+        DrawTest(0.0f, frame, opt.width, opt.height, backbuffer.data(), stats, flags);
+        if (opt.denoisePasses >= 0)
+            DenoiseTest(opt.width, opt.height, backbuffer.data(), denoised.data(), opt.denoisePasses);
+        step.seconds += GetTimeSeconds() - t0;
+        step.frame = frame + 1;
+        step.rays += stats.TotalRays();
+        ComputeErrors(opt.denoisePasses >= 0 ? denoised : backbuffer, reference, step.rmse, step.relMSE);
+        steps.push_back(step);
+    }
+    ShutdownTest();
+
+    if (opt.curve)
+    {
+        FILE* f = fopen(opt.curve, "wb");
+        if (f)
+        {
+            fprintf(f, "seconds,frame,rays,rmse,relmse\n");
+            for (const Step& s : steps)
+                fprintf(f, "%.6f,%i,%lld,%.8g,%.8g\n", s.seconds, s.frame, s.rays, s.rmse, s.relMSE);
+            fclose(f);
+        }
+        else
+            fprintf(stderr, "Failed to write '%s'\n", opt.curve);
+    }
+
+    printf("kernels %s, roulette %i, sampler %s, denoise passes %i, flags %s%s\n", GetKernelLevelName(GetKernelLevel()), opt.roulette, opt.sampler == kSamplerSobol ? "sobol" : "random", std::max(opt.denoisePasses, 0), opt.flags & kFlagWavefront ? "wavefront " : "", opt.flags & kFlagAdaptive ? "adaptive" : "");
+    printf("frame          ms     Mrays       RMSE     relMSE\n");
+    for (int f = 1; ; f *= 2)
+    {
+        const Step& s = steps[std::min(f, opt.frames) - 1];
+        printf("%5i %11.1f %9.2f %10.6f %10.6f\n", s.frame, s.seconds * 1000.0, s.rays * 1.0e-6, s.rmse, s.relMSE);
+        if (f >= opt.frames)
+            break;
+    }
+
+    // time to reach some error levels: halvings of the relMSE after the first frame
+    printf("time to relMSE:");
+    for (double target = steps[0].relMSE * 0.5; target >= steps.back().relMSE; target *= 0.5)
+        printf("  %.6f in %.1fms", target, TimeToRelMSE(steps, target) * 1000.0);
+    printf("\n");
+
+    const Step& last = steps.back();
+    const Step& quarter = steps[opt.frames / 4 - 1];
+    // MSE ~ frames^-slope
+    double slope = log((quarter.rmse * quarter.rmse) / (last.rmse * last.rmse)) / log(double(last.frame) / quarter.frame);
+    printf("MSE slope from frame %i to %i: %.3f (1.0 for unbiased uniform sampling)\n", quarter.frame, last.frame, slope);
+
+    bool failed = false;
+    if (opt.maxRMSE >= 0 && last.rmse > opt.maxRMSE)
+    {
+        printf("FAILED: RMSE %.6f > %.6f\n", last.rmse, opt.maxRMSE);
+        failed = true;
+    }
+    if (opt.maxRelMSE >= 0 && last.relMSE > opt.maxRelMSE)
+    {
+        printf("FAILED: relMSE %.6f > %.6f\n", last.relMSE, opt.maxRelMSE);
+        failed = true;
+    }
+    if (opt.minSlope >= 0 && slope < opt.minSlope)
+    {
+        printf("FAILED: MSE slope %.3f < %.3f\n", slope, opt.minSlope);
+        failed = true;
+    }
+    if (opt.baseline)
+    {
+        std::vector<Step> base = ReadCurve(opt.baseline);
+        if (base.empty())
+        {
+            printf("FAILED: could not read baseline '%s'\n", opt.baseline);
+            failed = true;
+        }
+        else
+        {
+            double target = base.back().relMSE;
+            double baseTime = TimeToRelMSE(base, target);
+            double time = TimeToRelMSE(steps, target);
+            // not there yet: extrapolate, assuming MSE ~ 1/time
+            if (time < 0)
+                time = last.seconds * last.relMSE / target;
+            printf("time to baseline relMSE %.6f: %.1fms, baseline %.1fms (%+.1f%%)\n", target, time * 1000.0, baseTime * 1000.0, (time / baseTime - 1.0) * 100.0);
+            if (time > baseTime * (1.0 + opt.maxSlowdown))
+            {
+                printf("FAILED: more than %.0f%% slower than baseline to reach the same error\n", opt.maxSlowdown * 100.0);
+                failed = true;
+            }
+        }
+    }
+    if (failed)
+        return 1;
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,143 @@
+// Compares the HitSpheres kernels of all instruction set levels the CPU supports (4-wide SSE/NEON,
+// 8-wide AVX2, 16-wide AVX-512), on the built-in scene and on larger generated ones. Rays are camera
+// rays through random pixels.
+//
+// Usage: BenchHitSpheres [--kernels=<level>] to only compare the given level against the base one.
+
+#include "../Source/Config.h"
+#include "../Source/Maths.h"
+#include "../Source/Test.h"
+#include "../Source/Kernels.h"
+#include "BenchUtil.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+typedef int (*HitSpheresRangeFunc)(const Ray& r, const SpheresSoA& spheres, int start, int end, float tMin, float& inoutTMax);
+
+const int kRayCount = 8192;
+const int kRepeats = 5;
+const float kMinT = 0.001f;
+const float kMaxT = 1.0e7f;
+
+static SpheresSoA* CreateSceneSpheres(const Sphere* spheres, int count)
+{
+    SpheresSoA* soa = new SpheresSoA(count);
+    for (int i = 0; i < count; ++i)
+    {
+        soa->centerX[i] = spheres[i].center.x;
+        soa->centerY[i] = spheres[i].center.y;
+        soa->centerZ[i] = spheres[i].center.z;
+        soa->sqRadius[i] = spheres[i].radius * spheres[i].radius;
+        soa->invRadius[i] = 1.0f / spheres[i].radius;
+    }
+    return soa;
+}
+
+// ground sphere plus a bunch of small random spheres, roughly where the built-in scene has them
+static SpheresSoA* CreateRandomSpheres(int count, uint32_t& state)
+{
+    std::vector<Sphere> spheres(count);
+    spheres[0] = Sphere(float3(0, -100.5f, -1), 100);
+    for (int i = 1; i < count; ++i)
+    {
+        float3 pos(RandomFloat01(state) * 16 - 8, RandomFloat01(state) * 2 - 0.5f, -RandomFloat01(state) * 12);
+        spheres[i] = Sphere(pos, 0.02f + RandomFloat01(state) * 0.2f);
+    }
+    return CreateSceneSpheres(spheres.data(), count);
+}
+
+// returns nanoseconds per ray (best of several runs), and the hit distances to validate results against
+static double RunKernel(HitSpheresRangeFunc func, const SpheresSoA& spheres, const std::vector<Ray>& rays, std::vector<float>& outT)
+{
+    double best = 1.0e30;
+    outT.resize(rays.size());
+    for (int rep = 0; rep < kRepeats; ++rep)
+    {
+        double t0 = GetTimeSeconds();
+        for (size_t i = 0; i < rays.size(); ++i)
+        {
+            float t = kMaxT;
+            func(rays[i], spheres, 0, spheres.simdCount, kMinT, t);
+            outT[i] = t;
+        }
+        double t1 = GetTimeSeconds();
+        if (t1 - t0 < best)
+            best = t1 - t0;
+    }
+    return best / rays.size() * 1.0e9;
+}
+
+// FMA rounds differently, so a handful of rays that just graze a sphere silhouette can
+// legitimately hit in one kernel and miss in the other; expect only a few of these
+static int CountMismatches(const std::vector<float>& a, const std::vector<float>& b)
+{
+    int count = 0;
+    for (size_t i = 0; i < a.size(); ++i)
+    {
+        if (fabsf(a[i] - b[i]) > 1.0e-4f * (1.0f + a[i]))
+            ++count;
+    }
+    return count;
+}
+
+static void BenchScene(const char* name, const SpheresSoA& spheres, const std::vector<Ray>& rays, int onlyLevel)
+{
+    printf("%-10s %7i spheres\n", name, spheres.count);
+    std::vector<float> baseT, t;
+    double baseNs = 0;
+    for (int level = 0; level < kKernelLevelCount; ++level)
+    {
+        const KernelTable* kernels = GetKernelTable(level);
+        if (kernels == NULL || (onlyLevel >= 0 && level != onlyLevel && level != kKernelLevelBase))
+            continue;
+        double ns = RunKernel(kernels->hitSpheresRange, spheres, rays, t);
+        if (level == kKernelLevelBase)
+        {
+            baseNs = ns;
+            baseT = t;
+        }
+        printf("  %-8s %9.1f ns/ray %7.2f Mrays/s  speedup %.2fx  mismatches %i\n", GetKernelLevelName(level), ns, 1.0e3 / ns, baseNs / ns, CountMismatches(baseT, t));
+    }
+}
+
+int main(int argc, char** argv)
+{
+    int onlyLevel = -1;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strncmp(argv[i], "--kernels=", 10) == 0)
+            onlyLevel = SelectKernels(argv[i] + 10);
+    }
+
+    // get the built-in scene & camera
+    int objCount, objSize, matSize, camSize;
+    UpdateTest(0.0f, 0, kBackbufferWidth, kBackbufferHeight, 0);
+    GetObjectCount(objCount, objSize, matSize, camSize);
+    std::vector<Sphere> sceneSpheres(objCount);
+    std::vector<char> sceneMaterials(objCount * matSize);
+    std::vector<int> sceneEmissives(objCount);
+    int emissiveCount;
+    Camera cam;
+    GetSceneDesc(sceneSpheres.data(), sceneMaterials.data(), &cam, sceneEmissives.data(), &emissiveCount);
+
+    uint32_t state = 1;
+    std::vector<Ray> rays(kRayCount);
+    for (int i = 0; i < kRayCount; ++i)
+        rays[i] = cam.GetRay(RandomFloat01(state), RandomFloat01(state), state);
+
+    SpheresSoA* builtin = CreateSceneSpheres(sceneSpheres.data(), objCount);
+    BenchScene("built-in", *builtin, rays, onlyLevel);
+    delete builtin;
+
+    const int kGeneratedCounts[] = { 256, 1024, 4096, 16384 };
+    for (int count : kGeneratedCounts)
+    {
+        SpheresSoA* spheres = CreateRandomSpheres(count, state);
+        BenchScene("generated", *spheres, rays, onlyLevel);
+        delete spheres;
+    }
+    return 0;
+}
@@ -0,0 +1,235 @@
+// Microbenchmarks of the tracer's inner functions, each called in isolation over a fixed set of
+// inputs: Camera::GetRay, random & Sobol 2D samples, RandomUnitVector, RandomInUnitSphere, diffuse
+// bounce direction sampling (old and new way), Scatter for each material type, and HitSpheres (all
+// spheres, and via the BVH) on scenes of 8, 46, 1k and 100k spheres.
+// Prints ns/call with a 95% confidence interval over the repetitions, and millions of calls
+// (i.e. rays) per second.
+//
+// Usage: BenchKernels [--reps=N] [--warmup=N] [--kernels=<level>]
+
+// Scatter & scene data are internal to Test.cpp, so it is compiled right into this benchmark
+#include "../Source/Test.cpp"
+#include "BenchUtil.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+const int kInputCount = 32768;
+static int s_Reps = 20;
+static int s_Warmup = 2;
+static volatile float s_Sink; // keeps results from being optimized away
+
+template<typename F>
+static void Run(const char* name, F func, int callCount)
+{
+    BenchStats st = MeasureNsPerCall(func, callCount, s_Warmup, s_Reps);
+    printf("  %-28s %10.2f ns/call  +-%7.2f  %9.2f M/s\n", name, st.mean, st.ci95, 1.0e3 / st.mean);
+}
+
+static void FillSoA(SpheresSoA& soa, const Sphere* spheres)
+{
+    for (int i = 0; i < soa.count; ++i)
+    {
+        soa.centerX[i] = spheres[i].center.x;
+        soa.centerY[i] = spheres[i].center.y;
+        soa.centerZ[i] = spheres[i].center.z;
+        soa.sqRadius[i] = spheres[i].radius * spheres[i].radius;
+        soa.invRadius[i] = 1.0f / spheres[i].radius;
+    }
+}
+
+// ground sphere plus random small ones around where the built-in scene has them, smaller when there are more
+static std::vector<Sphere> CreateRandomSpheres(int count, uint32_t& state)
+{
+    std::vector<Sphere> spheres(count);
+    spheres[0] = Sphere(float3(0, -100.5f, -1), 100);
+    float radiusScale = powf(1000.0f / count, 1.0f / 3.0f);
+    for (int i = 1; i < count; ++i)
+    {
+        float3 pos(RandomFloat01(state) * 16 - 8, RandomFloat01(state) * 2 - 0.5f, -RandomFloat01(state) * 12);
+        spheres[i] = Sphere(pos, (0.02f + RandomFloat01(state) * 0.2f) * radiusScale);
+    }
+    return spheres;
+}
+
+static void BenchScene(const char* name, const Sphere* spheres, int count, const std::vector<Ray>& rays)
+{
+    printf("HitSpheres, %s: %i spheres\n", name, count);
+    SpheresSoA soa(count);
+    FillSoA(soa, spheres);
+    SphereBvh bvh;
+    BuildBvh(bvh, soa);
+    // all spheres are slow on big scenes; fewer rays there
+    int rayCount = count > 10000 ? kInputCount / 64 : kInputCount;
+    Run("HitSpheres (all)", [&]() {
+        float sum = 0;
+        for (int i = 0; i < rayCount; ++i)
+        {
+            Hit hit;
+            sum += HitSpheres(rays[i], soa, kMinT, kMaxT, hit);
+        }
+        s_Sink = sum;
+    }, rayCount);
+    Run("HitBvh", [&]() {
+        float sum = 0;
+        for (int i = 0; i < kInputCount; ++i)
+        {
+            Hit hit;
+            sum += HitBvh(rays[i], bvh, kMinT, kMaxT, hit);
+        }
+        s_Sink = sum;
+    }, kInputCount);
+#if DO_BVH4
+    Run("HitBvh4", [&]() {
+        float sum = 0;
+        for (int i = 0; i < kInputCount; ++i)
+        {
+            Hit hit;
+            sum += HitBvh4(rays[i], bvh, kMinT, kMaxT, hit);
+        }
+        s_Sink = sum;
+    }, kInputCount);
+#endif
+}
+
+int main(int argc, char** argv)
+{
+    InitializeTest(1);
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strncmp(argv[i], "--reps=", 7) == 0)
+            s_Reps = std::max(1, atoi(argv[i] + 7));
+        else if (strncmp(argv[i], "--warmup=", 9) == 0)
+            s_Warmup = atoi(argv[i] + 9);
+        else if (strncmp(argv[i], "--kernels=", 10) == 0)
+            SelectKernels(argv[i] + 10);
+    }
+    UpdateTest(0.0f, 0, kBackbufferWidth, kBackbufferHeight, 0);
+    printf("%s kernels, %i warmup + %i measured repetitions\n", GetKernelLevelName(GetKernelLevel()), s_Warmup, s_Reps);
+
+    // fixed inputs
+    uint32_t state = 1;
+    std::vector<float> us(kInputCount), vs(kInputCount);
+    std::vector<Ray> rays(kInputCount);
+    for (int i = 0; i < kInputCount; ++i)
+    {
+        us[i] = RandomFloat01(state);
+        vs[i] = RandomFloat01(state);
+        rays[i] = s_Cam.GetRay(us[i], vs[i], state);
+    }
+
+    printf("Sampling\n");
+    Run("Camera::GetRay", [&]() {
+        uint32_t st = 1;
+        float sum = 0;
+        for (int i = 0; i < kInputCount; ++i)
+            sum += s_Cam.GetRay(us[i], vs[i], st).dir.getX();
+        s_Sink = sum;
+    }, kInputCount);
+    Run("Camera::GetRay, lens sample", [&]() {
+        float sum = 0;
+        for (int i = 0; i < kInputCount; ++i)
+            sum += s_Cam.GetRay(us[i], vs[i], vs[i], us[i]).dir.getX();
+        s_Sink = sum;
+    }, kInputCount);
+    Run("2x RandomFloat01", [&]() {
+        uint32_t st = 1;
+        float sum = 0;
+        for (int i = 0; i < kInputCount; ++i)
+            sum += RandomFloat01(st) + RandomFloat01(st);
+        s_Sink = sum;
+    }, kInputCount);
+    Run("SobolOwen2D", [&]() {
+        float sum = 0;
+        for (int i = 0; i < kInputCount; ++i)
+        {
+            float u, v;
+            SobolOwen2D(uint32_t(i), PcgHash(uint32_t(i) >> 4), u, v);
+            sum += u + v;
+        }
+        s_Sink = sum;
+    }, kInputCount);
+    Run("RandomUnitVector", [&]() {
+        uint32_t st = 1;
+        float sum = 0;
+        for (int i = 0; i < kInputCount; ++i)
+            sum += RandomUnitVector(st).getX();
+        s_Sink = sum;
+    }, kInputCount);
+    Run("RandomInUnitSphere", [&]() {
+        uint32_t st = 1;
+        float sum = 0;
+        for (int i = 0; i < kInputCount; ++i)
+            sum += RandomInUnitSphere(st).getX();
+        s_Sink = sum;
+    }, kInputCount);
+
+    // camera ray hits on the built-in scene, scattered as if each surface was of the given type
+    std::vector<Ray> hitRays;
+    std::vector<Hit> hits;
+    for (const Ray& r : rays)
+    {
+        Hit hit;
+        int id;
+        if (HitWorld(r, kMinT, kMaxT, hit, id))
+        {
+            hitRays.push_back(r);
+            hits.push_back(hit);
+        }
+    }
+    printf("Scatter (%i hits)\n", (int)hits.size());
+    const Material kMats[] =
+    {
+        { Material::Lambert, float3(0.8f, 0.8f, 0.8f), float3(0,0,0), 0, 0 },
+        { Material::Metal, float3(0.4f, 0.8f, 0.4f), float3(0,0,0), 0.2f, 0 },
+        { Material::Dielectric, float3(0.4f, 0.4f, 0.4f), float3(0,0,0), 0, 1.5f },
+    };
+    // diffuse bounce direction: what Lambert Scatter used to do (direction towards a random point on the unit
+    // sphere tangent to the hit), and the cosine-weighted hemisphere sampling it does now
+    Run("Lambert, n+RandomUnitVector", [&]() {
+        uint32_t st = 1;
+        float sum = 0;
+        for (size_t i = 0; i < hits.size(); ++i)
+            sum += normalize(hits[i].normal + RandomUnitVector(st)).getX();
+        s_Sink = sum;
+    }, (int)hits.size());
+    Run("Lambert, cosine hemisphere", [&]() {
+        uint32_t st = 1;
+        float sum = 0;
+        for (size_t i = 0; i < hits.size(); ++i)
+        {
+            float u1 = RandomFloat01(st), u2 = RandomFloat01(st);
+            float pdf;
+            sum += normalize(SampleCosineHemisphere(hits[i].normal, u1, u2, pdf)).getX() + pdf;
+        }
+        s_Sink = sum;
+    }, (int)hits.size());
+    const char* kMatNames[] = { "Scatter Lambert", "Scatter Metal", "Scatter Dielectric" };
+    for (int m = 0; m < 3; ++m)
+    {
+        Run(kMatNames[m], [&]() {
+            uint32_t st = 1;
+            float sum = 0;
+            for (size_t i = 0; i < hits.size(); ++i)
+            {
+                float3 attenuation;
+                Ray scattered;
+                float pdf;
+                float u1 = RandomFloat01(st), u2 = RandomFloat01(st);
+                if (Scatter(kMats[m], hitRays[i], hits[i], u1, u2, attenuation, scattered, pdf, st))
+                    sum += scattered.dir.getX();
+            }
+            s_Sink = sum;
+        }, (int)hits.size());
+    }
+
+    BenchScene("built-in, first 8", s_Spheres, 8, rays);
+    BenchScene("built-in", s_Spheres, kSphereCount, rays);
+    std::vector<Sphere> spheres = CreateRandomSpheres(1000, state);
+    BenchScene("generated", spheres.data(), (int)spheres.size(), rays);
+    spheres = CreateRandomSpheres(100000, state);
+    BenchScene("generated", spheres.data(), (int)spheres.size(), rays);
+
+    ShutdownTest();
+    return 0;
+}
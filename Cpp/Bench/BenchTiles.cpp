@@ -0,0 +1,74 @@
+// Compares splitting the frame into ranges of rows against square tiles in various orders and
+// sizes (see SetTileScheduling), at several thread counts. Prints speed and how much frame
+// times vary between frames.
+//
+// Usage: BenchTiles [frames] [width] [height]
+
+#include "../Source/Config.h"
+#include "../Source/Test.h"
+#include "BenchUtil.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+struct Schedule
+{
+    const char* name;
+    int tileSize;
+    TileOrder order;
+};
+
+static const Schedule kSchedules[] =
+{
+    { "rows", 0, kTileOrderRows },
+    { "tiles16 rows", 16, kTileOrderRows },
+    { "tiles16 hilbert", 16, kTileOrderHilbert },
+    { "tiles32 hilbert", 32, kTileOrderHilbert },
+    { "tiles64 hilbert", 64, kTileOrderHilbert },
+    { "tiles32 morton", 32, kTileOrderMorton },
+};
+
+static const int kThreadCounts[] = { 1, 8, 32, 64 };
+
+int main(int argc, char** argv)
+{
+    int frames = argc > 1 ? atoi(argv[1]) : 8;
+    int width = argc > 2 ? atoi(argv[2]) : 640;
+    int height = argc > 3 ? atoi(argv[3]) : 360;
+    std::vector<float> backbuffer(width * height * 4);
+    std::vector<double> times(frames);
+
+    printf("%i frames %ix%i\n", frames, width, height);
+    for (int threads : kThreadCounts)
+    {
+        InitializeTest(threads);
+        UpdateTest(0.0f, 0, width, height, 0);
+        printf("%i threads\n", threads);
+        for (const Schedule& sched : kSchedules)
+        {
+            SetTileScheduling(sched.tileSize, sched.order);
+            RayStats stats;
+            DrawTest(0.0f, 0, width, height, backbuffer.data(), stats, 0); // warm up
+            long long totalRays = 0;
+            double totalTime = 0;
+            for (int frame = 0; frame < frames; ++frame)
+            {
+                double t0 = GetTimeSeconds();
+                DrawTest(0.0f, frame, width, height, backbuffer.data(), stats, 0);
+                times[frame] = GetTimeSeconds() - t0;
+                totalTime += times[frame];
+                totalRays += stats.TotalRays();
+            }
+            double mean = totalTime / frames;
+            double variance = 0;
+            for (double t : times)
+                variance += (t - mean) * (t - mean);
+            variance /= frames;
+            printf("  %-16s %7.2f Mrays/s  %8.2f ms/frame  stddev %6.2f ms (%4.1f%%)\n", sched.name,
+                totalRays / totalTime * 1.0e-6, mean * 1000.0, sqrt(variance) * 1000.0, sqrt(variance) / mean * 100.0);
+        }
+        ShutdownTest();
+    }
+    return 0;
+}
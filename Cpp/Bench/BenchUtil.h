@@ -0,0 +1,43 @@
+#pragma once
+
+#include <chrono>
+#include <math.h>
+
+inline double GetTimeSeconds()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// mean and 95% confidence interval half-width of some measurements
+struct BenchStats
+{
+    double mean;
+    double ci95;
+};
+
+// Runs func (which does callCount calls of the measured thing) warmupReps times without measuring,
+// then reps times measuring each. Returns nanoseconds per call.
+template<typename F>
+BenchStats MeasureNsPerCall(F func, int callCount, int warmupReps, int reps)
+{
+    for (int i = 0; i < warmupReps; ++i)
+        func();
+    double sum = 0, sumSq = 0;
+    for (int i = 0; i < reps; ++i)
+    {
+        double t0 = GetTimeSeconds();
+        func();
+        double ns = (GetTimeSeconds() - t0) * 1.0e9 / callCount;
+        sum += ns;
+        sumSq += ns * ns;
+    }
+    BenchStats res;
+    res.mean = sum / reps;
+    double variance = reps > 1 ? (sumSq - sum * sum / reps) / (reps - 1) : 0;
+    // Student's t for 95% two-sided, by degrees of freedom; 1.96 for many
+    static const double kT95[] = { 12.71, 4.30, 3.18, 2.78, 2.57, 2.45, 2.36, 2.31, 2.26, 2.23, 2.20, 2.18, 2.16, 2.14, 2.13, 2.12, 2.11, 2.10, 2.09, 2.09 };
+    int dof = reps - 1;
+    double t = dof < 1 ? 0 : dof <= 20 ? kT95[dof - 1] : dof <= 30 ? 2.05 : 1.96;
+    res.ci95 = t * sqrt(variance > 0 ? variance : 0) / sqrt((double)reps);
+    return res;
+}
@@ -0,0 +1,72 @@
+// Renders the built-in scene with the regular recursive tracer and with the wavefront one
+// (kFlagWavefront), and prints speed and average image color of each. Random numbers are used
+// in a different order, so the images are not identical, but their statistics should match.
+//
+// Usage: BenchWavefront [frames] [width] [height] [--kernels=<level>]
+
+#include "../Source/Config.h"
+#include "../Source/Maths.h"
+#include "../Source/Test.h"
+#include "../Source/Kernels.h"
+#include "BenchUtil.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+struct RenderResult
+{
+    double seconds;
+    long long rays;
+    double mean[3];
+};
+
+static RenderResult Render(int frames, int width, int height, unsigned flags)
+{
+    std::vector<float> backbuffer(width * height * 4, 0.0f);
+    RenderResult res = {};
+    for (int frame = 0; frame < frames; ++frame)
+    {
+        RayStats stats;
+        double t0 = GetTimeSeconds();
+        UpdateTest(0.0f, frame, width, height, flags);
+        DrawTest(0.0f, frame, width, height, backbuffer.data(), stats, flags);
+        res.seconds += GetTimeSeconds() - t0;
+        res.rays += stats.TotalRays();
+    }
+    for (int i = 0; i < width * height; ++i)
+        for (int c = 0; c < 3; ++c)
+            res.mean[c] += backbuffer[i * 4 + c];
+    for (int c = 0; c < 3; ++c)
+        res.mean[c] /= width * height;
+    return res;
+}
+
+static void Print(const char* name, const RenderResult& res, int frames)
+{
+    printf("%-10s %7.2f Mrays/s  %8.2f ms/frame  %6.2f Mrays/frame  mean %.5f %.5f %.5f\n", name,
+        res.rays / res.seconds * 1.0e-6, res.seconds * 1000.0 / frames, res.rays * 1.0e-6 / frames,
+        res.mean[0], res.mean[1], res.mean[2]);
+}
+
+int main(int argc, char** argv)
+{
+    InitializeTest();
+    int args[3] = { 8, 640, 360 };
+    int argIndex = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strncmp(argv[i], "--kernels=", 10) == 0)
+            SelectKernels(argv[i] + 10);
+        else if (argIndex < 3)
+            args[argIndex++] = atoi(argv[i]);
+    }
+    int frames = args[0], width = args[1], height = args[2];
+
+    printf("%i frames %ix%i, %s kernels\n", frames, width, height, GetKernelLevelName(GetKernelLevel()));
+    // progressive, so the mean color is over all frames
+    Print("recursive", Render(frames, width, height, kFlagProgressive), frames);
+    Print("wavefront", Render(frames, width, height, kFlagProgressive | kFlagWavefront), frames);
+    ShutdownTest();
+    return 0;
+}
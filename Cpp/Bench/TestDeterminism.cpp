@@ -0,0 +1,100 @@
+// Checks that rendered images are bit-identical no matter how the work is split up: thread counts,
+// rows or tiles of various sizes & orders. Renders a few progressive frames of each tracing mode
+// (path at a time with both samplers, wavefront, adaptive, and denoised) with every split, and compares
+// them against the first one.
+// Exit code is 1 if anything differs.
+//
+// Usage: TestDeterminism [frames] [width] [height]
+
+#include "../Source/Config.h"
+#include "../Source/Test.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+struct Split
+{
+    const char* name;
+    int threads;
+    int tileSize;
+    TileOrder order;
+};
+
+static const Split kSplits[] =
+{
+    { "1 thread, rows", 1, 0, kTileOrderRows },
+    { "1 thread, tiles32 hilbert", 1, 32, kTileOrderHilbert },
+    { "2 threads, rows", 2, 0, kTileOrderRows },
+    { "3 threads, tiles7 rows", 3, 7, kTileOrderRows },
+    { "4 threads, tiles16 morton", 4, 16, kTileOrderMorton },
+    { "5 threads, tiles32 hilbert", 5, 32, kTileOrderHilbert },
+};
+
+struct Mode
+{
+    const char* name;
+    unsigned flags;
+    Sampler sampler;
+    bool denoise; // compare DenoiseTest result instead of the backbuffer
+};
+
+static const Mode kModes[] =
+{
+    { "path at a time", kFlagProgressive, kSamplerSobol, false },
+    { "path at a time, random sampler", kFlagProgressive, kSamplerRandom, false },
+    { "wavefront", kFlagProgressive | kFlagWavefront, kSamplerSobol, false },
+    { "adaptive", kFlagProgressive | kFlagAdaptive, kSamplerSobol, false },
+    { "denoised", kFlagProgressive | kFlagAOVs, kSamplerSobol, true },
+};
+
+static void Render(const Split& split, const Mode& mode, int frames, int width, int height, std::vector<float>& backbuffer)
+{
+    InitializeTest(split.threads);
+    SetTileScheduling(split.tileSize, split.order);
+    SetSampler(mode.sampler);
+    memset(backbuffer.data(), 0, backbuffer.size() * sizeof(backbuffer[0]));
+    for (int frame = 0; frame < frames; ++frame)
+    {
+        RayStats stats;
+        UpdateTest(0.0f, frame, width, height, mode.flags);
+        DrawTest(0.0f, frame, width, height, backbuffer.data(), stats, mode.flags);
+    }
+    if (mode.denoise)
+    {
+        std::vector<float> noisy(backbuffer);
+        DenoiseTest(width, height, noisy.data(), backbuffer.data());
+    }
+    ShutdownTest();
+}
+
+int main(int argc, char** argv)
+{
+    // odd size, so that tiles & rows don't divide it evenly
+    int frames = argc > 1 ? atoi(argv[1]) : 4;
+    int width = argc > 2 ? atoi(argv[2]) : 123;
+    int height = argc > 3 ? atoi(argv[3]) : 67;
+    std::vector<float> reference(width * height * 4), backbuffer(width * height * 4);
+
+    printf("%i frames %ix%i\n", frames, width, height);
+    int failures = 0;
+    for (const Mode& mode : kModes)
+    {
+        printf("%s\n", mode.name);
+        Render(kSplits[0], mode, frames, width, height, reference);
+        for (size_t i = 1; i < sizeof(kSplits) / sizeof(kSplits[0]); ++i)
+        {
+            Render(kSplits[i], mode, frames, width, height, backbuffer);
+            int differ = 0;
+            for (size_t j = 0; j < backbuffer.size(); j += 4)
+                differ += memcmp(&backbuffer[j], &reference[j], 4 * sizeof(float)) != 0;
+            printf("  %-28s %s", kSplits[i].name, differ ? "FAIL" : "ok");
+            if (differ)
+                printf(": %i of %i pixels differ from '%s'", differ, width * height, kSplits[0].name);
+            printf("\n");
+            failures += differ != 0;
+        }
+    }
+    printf("%s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
@@ -1,3 +1,4 @@
 emcc -O3 -std=c++11 -s WASM=1 -s ALLOW_MEMORY_GROWTH=1 -s EXPORTED_RUNTIME_METHODS='["cwrap"]' \
 	-o toypathtracer.js \
-	main.cpp ../Source/Maths.cpp ../Source/Test.cpp
+	main.cpp ../Source/Maths.cpp ../Source/Test.cpp ../Source/Profiler.cpp ../Source/Bvh.cpp \
+	../Source/Kernels.cpp ../Source/KernelsBase.cpp ../Source/KernelsSSE41.cpp ../Source/KernelsAVX2.cpp ../Source/KernelsAVX512.cpp
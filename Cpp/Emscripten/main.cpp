@@ -20,13 +20,13 @@ extern "C" void destroy_buffer(uint8_t* p)
 
 static float* backbuffer;
 static int frameCount;
-static int rayCount;
+static RayStats stats;
 static unsigned flags = kFlagProgressive;
 
 EMSCRIPTEN_KEEPALIVE
 extern "C" int getRayCount()
 {
-    return rayCount;
+    return (int)stats.TotalRays();
 }
 
 EMSCRIPTEN_KEEPALIVE
@@ -57,7 +57,7 @@ extern "C" void render(uint8_t* screen, int width, int height, double time)
     timeS *= 0.2f;
 
     UpdateTest(timeS, frameCount, width, height, flags);
-    DrawTest(timeS, frameCount, width, height, backbuffer, rayCount, flags);
+    DrawTest(timeS, frameCount, width, height, backbuffer, stats, flags);
     ++frameCount;
 
     // We get a floating point, linear color space buffer result.
@@ -0,0 +1,111 @@
+#include "PerfCounters.h"
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static const struct { const char* name; uint32_t type; uint64_t config; } kCounterDescs[kPerfCounterCount] =
+{
+    { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "branches", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS },
+    { "branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { "l1d_misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+    { "llc_misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+    { "task_clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+};
+
+static int s_Fds[kPerfCounterCount] = { -1, -1, -1, -1, -1, -1, -1 };
+
+int PerfCountersOpen(char* outError, int errorSize)
+{
+    PerfCountersClose();
+    int count = 0;
+    int firstErrno = 0;
+    for (int i = 0; i < kPerfCounterCount; ++i)
+    {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = kCounterDescs[i].type;
+        attr.config = kCounterDescs[i].config;
+        attr.disabled = 1;
+        attr.inherit = 1; // count in threads created later too
+        attr.exclude_kernel = 1; // so that it works with perf_event_paranoid 2 (default on most distros)
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        // no group with a leader here: inherited counters can't be read as a group
+        s_Fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        if (s_Fds[i] >= 0)
+            ++count;
+        else if (firstErrno == 0)
+            firstErrno = errno;
+    }
+    if (count == 0 || !PerfCounterAvailable(kPerfCycles))
+    {
+        const char* hint = "";
+        if (firstErrno == EACCES || firstErrno == EPERM)
+            hint = " (check /proc/sys/kernel/perf_event_paranoid)";
+        else if (firstErrno == ENOENT || firstErrno == EOPNOTSUPP)
+            hint = " (no hardware counters, e.g. running in a VM?)";
+        snprintf(outError, errorSize, "perf_event_open: %s%s", strerror(firstErrno), hint);
+    }
+    return count;
+}
+
+void PerfCountersClose()
+{
+    for (int i = 0; i < kPerfCounterCount; ++i)
+    {
+        if (s_Fds[i] >= 0)
+            close(s_Fds[i]);
+        s_Fds[i] = -1;
+    }
+}
+
+bool PerfCounterAvailable(PerfCounter counter)
+{
+    return s_Fds[counter] >= 0;
+}
+
+const char* PerfCounterName(PerfCounter counter)
+{
+    return kCounterDescs[counter].name;
+}
+
+void PerfCountersStart()
+{
+    for (int i = 0; i < kPerfCounterCount; ++i)
+    {
+        if (s_Fds[i] < 0)
+            continue;
+        ioctl(s_Fds[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(s_Fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+void PerfCountersStop(PerfValues& outValues)
+{
+    for (int i = 0; i < kPerfCounterCount; ++i)
+    {
+        if (s_Fds[i] >= 0)
+            ioctl(s_Fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+    for (int i = 0; i < kPerfCounterCount; ++i)
+    {
+        if (s_Fds[i] < 0)
+            continue;
+        // value, time enabled, time running; summed over inherited (thread) counters by the kernel
+        uint64_t data[3];
+        if (read(s_Fds[i], data, sizeof(data)) != sizeof(data))
+            continue;
+        uint64_t value = data[0];
+        if (data[2] != 0 && data[2] < data[1])
+            value = (uint64_t)((double)value * data[1] / data[2]);
+        outValues.value[i] += value;
+        outValues.valid[i] = true;
+    }
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+
+// Hardware performance counters via Linux perf_event_open, counting in this process' threads.
+// Counters are opened with "inherit", so they have to be opened *before* the worker threads are
+// created (i.e. before InitializeTest); values read then are summed over all the threads.
+// Counters that can't be opened (no PMU in a VM, perf_event_paranoid too strict, ...) are just
+// reported as unavailable; user space only is counted.
+
+enum PerfCounter
+{
+    kPerfCycles,
+    kPerfInstructions,
+    kPerfBranches,
+    kPerfBranchMisses,
+    kPerfL1DMisses, // L1 data cache read misses
+    kPerfLLCMisses, // last level cache read misses
+    kPerfTaskClock, // software counter: CPU time of all threads, in nanoseconds
+    kPerfCounterCount
+};
+
+struct PerfValues
+{
+    PerfValues() { Clear(); }
+    void Clear()
+    {
+        for (int i = 0; i < kPerfCounterCount; ++i)
+        {
+            value[i] = 0;
+            valid[i] = false;
+        }
+    }
+    void Add(const PerfValues& o)
+    {
+        for (int i = 0; i < kPerfCounterCount; ++i)
+        {
+            value[i] += o.value[i];
+            valid[i] |= o.valid[i];
+        }
+    }
+    uint64_t value[kPerfCounterCount];
+    bool valid[kPerfCounterCount]; // false if the counter was not available
+};
+
+// Returns number of counters that could be opened; if zero, reason why is in outError
+int PerfCountersOpen(char* outError, int errorSize);
+void PerfCountersClose();
+bool PerfCounterAvailable(PerfCounter counter);
+const char* PerfCounterName(PerfCounter counter);
+
+// Counting is only on between Start and Stop; Stop adds counts since Start into outValues
+// (scaled up if kernel had to multiplex the counters).
+void PerfCountersStart();
+void PerfCountersStop(PerfValues& outValues);
@@ -0,0 +1,392 @@
+// Headless command line front end: renders some frames on the CPU, prints timing results
+// (as a single line of JSON, easy to parse by scripts), and optionally saves the result.
+//
+// Usage: ToyPathTracer [options]
+//   --frames=N         number of frames to render (default 16)
+//   --warmup=N         render this many frames first, without measuring (default 0)
+//   --size=WxH         resolution (default 1280x720)
+//   --threads=N        worker thread count, including the main thread (default: one per CPU core)
+//   --flags=a,b,...    any of animate, progressive, wavefront, adaptive; or "none" (default progressive)
+//   --tile=N           tile size for scheduling work, 0 for ranges of rows (default DO_TILE_SIZE)
+//   --roulette=N       Russian roulette for paths that did N or more bounces, -1 for none (default DO_RUSSIAN_ROULETTE_DEPTH)
+//   --lights=MODE[:K]  light sampling from diffuse hits: all (default; every light), or K (default 1) lights picked
+//                      by power, solidangle or bvh (see SetLightSampling)
+//   --mis=MODE         multiple importance sampling of lights: off, balance or power (default DO_MIS_HEURISTIC)
+//   --sampler=MODE     pixel, lens & bounce samples: random or sobol (default DO_SAMPLER)
+//   --kernels=LEVEL    base, sse4.1, avx2, avx512 (default: best the CPU can do)
+//   --denoise[=N]      after each frame, run DenoiseTest with N passes (default DO_DENOISE_PASSES) into a separate
+//                      buffer; its time is reported as denoise_ms, and not included in ms_per_frame
+//   --output=FILE.pfm  write the final linear color buffer (denoised one with --denoise) as a PFM image
+//   --trace=FILE.json  record what the threads do, and write it as Chrome trace JSON (open in ui.perfetto.dev)
+//   --trace-frames=A-B only write frames A..B into the trace, counting from 0 (default: all measured frames)
+//   --perf             count CPU cycles, instructions, cache & branch misses in DrawTest over all threads (via
+//                      perf_event_open), and report them per frame and per million rays
+//   --scaling          render with 1, 2, ... up to --threads threads (default: CPU core count), and print
+//                      speedup & parallel efficiency relative to one thread, and how long (ms/frame) each
+//                      thread was idle, waiting for others to finish
+
+#include "../Source/Config.h"
+#include "../Source/Test.h"
+#include "../Source/Kernels.h"
+#include "../Source/Profiler.h"
+#include "PerfCounters.h"
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+
+static double GetTimeSeconds()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool ParseFlags(const char* str, unsigned& outFlags)
+{
+    static const struct { const char* name; unsigned flag; } kNames[] =
+    {
+        { "animate", kFlagAnimate },
+        { "progressive", kFlagProgressive },
+        { "wavefront", kFlagWavefront },
+        { "adaptive", kFlagAdaptive },
+        { "none", 0 },
+    };
+    outFlags = 0;
+    while (*str)
+    {
+        size_t len = strcspn(str, ",");
+        bool found = false;
+        for (const auto& n : kNames)
+        {
+            if (strlen(n.name) == len && strncmp(str, n.name, len) == 0)
+            {
+                outFlags |= n.flag;
+                found = true;
+            }
+        }
+        if (!found)
+            return false;
+        str += len;
+        if (*str == ',')
+            ++str;
+    }
+    return true;
+}
+
+static const char* kMisNames[] = { "off", "balance", "power" };
+static const char* kSamplerNames[] = { "random", "sobol" };
+
+static std::string FlagsToString(unsigned flags)
+{
+    std::string res;
+    if (flags & kFlagAnimate) res += "animate,";
+    if (flags & kFlagProgressive) res += "progressive,";
+    if (flags & kFlagWavefront) res += "wavefront,";
+    if (flags & kFlagAdaptive) res += "adaptive,";
+    if (res.empty())
+        return "none";
+    res.pop_back();
+    return res;
+}
+
+// Portable float map: RGB floats, little endian (negative scale), rows bottom to top
+static bool WritePFM(const char* path, const float* backbuffer, int width, int height)
+{
+    FILE* f = fopen(path, "wb");
+    if (!f)
+        return false;
+    fprintf(f, "PF\n%i %i\n-1.0\n", width, height);
+    std::vector<float> row(width * 3);
+    for (int y = 0; y < height; ++y)
+    {
+        for (int x = 0; x < width; ++x)
+        {
+            row[x * 3 + 0] = backbuffer[(y * width + x) * 4 + 0];
+            row[x * 3 + 1] = backbuffer[(y * width + x) * 4 + 1];
+            row[x * 3 + 2] = backbuffer[(y * width + x) * 4 + 2];
+        }
+        fwrite(row.data(), sizeof(float), row.size(), f);
+    }
+    return fclose(f) == 0;
+}
+
+struct Options
+{
+    int frames = 16;
+    int warmup = 0;
+    int width = kBackbufferWidth, height = kBackbufferHeight;
+    int threads = 0;
+    int tileSize = DO_TILE_SIZE;
+    int roulette = DO_RUSSIAN_ROULETTE_DEPTH;
+    LightSampling lights = kLightSamplingAll;
+    int lightSamples = 1;
+    MisHeuristic mis = (MisHeuristic)DO_MIS_HEURISTIC;
+    Sampler sampler = (Sampler)DO_SAMPLER;
+    int denoisePasses = -1; // -1: no denoising
+    const char* lightsName = "all";
+    unsigned flags = kFlagProgressive;
+    bool scaling = false;
+    bool perf = false;
+    const char* kernels = NULL;
+    const char* output = NULL;
+    const char* trace = NULL;
+    int traceFirst = -1, traceLast = -1;
+};
+
+struct RunResult
+{
+    int threads;
+    double totalTime, minTime, maxTime;
+    double denoiseTime;
+    RayStats stats; // summed over frames
+    std::vector<double> idleTime; // per thread, summed over frames
+    PerfValues perf; // summed over frames
+};
+
+static std::string StatsToJson(const RayStats& st)
+{
+    std::string depth;
+    for (int i = 0; i < kRayStatsDepthBuckets; ++i)
+        depth += (i ? "," : "") + std::to_string(st.pathDepth[i]);
+    char buf[512];
+    snprintf(buf, sizeof(buf), "{\"primary\":%llu,\"bounce\":%llu,\"shadow\":%llu,\"shadow_occluded\":%llu,\"hits\":%llu,\"misses\":%llu,"
+        "\"disk_calls\":%llu,\"disk_iterations\":%llu,\"sphere_calls\":%llu,\"sphere_iterations\":%llu,\"path_depth\":[",
+        (unsigned long long)st.primaryRays, (unsigned long long)st.bounceRays, (unsigned long long)st.shadowRays, (unsigned long long)st.shadowRaysOccluded,
+        (unsigned long long)st.hits, (unsigned long long)st.misses,
+        (unsigned long long)st.diskCalls, (unsigned long long)st.diskIterations, (unsigned long long)st.sphereCalls, (unsigned long long)st.sphereIterations);
+    return buf + depth + "]}";
+}
+
+static std::string PerfToJson(const PerfValues& perf, int frames, uint64_t rays)
+{
+    std::string res = "{";
+    double mrays = rays * 1.0e-6;
+    for (int i = 0; i < kPerfCounterCount; ++i)
+    {
+        PerfCounter c = (PerfCounter)i;
+        char buf[128];
+        if (perf.valid[c])
+            snprintf(buf, sizeof(buf), "\"%s\":{\"per_frame\":%.0f,\"per_mray\":%.0f},", PerfCounterName(c), (double)perf.value[c] / frames, mrays > 0 ? perf.value[c] / mrays : 0.0);
+        else
+            snprintf(buf, sizeof(buf), "\"%s\":null,", PerfCounterName(c));
+        res += buf;
+    }
+    char buf[128];
+    if (perf.valid[kPerfCycles] && perf.valid[kPerfInstructions] && perf.value[kPerfCycles] > 0)
+        snprintf(buf, sizeof(buf), "\"ipc\":%.3f,", (double)perf.value[kPerfInstructions] / perf.value[kPerfCycles]);
+    else
+        snprintf(buf, sizeof(buf), "\"ipc\":null,");
+    res += buf;
+    if (perf.valid[kPerfBranches] && perf.valid[kPerfBranchMisses] && perf.value[kPerfBranches] > 0)
+        snprintf(buf, sizeof(buf), "\"branch_miss_rate\":%.5f}", (double)perf.value[kPerfBranchMisses] / perf.value[kPerfBranches]);
+    else
+        snprintf(buf, sizeof(buf), "\"branch_miss_rate\":null}");
+    return res + buf;
+}
+
+static RunResult Render(const Options& opt, int threads, std::vector<float>& backbuffer, std::vector<float>& denoised)
+{
+    // counters have to be there before worker threads are created, to be inherited by them
+    if (opt.perf)
+    {
+        static bool s_Reported = false;
+        char error[256];
+        if (PerfCountersOpen(error, sizeof(error)) == 0 || !PerfCounterAvailable(kPerfCycles))
+        {
+            if (!s_Reported)
+                fprintf(stderr, "Hardware counters not available: %s\n", error);
+            s_Reported = true;
+        }
+    }
+    InitializeTest(threads);
+    if (opt.kernels)
+        SelectKernels(opt.kernels);
+    SetTileScheduling(opt.tileSize, kTileOrderHilbert);
+    SetRussianRoulette(opt.roulette);
+    SetLightSampling(opt.lights, opt.lightSamples);
+    SetMisHeuristic(opt.mis);
+    SetSampler(opt.sampler);
+    ProfilerSetEnabled(opt.trace != NULL);
+
+    RunResult res;
+    res.threads = GetThreadCount();
+    res.totalTime = 0;
+    res.minTime = 1.0e30;
+    res.maxTime = 0;
+    res.denoiseTime = 0;
+    res.idleTime.resize(res.threads);
+    std::vector<double> busy(res.threads);
+    for (int frame = -opt.warmup; frame < opt.frames; ++frame)
+    {
+        // fixed time step, so that animated runs are repeatable
+        int frameIndex = frame + opt.warmup;
+        float t = frameIndex / 60.0f;
+        RayStats stats;
+        double t0 = GetTimeSeconds();
+        UpdateTest(t, frameIndex, opt.width, opt.height, opt.flags);
+        double t1 = GetTimeSeconds();
+        PerfValues perf;
+        if (opt.perf)
+            PerfCountersStart();
+        DrawTest(t, frameIndex, opt.width, opt.height, backbuffer.data(), stats, opt.flags);
+        if (opt.perf)
+            PerfCountersStop(perf);
+        double t2 = GetTimeSeconds();
+        if (opt.denoisePasses >= 0)
+            DenoiseTest(opt.width, opt.height, backbuffer.data(), denoised.data(), opt.denoisePasses);
+        double t3 = GetTimeSeconds();
+        if (frame < 0)
+            continue;
+        res.denoiseTime += t3 - t2;
+        double dt = t2 - t0;
+        res.totalTime += dt;
+        if (dt < res.minTime) res.minTime = dt;
+        if (dt > res.maxTime) res.maxTime = dt;
+        res.stats.Add(stats);
+        res.perf.Add(perf);
+        int count = GetThreadBusyTimes(busy.data(), res.threads);
+        for (int i = 0; i < count; ++i)
+            res.idleTime[i] += std::max(0.0, (t2 - t1) - busy[i]);
+    }
+    if (opt.trace)
+    {
+        // warm up frames are not included by default
+        int first = opt.traceFirst >= 0 ? opt.traceFirst : opt.warmup;
+        int last = opt.traceLast >= 0 ? opt.traceLast : opt.warmup + opt.frames - 1;
+        if (!ProfilerWriteChromeTrace(opt.trace, first, last))
+            fprintf(stderr, "Failed to write '%s'\n", opt.trace);
+    }
+    ShutdownTest();
+    if (opt.perf)
+        PerfCountersClose();
+    return res;
+}
+
+int main(int argc, char** argv)
+{
+    Options opt;
+    for (int i = 1; i < argc; ++i)
+    {
+        const char* arg = argv[i];
+        bool ok = true;
+        if (strncmp(arg, "--frames=", 9) == 0)
+            opt.frames = atoi(arg + 9);
+        else if (strncmp(arg, "--warmup=", 9) == 0)
+            opt.warmup = atoi(arg + 9);
+        else if (strncmp(arg, "--size=", 7) == 0)
+            ok = sscanf(arg + 7, "%ix%i", &opt.width, &opt.height) == 2;
+        else if (strncmp(arg, "--threads=", 10) == 0)
+            opt.threads = atoi(arg + 10);
+        else if (strncmp(arg, "--flags=", 8) == 0)
+            ok = ParseFlags(arg + 8, opt.flags);
+        else if (strncmp(arg, "--tile=", 7) == 0)
+            opt.tileSize = atoi(arg + 7);
+        else if (strncmp(arg, "--roulette=", 11) == 0)
+            opt.roulette = atoi(arg + 11);
+        else if (strncmp(arg, "--lights=", 9) == 0)
+        {
+            char mode[32] = "";
+            opt.lightsName = arg + 9;
+            opt.lightSamples = 1;
+            ok = sscanf(arg + 9, "%31[a-z]:%i", mode, &opt.lightSamples) >= 1;
+            if (strcmp(mode, "all") == 0) opt.lights = kLightSamplingAll;
+            else if (strcmp(mode, "power") == 0) opt.lights = kLightSamplingPower;
+            else if (strcmp(mode, "solidangle") == 0) opt.lights = kLightSamplingSolidAngle;
+            else if (strcmp(mode, "bvh") == 0) opt.lights = kLightSamplingBvh;
+            else ok = false;
+        }
+        else if (strncmp(arg, "--mis=", 6) == 0)
+        {
+            if (strcmp(arg + 6, "off") == 0) opt.mis = kMisOff;
+            else if (strcmp(arg + 6, "balance") == 0) opt.mis = kMisBalance;
+            else if (strcmp(arg + 6, "power") == 0) opt.mis = kMisPower;
+            else ok = false;
+        }
+        else if (strncmp(arg, "--sampler=", 10) == 0)
+        {
+            if (strcmp(arg + 10, "random") == 0) opt.sampler = kSamplerRandom;
+            else if (strcmp(arg + 10, "sobol") == 0) opt.sampler = kSamplerSobol;
+            else ok = false;
+        }
+        else if (strcmp(arg, "--perf") == 0)
+            opt.perf = true;
+        else if (strcmp(arg, "--scaling") == 0)
+            opt.scaling = true;
+        else if (strcmp(arg, "--denoise") == 0)
+            opt.denoisePasses = DO_DENOISE_PASSES;
+        else if (strncmp(arg, "--denoise=", 10) == 0)
+            opt.denoisePasses = atoi(arg + 10);
+        else if (strncmp(arg, "--kernels=", 10) == 0)
+            opt.kernels = arg + 10;
+        else if (strncmp(arg, "--output=", 9) == 0)
+            opt.output = arg + 9;
+        else if (strncmp(arg, "--trace=", 8) == 0)
+            opt.trace = arg + 8;
+        else if (strncmp(arg, "--trace-frames=", 15) == 0)
+            ok = sscanf(arg + 15, "%i-%i", &opt.traceFirst, &opt.traceLast) == 2;
+        else
+            ok = false;
+        if (!ok || opt.frames < 1 || opt.warmup < 0 || opt.width < 1 || opt.height < 1 || opt.threads < 0 || opt.tileSize < 0)
+        {
+            fprintf(stderr, "Invalid argument '%s'; see the top of Cpp/Linux/main.cpp for usage\n", arg);
+            return 1;
+        }
+    }
+
+    // denoiser needs the AOVs
+    if (opt.denoisePasses >= 0)
+        opt.flags |= kFlagAOVs;
+    std::vector<float> backbuffer(opt.width * opt.height * 4, 0.0f);
+    std::vector<float> denoised(opt.denoisePasses >= 0 ? backbuffer.size() : 0);
+    if (opt.scaling)
+    {
+        // same scene & frames with 1..N threads, one JSON line for each
+        int maxThreads = opt.threads > 0 ? opt.threads : (int)std::thread::hardware_concurrency();
+        double baseTime = 0;
+        for (int threads = 1; threads <= std::max(maxThreads, 1); ++threads)
+        {
+            RunResult res = Render(opt, threads, backbuffer, denoised);
+            double frameTime = res.totalTime / opt.frames;
+            if (threads == 1)
+                baseTime = frameTime;
+            double speedup = baseTime / frameTime;
+            std::string idle;
+            double idleSum = 0, idleMax = 0;
+            for (double t : res.idleTime)
+            {
+                double ms = t * 1000.0 / opt.frames;
+                char buf[32];
+                snprintf(buf, sizeof(buf), "%s%.3f", idle.empty() ? "" : ",", ms);
+                idle += buf;
+                idleSum += ms;
+                idleMax = std::max(idleMax, ms);
+            }
+            std::string perf = opt.perf ? ",\"perf\":" + PerfToJson(res.perf, opt.frames, res.stats.TotalRays()) : "";
+            printf("{\"threads\":%i,\"ms_per_frame\":%.3f,\"mrays_per_s\":%.3f,\"speedup\":%.3f,\"efficiency\":%.3f,"
+                "\"idle_ms_mean\":%.3f,\"idle_ms_max\":%.3f,\"idle_ms_per_thread\":[%s]%s}\n",
+                res.threads, frameTime * 1000.0, (double)res.stats.TotalRays() / res.totalTime * 1.0e-6, speedup, speedup / threads,
+                idleSum / res.threads, idleMax, idle.c_str(), perf.c_str());
+            fflush(stdout);
+        }
+        return 0;
+    }
+
+    RunResult res = Render(opt, opt.threads, backbuffer, denoised);
+    std::string perf = opt.perf ? ",\"perf\":" + PerfToJson(res.perf, opt.frames, res.stats.TotalRays()) : "";
+    printf("{\"frames\":%i,\"width\":%i,\"height\":%i,\"threads\":%i,\"kernels\":\"%s\",\"flags\":\"%s\",\"tile\":%i,\"roulette\":%i,\"lights\":\"%s\",\"mis\":\"%s\",\"sampler\":\"%s\",\"denoise\":%i,"
+        "\"ms_per_frame\":%.3f,\"denoise_ms\":%.3f,\"ms_min\":%.3f,\"ms_max\":%.3f,\"mrays_per_s\":%.3f,\"mrays_per_frame\":%.3f,\"rays_per_path\":%.3f,\"rays\":%s%s}\n",
+        opt.frames, opt.width, opt.height, res.threads, GetKernelLevelName(GetKernelLevel()), FlagsToString(opt.flags).c_str(), opt.tileSize, opt.roulette, opt.lightsName, kMisNames[opt.mis], kSamplerNames[opt.sampler], opt.denoisePasses,
+        res.totalTime * 1000.0 / opt.frames, res.denoiseTime * 1000.0 / opt.frames, res.minTime * 1000.0, res.maxTime * 1000.0, (double)res.stats.TotalRays() / res.totalTime * 1.0e-6, (double)res.stats.TotalRays() * 1.0e-6 / opt.frames,
+        (double)(res.stats.primaryRays + res.stats.bounceRays) / std::max<uint64_t>(res.stats.primaryRays, 1), StatsToJson(res.stats).c_str(), perf.c_str());
+
+    const std::vector<float>& image = opt.denoisePasses >= 0 ? denoised : backbuffer;
+    if (opt.output && !WritePFM(opt.output, image.data(), opt.width, opt.height))
+    {
+        fprintf(stderr, "Failed to write '%s'\n", opt.output);
+        return 1;
+    }
+    return 0;
+}
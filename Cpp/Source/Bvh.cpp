@@ -0,0 +1,984 @@
+#include "Bvh.h"
+#include <float.h>
+#include <string.h>
+#include <algorithm>
+
+SphereBvh::SphereBvh()
+: nodes(nullptr), nodeCount(0), nodeCapacity(0), maxDepth(0)
+#if CPU_CAN_DO_SIMD
+, nodes4(nullptr), node4Count(0), node4Capacity(0)
+#endif
+, leafSpheres(nullptr), leafIds(nullptr), leafIndices(nullptr)
+, buildIndices(nullptr), buildBounds(nullptr), buildCapacity(0)
+{
+}
+
+SphereBvh::~SphereBvh()
+{
+    delete[] nodes;
+#if CPU_CAN_DO_SIMD
+    delete[] nodes4;
+#endif
+    delete leafSpheres;
+    delete[] leafIds;
+    delete[] leafIndices;
+    delete[] buildIndices;
+    delete[] buildBounds;
+}
+
+
+struct BuildBox
+{
+    BuildBox() : bmin(FLT_MAX, FLT_MAX, FLT_MAX), bmax(-FLT_MAX, -FLT_MAX, -FLT_MAX) {}
+    void Grow(const float* mn, const float* mx)
+    {
+        bmin.x = std::min(bmin.x, mn[0]); bmin.y = std::min(bmin.y, mn[1]); bmin.z = std::min(bmin.z, mn[2]);
+        bmax.x = std::max(bmax.x, mx[0]); bmax.y = std::max(bmax.y, mx[1]); bmax.z = std::max(bmax.z, mx[2]);
+    }
+    void Grow(const BuildBox& b) { Grow(&b.bmin.x, &b.bmax.x); }
+    float Area() const
+    {
+        float dx = bmax.x - bmin.x, dy = bmax.y - bmin.y, dz = bmax.z - bmin.z;
+        if (dx < 0) return 0.0f;
+        return dx * dy + dy * dz + dz * dx;
+    }
+    float3pack bmin, bmax;
+};
+
+struct BuildState
+{
+    SphereBvh* bvh;
+    int* indices;
+    const float* bounds; // per sphere: min xyz, max xyz
+    int leafSphereCount;
+};
+
+// SAH costs are in "one SIMD sphere test" units; leaves are processed kSimdWidth spheres at a time
+const float kSahTraversalCost = 1.0f;
+static float SahLeafCost(int count) { return float((count + kSimdWidth - 1) / kSimdWidth); }
+
+static const float* SphereMin(const BuildState& st, int index) { return st.bounds + st.indices[index] * 6; }
+static const float* SphereMax(const BuildState& st, int index) { return st.bounds + st.indices[index] * 6 + 3; }
+static float SphereCentroid(const BuildState& st, int index, int axis) { return 0.5f * (SphereMin(st, index)[axis] + SphereMax(st, index)[axis]); }
+
+static void MakeLeaf(BuildState& st, BvhNode& node, int start, int count)
+{
+    node.leftOrStart = start; // index into "indices" for now, remapped into padded leaf data after the build
+    node.count = count;
+    st.leafSphereCount += (count + kSimdWidth - 1) / kSimdWidth * kSimdWidth;
+}
+
+// smallest n such that 2^n >= count
+static int CeilLog2(int count)
+{
+    int n = 0;
+    while ((1 << n) < count)
+        ++n;
+    return n;
+}
+
+// Nodes keep to depth + CeilLog2(count) <= kBvhMaxDepth: splits in half can always finish the subtree within
+// that, so whenever an SAH split would leave a child with too many spheres for its depth, that is what we do.
+static void BuildNode(BuildState& st, int nodeIndex, int start, int count, int depth)
+{
+    SphereBvh& bvh = *st.bvh;
+
+    BuildBox box, centroidBox;
+    for (int i = start; i < start + count; ++i)
+    {
+        box.Grow(SphereMin(st, i), SphereMax(st, i));
+        float c[3] = { SphereCentroid(st, i, 0), SphereCentroid(st, i, 1), SphereCentroid(st, i, 2) };
+        centroidBox.Grow(c, c);
+    }
+    BvhNode& node = bvh.nodes[nodeIndex];
+    node.boundsMin = box.bmin;
+    node.boundsMax = box.bmax;
+
+    st.bvh->maxDepth = std::max(st.bvh->maxDepth, depth);
+    if (count == 1)
+    {
+        MakeLeaf(st, node, start, count);
+        return;
+    }
+
+    // evaluate binned SAH split candidates along all axes
+    float bestCost = FLT_MAX;
+    int bestAxis = -1, bestSplit = 0;
+    const float* cmin = &centroidBox.bmin.x;
+    const float* cmax = &centroidBox.bmax.x;
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        float extent = cmax[axis] - cmin[axis];
+        float binScale = kBvhBinCount / extent;
+        // (an extent of a few denormals would make the scale infinite, and bin indices NaN)
+        if (extent <= 0.0f || binScale > FLT_MAX)
+            continue;
+
+        BuildBox binBoxes[kBvhBinCount];
+        int binCounts[kBvhBinCount] = {};
+        for (int i = start; i < start + count; ++i)
+        {
+            int bin = std::min(kBvhBinCount - 1, int((SphereCentroid(st, i, axis) - cmin[axis]) * binScale));
+            binCounts[bin]++;
+            binBoxes[bin].Grow(SphereMin(st, i), SphereMax(st, i));
+        }
+
+        // sweep from the right to get areas & counts of all possible right sides
+        float rightArea[kBvhBinCount];
+        int rightCount[kBvhBinCount];
+        BuildBox acc;
+        int accCount = 0;
+        for (int b = kBvhBinCount - 1; b > 0; --b)
+        {
+            acc.Grow(binBoxes[b]);
+            accCount += binCounts[b];
+            rightArea[b] = acc.Area();
+            rightCount[b] = accCount;
+        }
+        // and sweep from the left, evaluating the cost of splitting before each bin
+        acc = BuildBox();
+        accCount = 0;
+        for (int b = 1; b < kBvhBinCount; ++b)
+        {
+            acc.Grow(binBoxes[b - 1]);
+            accCount += binCounts[b - 1];
+            if (accCount == 0 || rightCount[b] == 0)
+                continue;
+            float cost = acc.Area() * SahLeafCost(accCount) + rightArea[b] * SahLeafCost(rightCount[b]);
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = b;
+            }
+        }
+    }
+
+    float nodeArea = box.Area();
+    float splitCost = nodeArea > 0.0f ? kSahTraversalCost + bestCost / nodeArea : FLT_MAX;
+    if (count <= kBvhMaxLeafSize && (bestAxis == -1 || SahLeafCost(count) <= splitCost))
+    {
+        MakeLeaf(st, node, start, count);
+        return;
+    }
+
+    int mid = -1;
+    if (bestAxis != -1)
+    {
+        // partition spheres by the chosen bin
+        float binScale = kBvhBinCount / (cmax[bestAxis] - cmin[bestAxis]);
+        int* first = st.indices + start;
+        int* last = st.indices + start + count;
+        int* pivot = std::partition(first, last, [&](int idx)
+        {
+            float c = 0.5f * (st.bounds[idx * 6 + bestAxis] + st.bounds[idx * 6 + 3 + bestAxis]);
+            return std::min(kBvhBinCount - 1, int((c - cmin[bestAxis]) * binScale)) < bestSplit;
+        });
+        mid = int(pivot - st.indices);
+        if (depth + 1 + CeilLog2(std::max(mid - start, start + count - mid)) > kBvhMaxDepth)
+            mid = -1;
+    }
+    if (mid == -1)
+    {
+        // no SAH split (e.g. all centroids are in the same spot), or it would make the tree too deep:
+        // split in half along the longest axis
+        int axis = 0;
+        for (int a = 1; a < 3; ++a)
+        {
+            if (cmax[a] - cmin[a] > cmax[axis] - cmin[axis])
+                axis = a;
+        }
+        mid = start + count / 2;
+        std::nth_element(st.indices + start, st.indices + mid, st.indices + start + count, [&](int a, int b)
+        {
+            return st.bounds[a * 6 + axis] + st.bounds[a * 6 + 3 + axis] < st.bounds[b * 6 + axis] + st.bounds[b * 6 + 3 + axis];
+        });
+    }
+
+    int left = bvh.nodeCount;
+    bvh.nodeCount += 2;
+    node.leftOrStart = left;
+    node.count = 0;
+    BuildNode(st, left, start, mid - start, depth + 1);
+    BuildNode(st, left + 1, mid, start + count - mid, depth + 1);
+}
+
+
+#if CPU_CAN_DO_SIMD
+static float NodeArea(const BvhNode& node)
+{
+    float dx = node.boundsMax.x - node.boundsMin.x, dy = node.boundsMax.y - node.boundsMin.y, dz = node.boundsMax.z - node.boundsMin.z;
+    return dx * dy + dy * dz + dz * dx;
+}
+
+// Turns the binary node (and the ones below it) into 4-wide node(s); returns index of the new node
+static int CollapseNode(SphereBvh& bvh, int nodeIndex)
+{
+    // start with the children of the node, and keep on replacing the largest inner child
+    // with its own two children while there's space
+    int children[4];
+    int childCount = 0;
+    const BvhNode& node = bvh.nodes[nodeIndex];
+    if (node.count != 0)
+    {
+        children[childCount++] = nodeIndex;
+    }
+    else
+    {
+        children[childCount++] = node.leftOrStart;
+        children[childCount++] = node.leftOrStart + 1;
+    }
+    while (childCount < 4)
+    {
+        int largest = -1;
+        float largestArea = -1.0f;
+        for (int i = 0; i < childCount; ++i)
+        {
+            const BvhNode& c = bvh.nodes[children[i]];
+            if (c.count == 0 && NodeArea(c) > largestArea)
+            {
+                largest = i;
+                largestArea = NodeArea(c);
+            }
+        }
+        if (largest == -1)
+            break;
+        int left = bvh.nodes[children[largest]].leftOrStart;
+        children[largest] = left;
+        children[childCount++] = left + 1;
+    }
+
+    int index4 = bvh.node4Count++;
+    BvhNode4& node4 = bvh.nodes4[index4];
+    node4.childCount = childCount;
+    for (int i = 0; i < 4; ++i)
+    {
+        if (i < childCount)
+        {
+            const BvhNode& c = bvh.nodes[children[i]];
+            node4.boundsMinX[i] = c.boundsMin.x; node4.boundsMinY[i] = c.boundsMin.y; node4.boundsMinZ[i] = c.boundsMin.z;
+            node4.boundsMaxX[i] = c.boundsMax.x; node4.boundsMaxY[i] = c.boundsMax.y; node4.boundsMaxZ[i] = c.boundsMax.z;
+            node4.child[i] = c.leftOrStart;
+            node4.count[i] = c.count;
+        }
+        else
+        {
+            node4.boundsMinX[i] = node4.boundsMinY[i] = node4.boundsMinZ[i] = 0.0f;
+            node4.boundsMaxX[i] = node4.boundsMaxY[i] = node4.boundsMaxZ[i] = 0.0f;
+            node4.child[i] = -1;
+            node4.count[i] = 0;
+        }
+    }
+    for (int i = 0; i < childCount; ++i)
+    {
+        if (node4.count[i] == 0)
+            node4.child[i] = CollapseNode(bvh, children[i]);
+    }
+    return index4;
+}
+#endif // #if CPU_CAN_DO_SIMD
+
+
+void BuildBvh(SphereBvh& bvh, const SpheresSoA& spheres)
+{
+    int count = spheres.count;
+    if (bvh.buildCapacity < count)
+    {
+        delete[] bvh.buildIndices;
+        delete[] bvh.buildBounds;
+        delete[] bvh.leafIndices;
+        bvh.buildIndices = new int[count];
+        bvh.buildBounds = new float[count * 6];
+        bvh.leafIndices = new int[count];
+        bvh.buildCapacity = count;
+    }
+    int maxNodes = std::max(1, 2 * count - 1);
+    if (bvh.nodeCapacity < maxNodes)
+    {
+        delete[] bvh.nodes;
+        bvh.nodes = new BvhNode[maxNodes];
+        bvh.nodeCapacity = maxNodes;
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+        float r = sqrtf(spheres.sqRadius[i]);
+        float* b = bvh.buildBounds + i * 6;
+        b[0] = spheres.centerX[i] - r; b[1] = spheres.centerY[i] - r; b[2] = spheres.centerZ[i] - r;
+        b[3] = spheres.centerX[i] + r; b[4] = spheres.centerY[i] + r; b[5] = spheres.centerZ[i] + r;
+        bvh.buildIndices[i] = i;
+    }
+
+    BuildState st;
+    st.bvh = &bvh;
+    st.indices = bvh.buildIndices;
+    st.bounds = bvh.buildBounds;
+    st.leafSphereCount = 0;
+    bvh.nodeCount = 1;
+    bvh.maxDepth = 0;
+    if (count > kBvhMinSpheres)
+    {
+        BuildNode(st, 0, 0, count, 0);
+        assert(bvh.maxDepth <= kBvhMaxDepth);
+    }
+    else
+    {
+        BvhNode& root = bvh.nodes[0];
+        root.boundsMin = float3pack(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+        root.boundsMax = float3pack(FLT_MAX, FLT_MAX, FLT_MAX);
+        MakeLeaf(st, root, 0, count);
+    }
+
+    // copy sphere data into leaf order, padding each leaf to SIMD width
+    if (bvh.leafSpheres == nullptr || bvh.leafSpheres->count < st.leafSphereCount)
+    {
+        delete bvh.leafSpheres;
+        delete[] bvh.leafIds;
+        bvh.leafSpheres = new SpheresSoA(st.leafSphereCount);
+        bvh.leafIds = new int[bvh.leafSpheres->simdCount];
+    }
+    SpheresSoA& dst = *bvh.leafSpheres;
+    int dstIndex = 0;
+    for (int n = 0; n < bvh.nodeCount; ++n)
+    {
+        BvhNode& node = bvh.nodes[n];
+        if (node.count == 0)
+            continue;
+        int srcStart = node.leftOrStart;
+        int paddedCount = (node.count + kSimdWidth - 1) / kSimdWidth * kSimdWidth;
+        node.leftOrStart = dstIndex;
+        for (int i = 0; i < paddedCount; ++i, ++dstIndex)
+        {
+            if (i < node.count)
+            {
+                int src = st.indices[srcStart + i];
+                dst.centerX[dstIndex] = spheres.centerX[src];
+                dst.centerY[dstIndex] = spheres.centerY[src];
+                dst.centerZ[dstIndex] = spheres.centerZ[src];
+                dst.sqRadius[dstIndex] = spheres.sqRadius[src];
+                dst.invRadius[dstIndex] = spheres.invRadius[src];
+                bvh.leafIds[dstIndex] = src;
+                bvh.leafIndices[src] = dstIndex;
+            }
+            else
+            {
+                dst.centerX[dstIndex] = dst.centerY[dstIndex] = dst.centerZ[dstIndex] = 10000.0f;
+                dst.sqRadius[dstIndex] = 0.0f;
+                dst.invRadius[dstIndex] = 0.0f;
+                bvh.leafIds[dstIndex] = -1;
+            }
+        }
+        node.count = paddedCount;
+    }
+
+#if CPU_CAN_DO_SIMD
+    // each 4-wide node takes up at least two binary nodes, and there's one more for the root
+    int maxNodes4 = bvh.nodeCount / 2 + 1;
+    if (bvh.node4Capacity < maxNodes4)
+    {
+        delete[] bvh.nodes4;
+        bvh.nodes4 = new BvhNode4[maxNodes4];
+        bvh.node4Capacity = maxNodes4;
+    }
+    bvh.node4Count = 0;
+    CollapseNode(bvh, 0);
+#endif
+}
+
+
+// Returns distance at which the ray enters the box, or FLT_MAX if it misses it within [tMin,tMax]
+static VM_INLINE float HitBox(const BvhNode& node, const float3& rOrig, const float3& rInvDir, float tMin, float tMax)
+{
+#if DO_FLOAT3_WITH_SIMD
+    float3 t0 = (node.boundsMin.toFloat3() - rOrig) * rInvDir;
+    float3 t1 = (node.boundsMax.toFloat3() - rOrig) * rInvDir;
+    float tEnter = std::max(hmax(min(t0, t1)), tMin);
+    float tExit = std::min(hmin(max(t0, t1)), tMax);
+#else
+    float tx0 = (node.boundsMin.x - rOrig.x) * rInvDir.x, tx1 = (node.boundsMax.x - rOrig.x) * rInvDir.x;
+    float ty0 = (node.boundsMin.y - rOrig.y) * rInvDir.y, ty1 = (node.boundsMax.y - rOrig.y) * rInvDir.y;
+    float tz0 = (node.boundsMin.z - rOrig.z) * rInvDir.z, tz1 = (node.boundsMax.z - rOrig.z) * rInvDir.z;
+    float tEnter = std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)), std::max(std::min(tz0, tz1), tMin));
+    float tExit = std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)), std::min(std::max(tz0, tz1), tMax));
+#endif
+    return tEnter <= tExit ? tEnter : FLT_MAX;
+}
+
+static float SafeInverse(float v)
+{
+    // avoid infinities & NaNs in slab tests for axis-aligned rays
+    if (fabsf(v) < 1.0e-20f)
+        v = v < 0 ? -1.0e-20f : 1.0e-20f;
+    return 1.0f / v;
+}
+
+int HitBvh(const Ray& r, const SphereBvh& bvh, float tMin, float tMax, Hit& outHit)
+{
+    float3 rInvDir = float3(SafeInverse(r.dir.getX()), SafeInverse(r.dir.getY()), SafeInverse(r.dir.getZ()));
+    float hitT = tMax;
+    int hitId = -1;
+
+    // stack of nodes still to visit, along with distances where the ray enters them
+    int stack[kBvhStackSize];
+    float stackT[kBvhStackSize];
+    int stackSize = 0;
+    if (HitBox(bvh.nodes[0], r.orig, rInvDir, tMin, hitT) == FLT_MAX)
+        return -1;
+    int nodeIndex = 0;
+    while (true)
+    {
+        const BvhNode& node = bvh.nodes[nodeIndex];
+        if (node.count == 0)
+        {
+            // visit closer child first, remember the other one for later
+            int left = node.leftOrStart;
+            float tLeft = HitBox(bvh.nodes[left], r.orig, rInvDir, tMin, hitT);
+            float tRight = HitBox(bvh.nodes[left + 1], r.orig, rInvDir, tMin, hitT);
+            if (tLeft > tRight)
+            {
+                std::swap(tLeft, tRight);
+                left++;
+            }
+            int near = left;
+            int far = node.leftOrStart * 2 + 1 - left;
+            if (tLeft != FLT_MAX)
+            {
+                if (tRight != FLT_MAX)
+                {
+                    assert(stackSize < kBvhStackSize);
+                    stack[stackSize] = far;
+                    stackT[stackSize] = tRight;
+                    stackSize++;
+                }
+                nodeIndex = near;
+                continue;
+            }
+        }
+        else
+        {
+            int id = HitSpheresRange(r, *bvh.leafSpheres, node.leftOrStart, node.leftOrStart + node.count, tMin, hitT);
+            if (id != -1)
+                hitId = id;
+        }
+
+        // pop next node; skip ones that are further than the closest hit we already have
+        do
+        {
+            if (stackSize == 0)
+                goto done;
+            --stackSize;
+        } while (stackT[stackSize] >= hitT);
+        nodeIndex = stack[stackSize];
+    }
+done:
+    if (hitId == -1)
+        return -1;
+    SetSphereHit(r, *bvh.leafSpheres, hitId, hitT, outHit);
+    return bvh.leafIds[hitId];
+}
+
+
+#if CPU_CAN_DO_SIMD
+int HitBvh4(const Ray& r, const SphereBvh& bvh, float tMin, float tMax, Hit& outHit)
+{
+    float4 rOrigX = float4(r.orig.getX()), rOrigY = float4(r.orig.getY()), rOrigZ = float4(r.orig.getZ());
+    float4 rInvDirX = float4(SafeInverse(r.dir.getX())), rInvDirY = float4(SafeInverse(r.dir.getY())), rInvDirZ = float4(SafeInverse(r.dir.getZ()));
+    float4 tMin4 = float4(tMin);
+    float hitT = tMax;
+    int hitId = -1;
+
+    // whole scene is a single leaf?
+    if (bvh.nodes[0].count != 0)
+    {
+        hitId = HitSpheresRange(r, *bvh.leafSpheres, 0, bvh.nodes[0].count, tMin, hitT);
+        if (hitId == -1)
+            return -1;
+        SetSphereHit(r, *bvh.leafSpheres, hitId, hitT, outHit);
+        return bvh.leafIds[hitId];
+    }
+
+    // stack of nodes/leaves still to visit, along with distances where the ray enters them
+    struct StackEntry { int child; int count; float t; };
+    StackEntry stack[kBvhStackSize];
+    int stackSize = 0;
+    int nodeIndex = 0;
+    while (true)
+    {
+        // test ray against bounds of all 4 children at once
+        const BvhNode4& node = bvh.nodes4[nodeIndex];
+        float4 t0x = (float4(node.boundsMinX) - rOrigX) * rInvDirX, t1x = (float4(node.boundsMaxX) - rOrigX) * rInvDirX;
+        float4 t0y = (float4(node.boundsMinY) - rOrigY) * rInvDirY, t1y = (float4(node.boundsMaxY) - rOrigY) * rInvDirY;
+        float4 t0z = (float4(node.boundsMinZ) - rOrigZ) * rInvDirZ, t1z = (float4(node.boundsMaxZ) - rOrigZ) * rInvDirZ;
+        float4 tEnter = max(max(min(t0x, t1x), min(t0y, t1y)), max(min(t0z, t1z), tMin4));
+        float4 tExit = min(min(max(t0x, t1x), max(t0y, t1y)), min(max(t0z, t1z), float4(hitT)));
+        unsigned hitMask = mask(tEnter <= tExit) & ((1 << node.childCount) - 1);
+
+        // push hit children so that the closest one ends up on top of the stack
+        if (hitMask != 0)
+        {
+            float tEnterScalar[4];
+            float4 v = tEnter;
+            tEnterScalar[0] = v.getX(); tEnterScalar[1] = v.getY(); tEnterScalar[2] = v.getZ(); tEnterScalar[3] = v.getW();
+            int stackBase = stackSize;
+            for (int i = 0; i < 4; ++i)
+            {
+                if (!(hitMask & (1 << i)))
+                    continue;
+                StackEntry e = { node.child[i], node.count[i], tEnterScalar[i] };
+                int j = stackSize++;
+                assert(stackSize <= kBvhStackSize);
+                while (j > stackBase && stack[j - 1].t < e.t)
+                {
+                    stack[j] = stack[j - 1];
+                    --j;
+                }
+                stack[j] = e;
+            }
+        }
+
+        // pop next inner node, intersecting leaves on the way; skip entries that are further than the closest hit
+        nodeIndex = -1;
+        while (stackSize > 0)
+        {
+            const StackEntry& e = stack[--stackSize];
+            if (e.t >= hitT)
+                continue;
+            if (e.count == 0)
+            {
+                nodeIndex = e.child;
+                break;
+            }
+            int id = HitSpheresRange(r, *bvh.leafSpheres, e.child, e.child + e.count, tMin, hitT);
+            if (id != -1)
+                hitId = id;
+        }
+        if (nodeIndex == -1)
+            break;
+    }
+
+    if (hitId == -1)
+        return -1;
+    SetSphereHit(r, *bvh.leafSpheres, hitId, hitT, outHit);
+    return bvh.leafIds[hitId];
+}
+#endif // #if CPU_CAN_DO_SIMD
+
+
+// Returns bit mask of packet rays that enter the box before their current closest hit,
+// and the smallest distance at which any of them enters it
+static unsigned HitBoxPacket(const BvhNode& node, const RayPacket& rays, const float* invDir, float tMin, const float* tMax, float& outTEnter)
+{
+#if defined(__AVX2__)
+    // all 8 rays of the packet at once, straight from the SoA arrays
+    float8 t0x = (float8(node.boundsMin.x) - float8(rays.origX)) * float8(invDir), t1x = (float8(node.boundsMax.x) - float8(rays.origX)) * float8(invDir);
+    float8 t0y = (float8(node.boundsMin.y) - float8(rays.origY)) * float8(invDir + kRayPacketSize), t1y = (float8(node.boundsMax.y) - float8(rays.origY)) * float8(invDir + kRayPacketSize);
+    float8 t0z = (float8(node.boundsMin.z) - float8(rays.origZ)) * float8(invDir + kRayPacketSize * 2), t1z = (float8(node.boundsMax.z) - float8(rays.origZ)) * float8(invDir + kRayPacketSize * 2);
+    float8 tEnter = max(max(min(t0x, t1x), min(t0y, t1y)), max(min(t0z, t1z), float8(tMin)));
+    float8 tExit = min(min(max(t0x, t1x), max(t0y, t1y)), min(max(t0z, t1z), float8(tMax)));
+    bool8 hit = tEnter <= tExit;
+    outTEnter = hmin(select(float8(FLT_MAX), tEnter, hit));
+    return mask(hit);
+#elif CPU_CAN_DO_SIMD
+    // two halves of 4 rays each
+    unsigned hitMask = 0;
+    float4 tEnterMin = float4(FLT_MAX);
+    for (int i = 0; i < kRayPacketSize; i += 4)
+    {
+        float4 t0x = (float4(node.boundsMin.x) - float4(rays.origX + i)) * float4(invDir + i), t1x = (float4(node.boundsMax.x) - float4(rays.origX + i)) * float4(invDir + i);
+        float4 t0y = (float4(node.boundsMin.y) - float4(rays.origY + i)) * float4(invDir + kRayPacketSize + i), t1y = (float4(node.boundsMax.y) - float4(rays.origY + i)) * float4(invDir + kRayPacketSize + i);
+        float4 t0z = (float4(node.boundsMin.z) - float4(rays.origZ + i)) * float4(invDir + kRayPacketSize * 2 + i), t1z = (float4(node.boundsMax.z) - float4(rays.origZ + i)) * float4(invDir + kRayPacketSize * 2 + i);
+        float4 tEnter = max(max(min(t0x, t1x), min(t0y, t1y)), max(min(t0z, t1z), float4(tMin)));
+        float4 tExit = min(min(max(t0x, t1x), max(t0y, t1y)), min(max(t0z, t1z), float4(tMax + i)));
+        bool4 hit = tEnter <= tExit;
+        tEnterMin = min(tEnterMin, select(float4(FLT_MAX), tEnter, hit));
+        hitMask |= mask(hit) << i;
+    }
+    outTEnter = hmin(tEnterMin);
+    return hitMask;
+#else
+    unsigned hitMask = 0;
+    outTEnter = FLT_MAX;
+    for (int i = 0; i < kRayPacketSize; ++i)
+    {
+        float3 orig(rays.origX[i], rays.origY[i], rays.origZ[i]);
+        float3 rInvDir(invDir[i], invDir[i + kRayPacketSize], invDir[i + kRayPacketSize * 2]);
+        float t = HitBox(node, orig, rInvDir, tMin, tMax[i]);
+        if (t != FLT_MAX)
+        {
+            hitMask |= 1 << i;
+            outTEnter = std::min(outTEnter, t);
+        }
+    }
+    return hitMask;
+#endif
+}
+
+unsigned HitBvhPacket(const RayPacket& rays, const SphereBvh& bvh, float tMin, float tMax, Hit* outHits, int* outIDs)
+{
+    float hitT[kRayPacketSize];
+    int hitId[kRayPacketSize];
+    float invDir[kRayPacketSize * 3];
+    for (int i = 0; i < kRayPacketSize; ++i)
+    {
+        hitT[i] = tMax;
+        hitId[i] = -1;
+        invDir[i] = SafeInverse(rays.dirX[i]);
+        invDir[i + kRayPacketSize] = SafeInverse(rays.dirY[i]);
+        invDir[i + kRayPacketSize * 2] = SafeInverse(rays.dirZ[i]);
+    }
+
+    // whole scene is a single leaf?
+    if (bvh.nodes[0].count != 0)
+    {
+        HitSpheresPacketRange(rays, *bvh.leafSpheres, 0, bvh.nodes[0].count, tMin, hitT, hitId);
+    }
+    else
+    {
+        // stack of nodes still to visit; near child (for the packet as a whole) goes first
+        int stack[kBvhStackSize];
+        int stackSize = 0;
+        stack[stackSize++] = 0;
+        while (stackSize > 0)
+        {
+            const BvhNode& node = bvh.nodes[stack[--stackSize]];
+            if (node.count != 0)
+            {
+                HitSpheresPacketRange(rays, *bvh.leafSpheres, node.leftOrStart, node.leftOrStart + node.count, tMin, hitT, hitId);
+                continue;
+            }
+            int left = node.leftOrStart;
+            float tLeft, tRight;
+            unsigned maskLeft = HitBoxPacket(bvh.nodes[left], rays, invDir, tMin, hitT, tLeft);
+            unsigned maskRight = HitBoxPacket(bvh.nodes[left + 1], rays, invDir, tMin, hitT, tRight);
+            assert(stackSize + 2 <= kBvhStackSize);
+            if (tLeft <= tRight)
+            {
+                if (maskRight) stack[stackSize++] = left + 1;
+                if (maskLeft) stack[stackSize++] = left;
+            }
+            else
+            {
+                if (maskLeft) stack[stackSize++] = left;
+                if (maskRight) stack[stackSize++] = left + 1;
+            }
+        }
+    }
+
+    unsigned hitMask = 0;
+    for (int i = 0; i < kRayPacketSize; ++i)
+    {
+        outIDs[i] = -1;
+        if (hitId[i] == -1)
+            continue;
+        SetSphereHit(rays.Get(i), *bvh.leafSpheres, hitId[i], hitT[i], outHits[i]);
+        outIDs[i] = bvh.leafIds[hitId[i]];
+        hitMask |= 1 << i;
+    }
+    return hitMask;
+}
+
+
+bool OccludedBvh(const Ray& r, const SphereBvh& bvh, float tMin, float tMax, int ignoreID)
+{
+    float3 rInvDir = float3(SafeInverse(r.dir.getX()), SafeInverse(r.dir.getY()), SafeInverse(r.dir.getZ()));
+    int ignoreIndex = ignoreID >= 0 ? bvh.leafIndices[ignoreID] : -1;
+
+    // any hit will do, so no need to visit nodes in any particular order
+    int stack[kBvhStackSize];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize > 0)
+    {
+        const BvhNode& node = bvh.nodes[stack[--stackSize]];
+        if (HitBox(node, r.orig, rInvDir, tMin, tMax) == FLT_MAX)
+            continue;
+        if (node.count == 0)
+        {
+            assert(stackSize + 2 <= kBvhStackSize);
+            stack[stackSize++] = node.leftOrStart + 1;
+            stack[stackSize++] = node.leftOrStart;
+        }
+        else if (OccludedSpheresRange(r, *bvh.leafSpheres, node.leftOrStart, node.leftOrStart + node.count, tMin, tMax, ignoreIndex))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+#if CPU_CAN_DO_SIMD
+bool OccludedBvh4(const Ray& r, const SphereBvh& bvh, float tMin, float tMax, int ignoreID)
+{
+    int ignoreIndex = ignoreID >= 0 ? bvh.leafIndices[ignoreID] : -1;
+
+    // whole scene is a single leaf?
+    if (bvh.nodes[0].count != 0)
+        return OccludedSpheresRange(r, *bvh.leafSpheres, 0, bvh.nodes[0].count, tMin, tMax, ignoreIndex);
+
+    float4 rOrigX = float4(r.orig.getX()), rOrigY = float4(r.orig.getY()), rOrigZ = float4(r.orig.getZ());
+    float4 rInvDirX = float4(SafeInverse(r.dir.getX())), rInvDirY = float4(SafeInverse(r.dir.getY())), rInvDirZ = float4(SafeInverse(r.dir.getZ()));
+    float4 tMin4 = float4(tMin), tMax4 = float4(tMax);
+
+    // any hit will do, so children are visited in whatever order; leaves are tested right away
+    int stack[kBvhStackSize];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize > 0)
+    {
+        const BvhNode4& node = bvh.nodes4[stack[--stackSize]];
+        float4 t0x = (float4(node.boundsMinX) - rOrigX) * rInvDirX, t1x = (float4(node.boundsMaxX) - rOrigX) * rInvDirX;
+        float4 t0y = (float4(node.boundsMinY) - rOrigY) * rInvDirY, t1y = (float4(node.boundsMaxY) - rOrigY) * rInvDirY;
+        float4 t0z = (float4(node.boundsMinZ) - rOrigZ) * rInvDirZ, t1z = (float4(node.boundsMaxZ) - rOrigZ) * rInvDirZ;
+        float4 tEnter = max(max(min(t0x, t1x), min(t0y, t1y)), max(min(t0z, t1z), tMin4));
+        float4 tExit = min(min(max(t0x, t1x), max(t0y, t1y)), min(max(t0z, t1z), tMax4));
+        unsigned hitMask = mask(tEnter <= tExit) & ((1 << node.childCount) - 1);
+        while (hitMask != 0)
+        {
+            int i = firstLane(hitMask);
+            hitMask &= hitMask - 1;
+            if (node.count[i] == 0)
+            {
+                assert(stackSize < kBvhStackSize);
+                stack[stackSize++] = node.child[i];
+            }
+            else if (OccludedSpheresRange(r, *bvh.leafSpheres, node.child[i], node.child[i] + node.count[i], tMin, tMax, ignoreIndex))
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+#endif // #if CPU_CAN_DO_SIMD
+
+
+LightBvh::LightBvh()
+: nodes(nullptr), parents(nullptr), nodeCount(0), nodeCapacity(0), lightLeaves(nullptr)
+, buildIndices(nullptr), buildCapacity(0)
+{
+}
+
+LightBvh::~LightBvh()
+{
+    delete[] nodes;
+    delete[] parents;
+    delete[] lightLeaves;
+    delete[] buildIndices;
+}
+
+// smallest cone that contains both cones (approximately)
+static LightCone ConeUnion(const LightCone& coneA, const LightCone& coneB)
+{
+    const LightCone& a = coneA.thetaO >= coneB.thetaO ? coneA : coneB;
+    const LightCone& b = coneA.thetaO >= coneB.thetaO ? coneB : coneA;
+    float3 axisA = a.axis.toFloat3(), axisB = b.axis.toFloat3();
+    float thetaD = acosf(std::min(std::max(dot(axisA, axisB), -1.0f), 1.0f));
+    LightCone res;
+    res.axis = a.axis;
+    res.thetaE = std::max(a.thetaE, b.thetaE);
+    res.thetaO = a.thetaO;
+    if (std::min(thetaD + b.thetaO, kPI) <= a.thetaO)
+        return res; // b is inside a
+    float thetaO = (a.thetaO + thetaD + b.thetaO) * 0.5f;
+    if (thetaO >= kPI)
+    {
+        res.thetaO = kPI;
+        return res;
+    }
+    // rotate axis of a towards b, by as much as the cone gets wider
+    float thetaR = thetaO - a.thetaO;
+    float3 ortho = axisB - axisA * dot(axisA, axisB);
+    if (sqLength(ortho) > 1.0e-12f)
+        res.axis = axisA * cosf(thetaR) + normalize(ortho) * sinf(thetaR);
+    res.thetaO = thetaO;
+    return res;
+}
+
+static void BuildLightNode(LightBvh& bvh, const Sphere* spheres, const int* lightIDs, const float* power, int nodeIndex, int start, int count)
+{
+    LightBvhNode& node = bvh.nodes[nodeIndex];
+    int* indices = bvh.buildIndices;
+    if (count == 1)
+    {
+        int light = indices[start];
+        const Sphere& s = spheres[lightIDs[light]];
+        float3 c(s.center.x, s.center.y, s.center.z);
+        node.boundsMin = c - float3(s.radius, s.radius, s.radius);
+        node.boundsMax = c + float3(s.radius, s.radius, s.radius);
+        node.leftOrLight = light;
+        node.isLeaf = 1;
+        bvh.lightLeaves[light] = nodeIndex;
+        node.cone.axis = float3pack(0, 1, 0);
+        node.cone.thetaO = kPI;
+        node.cone.thetaE = kPI * 0.5f;
+        node.power = power[light];
+        return;
+    }
+
+    // split in the middle of the longest axis of light centers; halfway through the lights if that does not split anything
+    BuildBox centroidBox;
+    for (int i = start; i < start + count; ++i)
+    {
+        const Sphere& s = spheres[lightIDs[indices[i]]];
+        float c[3] = { s.center.x, s.center.y, s.center.z };
+        centroidBox.Grow(c, c);
+    }
+    float3pack extent(centroidBox.bmax.x - centroidBox.bmin.x, centroidBox.bmax.y - centroidBox.bmin.y, centroidBox.bmax.z - centroidBox.bmin.z);
+    int axis = extent.x > extent.y && extent.x > extent.z ? 0 : (extent.y > extent.z ? 1 : 2);
+    float split = 0.5f * ((&centroidBox.bmin.x)[axis] + (&centroidBox.bmax.x)[axis]);
+    int* mid = std::partition(indices + start, indices + start + count, [&](int light)
+    {
+        return (&spheres[lightIDs[light]].center.x)[axis] < split;
+    });
+    int leftCount = int(mid - (indices + start));
+    if (leftCount == 0 || leftCount == count)
+    {
+        leftCount = count / 2;
+        std::nth_element(indices + start, indices + start + leftCount, indices + start + count, [&](int a, int b)
+        {
+            return (&spheres[lightIDs[a]].center.x)[axis] < (&spheres[lightIDs[b]].center.x)[axis];
+        });
+    }
+
+    int left = bvh.nodeCount;
+    bvh.nodeCount += 2;
+    bvh.parents[left] = bvh.parents[left + 1] = nodeIndex;
+    BuildLightNode(bvh, spheres, lightIDs, power, left, start, leftCount);
+    BuildLightNode(bvh, spheres, lightIDs, power, left + 1, start + leftCount, count - leftCount);
+
+    const LightBvhNode& l = bvh.nodes[left];
+    const LightBvhNode& r = bvh.nodes[left + 1];
+    node.boundsMin = float3pack(std::min(l.boundsMin.x, r.boundsMin.x), std::min(l.boundsMin.y, r.boundsMin.y), std::min(l.boundsMin.z, r.boundsMin.z));
+    node.boundsMax = float3pack(std::max(l.boundsMax.x, r.boundsMax.x), std::max(l.boundsMax.y, r.boundsMax.y), std::max(l.boundsMax.z, r.boundsMax.z));
+    node.leftOrLight = left;
+    node.isLeaf = 0;
+    node.cone = ConeUnion(l.cone, r.cone);
+    node.power = l.power + r.power;
+}
+
+void BuildLightBvh(LightBvh& bvh, const Sphere* spheres, const int* lightIDs, const float* power, int count)
+{
+    if (bvh.buildCapacity < count)
+    {
+        delete[] bvh.buildIndices;
+        delete[] bvh.lightLeaves;
+        bvh.buildIndices = new int[count];
+        bvh.lightLeaves = new int[count];
+        bvh.buildCapacity = count;
+    }
+    int maxNodes = std::max(1, 2 * count - 1);
+    if (bvh.nodeCapacity < maxNodes)
+    {
+        delete[] bvh.nodes;
+        delete[] bvh.parents;
+        bvh.nodes = new LightBvhNode[maxNodes];
+        bvh.parents = new int[maxNodes];
+        bvh.nodeCapacity = maxNodes;
+    }
+    for (int i = 0; i < count; ++i)
+        bvh.buildIndices[i] = i;
+    bvh.nodeCount = 0;
+    if (count == 0)
+        return;
+    bvh.nodeCount = 1;
+    bvh.parents[0] = -1;
+    BuildLightNode(bvh, spheres, lightIDs, power, 0, 0, count);
+}
+
+// Upper bound-ish estimate of light that the node could send towards pos
+static float LightNodeImportance(const LightBvhNode& node, float3 pos, float3 normal)
+{
+    float3 bmin = node.boundsMin.toFloat3(), bmax = node.boundsMax.toFloat3();
+    float3 center = (bmin + bmax) * 0.5f;
+    float3 toCenter = center - pos;
+    float distSq = sqLength(toCenter);
+    float radiusSq = sqLength(bmax - center);
+    if (distSq <= radiusSq)
+        return node.power / std::max(distSq, 1.0e-6f); // inside the bounds, all directions are possible
+    float3 dir = toCenter * (1.0f / sqrtf(distSq));
+    // everything in the node is within thetaU of dir
+    float sinThetaU = sqrtf(radiusSq / distSq);
+    float cosThetaU = sqrtf(1.0f - radiusSq / distSq);
+
+    // angle to surface normal, reduced by thetaU; nothing comes from below the surface
+    float cosThetaI = dot(normal, dir);
+    float cosI = 1.0f;
+    if (cosThetaI < cosThetaU)
+    {
+        float sinThetaI = sqrtf(std::max(0.0f, 1.0f - cosThetaI * cosThetaI));
+        cosI = cosThetaI * cosThetaU + sinThetaI * sinThetaU; // cos(thetaI - thetaU)
+        if (cosI <= 0)
+            return 0;
+    }
+
+    // do the lights face the point at all?
+    float cosO = 1.0f;
+    if (node.cone.thetaO < kPI)
+    {
+        float theta = acosf(std::min(std::max(-dot(node.cone.axis.toFloat3(), dir), -1.0f), 1.0f));
+        float thetaP = std::max(0.0f, theta - node.cone.thetaO - acosf(cosThetaU));
+        if (thetaP >= node.cone.thetaE)
+            return 0;
+        cosO = cosf(thetaP);
+    }
+    return node.power * cosI * cosO / distSq;
+}
+
+int SampleLightBvh(const LightBvh& bvh, float3 pos, float3 normal, int skipLight, uint32_t& state, float& outPdf)
+{
+    if (bvh.nodeCount == 0)
+        return -1;
+    float pdf = 1.0f;
+    int index = 0;
+    while (!bvh.nodes[index].isLeaf)
+    {
+        int left = bvh.nodes[index].leftOrLight;
+        const LightBvhNode& l = bvh.nodes[left];
+        const LightBvhNode& r = bvh.nodes[left + 1];
+        float wl = l.isLeaf && l.leftOrLight == skipLight ? 0.0f : LightNodeImportance(l, pos, normal);
+        float wr = r.isLeaf && r.leftOrLight == skipLight ? 0.0f : LightNodeImportance(r, pos, normal);
+        float total = wl + wr;
+        if (total <= 0)
+            return -1;
+        float pl = wl / total;
+        if (RandomFloat01(state) < pl)
+        {
+            index = left;
+            pdf *= pl;
+        }
+        else
+        {
+            index = left + 1;
+            pdf *= 1.0f - pl;
+        }
+    }
+    int light = bvh.nodes[index].leftOrLight;
+    if (light == skipLight)
+        return -1;
+    outPdf = pdf;
+    return light;
+}
+
+float LightBvhPdf(const LightBvh& bvh, float3 pos, float3 normal, int skipLight, int light)
+{
+    if (bvh.nodeCount == 0 || light == skipLight)
+        return 0.0f;
+    // walk up from the leaf, with the same child probabilities as the traversal above
+    float pdf = 1.0f;
+    int index = bvh.lightLeaves[light];
+    for (int parent = bvh.parents[index]; parent >= 0; index = parent, parent = bvh.parents[index])
+    {
+        int left = bvh.nodes[parent].leftOrLight;
+        const LightBvhNode& l = bvh.nodes[left];
+        const LightBvhNode& r = bvh.nodes[left + 1];
+        float wl = l.isLeaf && l.leftOrLight == skipLight ? 0.0f : LightNodeImportance(l, pos, normal);
+        float wr = r.isLeaf && r.leftOrLight == skipLight ? 0.0f : LightNodeImportance(r, pos, normal);
+        float total = wl + wr;
+        if (total <= 0)
+            return 0.0f;
+        float pl = wl / total;
+        pdf *= index == left ? pl : 1.0f - pl;
+    }
+    return pdf;
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include "Maths.h"
+
+// Bounding volume hierarchy over spheres, built with binned SAH (surface area heuristic).
+//
+// Spheres are copied into "leaf order": each leaf references a contiguous range in
+// leafSpheres, padded to kSimdWidth with "impossible spheres", so that leaves can be
+// intersected with the regular HitSpheresRange kernel.
+
+// max. number of spheres in a leaf
+#define kBvhMaxLeafSize 8
+// below this sphere count a plain SIMD loop over all spheres is faster than any traversal,
+// so the whole hierarchy is just a single leaf
+#define kBvhMinSpheres 128
+// number of bins used for SAH split evaluation
+#define kBvhBinCount 16
+// max. depth of the hierarchy (root is at depth 0); below a depth where SAH splits could go past it,
+// the build splits spheres in half instead
+#define kBvhMaxDepth 32
+// size of traversal stacks: 4-wide traversal can push up to 4 children per node and pops one
+#define kBvhStackSize (3 * kBvhMaxDepth + 1)
+
+struct BvhNode
+{
+    float3pack boundsMin;
+    int leftOrStart; // inner node: index of left child (right child is next to it); leaf: start in leafSpheres
+    float3pack boundsMax;
+    int count; // inner node: zero; leaf: number of spheres (incl. padding) in leafSpheres
+};
+
+#if CPU_CAN_DO_SIMD
+// 4-wide BVH node: bounds of all four children in "structure of arrays" layout,
+// so that a ray can be tested against all of them at once with float4.
+struct BvhNode4
+{
+    float boundsMinX[4], boundsMinY[4], boundsMinZ[4];
+    float boundsMaxX[4], boundsMaxY[4], boundsMaxZ[4];
+    int child[4]; // inner child: index of the node; leaf child: start in leafSpheres
+    int count[4]; // inner child: zero; leaf child: number of spheres (incl. padding) in leafSpheres
+    int childCount; // children are always in the first childCount slots
+};
+#endif
+
+struct SphereBvh
+{
+    SphereBvh();
+    ~SphereBvh();
+
+    BvhNode* nodes;
+    int nodeCount;
+    int nodeCapacity;
+    int maxDepth; // depth of the deepest leaf, at most kBvhMaxDepth
+
+#if CPU_CAN_DO_SIMD
+    // same hierarchy, collapsed into 4-wide nodes
+    BvhNode4* nodes4;
+    int node4Count;
+    int node4Capacity;
+#endif
+
+    SpheresSoA* leafSpheres;
+    int* leafIds; // index in leafSpheres -> index in original spheres data
+    int* leafIndices; // index in original spheres data -> index in leafSpheres
+
+    // scratch data used during the build
+    int* buildIndices;
+    float* buildBounds;
+    int buildCapacity;
+};
+
+// (Re)builds the hierarchy for given spheres. Can be called each frame; memory is reused.
+void BuildBvh(SphereBvh& bvh, const SpheresSoA& spheres);
+
+// Same as HitSpheres, but traverses the hierarchy. Returns index into the original spheres data.
+int HitBvh(const Ray& r, const SphereBvh& bvh, float tMin, float tMax, Hit& outHit);
+#if CPU_CAN_DO_SIMD
+// Same as HitBvh, but traverses the 4-wide nodes.
+int HitBvh4(const Ray& r, const SphereBvh& bvh, float tMin, float tMax, Hit& outHit);
+#endif
+
+// Same as HitSpheresPacket, but traverses the (binary) hierarchy; a node is visited when any of the rays hits it.
+unsigned HitBvhPacket(const RayPacket& rays, const SphereBvh& bvh, float tMin, float tMax, Hit* outHits, int* outIDs);
+
+// Same as OccludedSpheres, but traverses the hierarchy; ignoreID is index into the original spheres data.
+bool OccludedBvh(const Ray& r, const SphereBvh& bvh, float tMin, float tMax, int ignoreID);
+#if CPU_CAN_DO_SIMD
+bool OccludedBvh4(const Ray& r, const SphereBvh& bvh, float tMin, float tMax, int ignoreID);
+#endif
+
+
+// Hierarchy over light sources, for picking one of many lights by its estimated contribution at a shading
+// point ("Importance Sampling of Many Lights with Adaptive Tree Splitting", Conty & Kulla 2018). Each node
+// has bounds, total power and an orientation cone of the lights below it; traversal randomly goes into
+// one of the children, with probability proportional to how much light they could send towards the point.
+
+// Orientation cone: emitting surfaces face within thetaO of axis, and emit within thetaE around
+// their normals. Spheres emit in all directions (thetaO = pi, thetaE = pi/2).
+struct LightCone
+{
+    float3pack axis;
+    float thetaO, thetaE;
+};
+
+struct LightBvhNode
+{
+    float3pack boundsMin;
+    int leftOrLight; // inner node: index of left child (right child is next to it); leaf: light index
+    float3pack boundsMax;
+    int isLeaf;
+    LightCone cone;
+    float power;
+};
+
+struct LightBvh
+{
+    LightBvh();
+    ~LightBvh();
+
+    LightBvhNode* nodes;
+    int* parents; // parent node index of each node, -1 for the root
+    int nodeCount;
+    int nodeCapacity;
+    int* lightLeaves; // light index -> its leaf node
+
+    // scratch data used during the build
+    int* buildIndices;
+    int buildCapacity;
+};
+
+// (Re)builds the hierarchy over spherical lights: spheres[lightIDs[i]] with power[i] (anything proportional
+// to emitted power); one light per leaf. Light indices used below are indices into lightIDs.
+void BuildLightBvh(LightBvh& bvh, const Sphere* spheres, const int* lightIDs, const float* power, int count);
+
+// Picks a light for shading point pos with normal (lights behind it get zero probability), skipping light
+// skipLight (-1 for none). Returns light index and its probability, or -1 when no light can contribute.
+int SampleLightBvh(const LightBvh& bvh, float3 pos, float3 normal, int skipLight, uint32_t& state, float& outPdf);
+
+// Probability that SampleLightBvh with the same arguments picks the given light.
+float LightBvhPdf(const LightBvh& bvh, float3 pos, float3 normal, int skipLight, int light);
@@ -12,6 +12,18 @@
 #define CPU_CAN_DO_SIMD 1
 #endif
 
+#if CPU_CAN_DO_SIMD && defined(__AVX2__)
+#define CPU_CAN_DO_AVX2 1
+#else
+#define CPU_CAN_DO_AVX2 0
+#endif
+
+#if CPU_CAN_DO_AVX2 && defined(__AVX512F__)
+#define CPU_CAN_DO_AVX512 1
+#else
+#define CPU_CAN_DO_AVX512 0
+#endif
+
 #if defined(__EMSCRIPTEN__) && !defined(__EMSCRIPTEN_PTHREADS__)
 #define CPU_CAN_DO_THREADS 0
 #else
@@ -23,6 +35,18 @@
 #define DO_ANIMATE_SMOOTHING 0.9f
 #define DO_LIGHT_SAMPLING 1
 #define DO_MITSUBA_COMPARE 0
+// Adaptive sampling (kFlagAdaptive): pixels whose estimated relative error drops below this only get a sample per frame
+#define DO_ADAPTIVE_THRESHOLD 0.01f
+// Threads trace square tiles of this many pixels (0: ranges of rows); see SetTileScheduling
+#define DO_TILE_SIZE 32
+// Paths that did this many bounces are subject to Russian roulette (-1: never); see SetRussianRoulette
+#define DO_RUSSIAN_ROULETTE_DEPTH 3
+// Multiple importance sampling of light samples & bounce rays: 0 off, 1 balance heuristic, 2 power heuristic; see SetMisHeuristic
+#define DO_MIS_HEURISTIC 2
+// Pixel, lens & bounce direction samples: 0 random, 1 Owen-scrambled Sobol; see SetSampler
+#define DO_SAMPLER 1
+// Denoiser filter passes, each with taps twice as far apart (5: 125x125 pixel footprint); see DenoiseTest
+#define DO_DENOISE_PASSES 5
 
 // GPU tracing compute shader parameters
 #define kCSGroupSizeX 8
@@ -34,3 +58,16 @@
 
 // Should HitSpheres function use SSE/NEON?
 #define DO_HIT_SPHERES_SIMD (CPU_CAN_DO_SIMD && 1)
+
+// Should HitSpheres function use 8-wide AVX2 (in kernels compiled for it, see Kernels.h)?
+#define DO_HIT_SPHERES_AVX2 (DO_HIT_SPHERES_SIMD && CPU_CAN_DO_AVX2 && 1)
+// Should HitSpheres function use 16-wide AVX-512 (in kernels compiled for it, see Kernels.h)?
+#define DO_HIT_SPHERES_AVX512 (DO_HIT_SPHERES_AVX2 && CPU_CAN_DO_AVX512 && 1)
+
+// Should ray queries use a bounding volume hierarchy over spheres (instead of testing all of them)?
+#define DO_BVH 1
+// Should the BVH be traversed as a 4-wide one (bounds of 4 children tested at once via SSE/NEON)?
+#define DO_BVH4 (CPU_CAN_DO_SIMD && DO_BVH && 1)
+
+// Should primary (camera) rays be traced in packets of kRayPacketSize rays? Only pays off with SIMD.
+#define DO_RAY_PACKETS (CPU_CAN_DO_SIMD && 1)
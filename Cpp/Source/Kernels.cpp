@@ -0,0 +1,142 @@
+#define _CRT_SECURE_NO_WARNINGS // getenv
+#include "Kernels.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define CPU_IS_X86 1
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#else
+#define CPU_IS_X86 0
+#endif
+
+// defined in KernelsBase.cpp etc.
+const KernelTable* GetKernelTableBase();
+const KernelTable* GetKernelTableSSE41();
+const KernelTable* GetKernelTableAVX2();
+const KernelTable* GetKernelTableAVX512();
+
+KernelTable g_Kernels = *GetKernelTableBase();
+static int s_KernelLevel = kKernelLevelBase;
+
+static const char* s_KernelLevelNames[kKernelLevelCount] = { "base", "sse4.1", "avx2", "avx512" };
+
+
+#if CPU_IS_X86
+static void CpuId(int leaf, unsigned regs[4])
+{
+#if defined(_MSC_VER)
+    __cpuidex((int*)regs, leaf, 0);
+#else
+    __cpuid_count(leaf, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// which register states the OS saves on context switches
+static uint64_t GetXCR0()
+{
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    uint32_t lo, hi;
+    __asm__ ("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    return ((uint64_t)hi << 32) | lo;
+#endif
+}
+#endif // #if CPU_IS_X86
+
+static bool IsKernelLevelSupportedByCpu(int level)
+{
+    if (level == kKernelLevelBase)
+        return true;
+#if CPU_IS_X86
+    unsigned regs[4];
+    CpuId(0, regs);
+    unsigned maxLeaf = regs[0];
+    CpuId(1, regs);
+    unsigned ecx1 = regs[2];
+    unsigned ebx7 = 0;
+    if (maxLeaf >= 7)
+    {
+        CpuId(7, regs);
+        ebx7 = regs[1];
+    }
+    bool sse41 = (ecx1 & (1 << 19)) != 0;
+    if (level == kKernelLevelSSE41)
+        return sse41;
+
+    // AVX needs OS support for saving YMM registers (and ZMM/mask ones for AVX-512)
+    bool osxsave = (ecx1 & (1 << 27)) != 0;
+    uint64_t xcr0 = osxsave ? GetXCR0() : 0;
+    bool avx = (ecx1 & (1 << 28)) != 0 && (xcr0 & 0x6) == 0x6;
+    bool fma = (ecx1 & (1 << 12)) != 0;
+    bool avx2 = (ebx7 & (1 << 5)) != 0;
+    if (level == kKernelLevelAVX2)
+        return sse41 && avx && fma && avx2;
+
+    bool avx512f = (ebx7 & (1 << 16)) != 0 && (xcr0 & 0xE6) == 0xE6;
+    if (level == kKernelLevelAVX512)
+        return sse41 && avx && fma && avx2 && avx512f;
+#endif
+    return false;
+}
+
+const KernelTable* GetKernelTable(int level)
+{
+    const KernelTable* table = NULL;
+    switch (level)
+    {
+    case kKernelLevelBase: table = GetKernelTableBase(); break;
+    case kKernelLevelSSE41: table = GetKernelTableSSE41(); break;
+    case kKernelLevelAVX2: table = GetKernelTableAVX2(); break;
+    case kKernelLevelAVX512: table = GetKernelTableAVX512(); break;
+    }
+    if (table != NULL && !IsKernelLevelSupportedByCpu(level))
+        table = NULL;
+    return table;
+}
+
+int SelectKernels(const char* levelName)
+{
+    if (levelName == NULL || levelName[0] == 0)
+        levelName = getenv("TOYPT_KERNELS");
+
+    int level = -1;
+    if (levelName != NULL)
+    {
+        for (int i = 0; i < kKernelLevelCount; ++i)
+        {
+            if (strcmp(levelName, s_KernelLevelNames[i]) == 0 && GetKernelTable(i) != NULL)
+                level = i;
+        }
+    }
+    // otherwise pick the widest one we can do
+    if (level < 0)
+    {
+        for (level = kKernelLevelCount - 1; level > kKernelLevelBase; --level)
+        {
+            if (GetKernelTable(level) != NULL)
+                break;
+        }
+    }
+
+    g_Kernels = *GetKernelTable(level);
+    s_KernelLevel = level;
+    return level;
+}
+
+int GetKernelLevel()
+{
+    return s_KernelLevel;
+}
+
+const char* GetKernelLevelName(int level)
+{
+    if (level < 0 || level >= kKernelLevelCount)
+        return "unknown";
+    return s_KernelLevelNames[level];
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "Maths.h"
+
+// Hot inner loop functions, compiled several times for different instruction sets
+// (KernelsBase.cpp, KernelsSSE41.cpp, KernelsAVX2.cpp, KernelsAVX512.cpp, each with
+// their own compiler flags). The best one that the CPU supports is picked at startup,
+// so that a single executable can run everywhere, and still use wide SIMD where possible.
+
+enum KernelLevel
+{
+    kKernelLevelBase, // SSE2 on x86 (SSE4.1 on Windows), NEON on ARM, scalar on WebAssembly
+    kKernelLevelSSE41,
+    kKernelLevelAVX2, // AVX2 + FMA
+    kKernelLevelAVX512, // AVX-512F
+    kKernelLevelCount
+};
+
+// one random direction towards a spherical light, used for a shadow ray
+struct LightSample
+{
+    float3 dir;
+    float omega; // solid angle of the cone that light subtends
+    float dist; // distance along dir to the light surface
+    int id; // sphere index of the light
+};
+
+// One pass of the denoiser (see DenoiseTest): inputs & outputs are planes of floats, with rows stride floats
+// apart. Each row has padding of at least 2*step+16 floats on both sides, where everything is zero (zero
+// normals get no weight); filtering does not need to check for image edges, and can do a whole SIMD register
+// of pixels past the end of a row.
+struct DenoisePass
+{
+    int width, height, stride;
+    int step; // pixels between filter taps
+    const float* normal[3]; // unit length, or zero where nothing was hit
+    const float* depth;
+    const float* depthGradient; // how much depth changes from a pixel to its neighbor
+    const float* color[3]; // without albedo, see DenoiseTest
+    const float* variance; // of color luminance
+    float* outColor[3];
+    float* outVariance;
+};
+
+struct KernelTable
+{
+    // see HitSpheresRange
+    int (*hitSpheresRange)(const Ray& r, const SpheresSoA& spheres, int start, int end, float tMin, float& inoutTMax);
+    // see OccludedSpheresRange
+    bool (*occludedSpheresRange)(const Ray& r, const SpheresSoA& spheres, int start, int end, float tMin, float tMax, int ignoreIndex);
+    // see HitSpheresPacketRange
+    void (*hitSpheresPacket)(const RayPacket& rays, const SpheresSoA& spheres, int start, int end, float tMin, float* inoutTMax, int* inoutID);
+    // backbuffer = backbuffer * lerpFac + colors * (1-lerpFac), for pixelCount RGBA float pixels
+    void (*accumulatePixels)(float* backbuffer, const float* colors, int pixelCount, float lerpFac);
+    // For each of the lights (except skipID), picks a random direction from pos towards it, uniformly
+    // distributed over the cone that the light sphere subtends. Returns number of samples written.
+    int (*sampleLights)(float3 pos, const Sphere* spheres, const int* lightIDs, int lightCount, int skipID, uint32_t& state, LightSample* outSamples);
+    // Edge-avoiding a-trous filter pass over row y: each pixel becomes a weighted average of 5x5 pixels that are
+    // pass.step apart, weighted by how similar their normal, depth & luminance are.
+    void (*denoiseRow)(const DenoisePass& pass, int y);
+};
+
+// currently used kernels
+extern KernelTable g_Kernels;
+
+// Picks the kernels to use: levelName (e.g. "avx2") when given, else the level from TOYPT_KERNELS
+// environment variable when set, else the best one supported by the CPU. Asking for a level that
+// is not compiled in, or not supported by the CPU, also falls back to the best one. Returns the used level.
+int SelectKernels(const char* levelName);
+int GetKernelLevel();
+const char* GetKernelLevelName(int level);
+// NULL if the level is not compiled in, or not supported by the CPU
+const KernelTable* GetKernelTable(int level);
@@ -0,0 +1,9 @@
+// Kernels compiled for AVX2 + FMA; needs "-mavx2 -mfma" (or /arch:AVX2) compiler flags.
+#include "Kernels.h"
+
+#if CPU_CAN_DO_AVX2
+#define KERNEL_TABLE_GETTER GetKernelTableAVX2
+#include "KernelsImpl.h"
+#else
+const KernelTable* GetKernelTableAVX2() { return NULL; }
+#endif
@@ -0,0 +1,9 @@
+// Kernels compiled for AVX-512; needs "-mavx512f -mavx2 -mfma" (or /arch:AVX512) compiler flags.
+#include "Kernels.h"
+
+#if CPU_CAN_DO_AVX512
+#define KERNEL_TABLE_GETTER GetKernelTableAVX512
+#include "KernelsImpl.h"
+#else
+const KernelTable* GetKernelTableAVX512() { return NULL; }
+#endif
@@ -0,0 +1,3 @@
+// Kernels compiled with the default compiler settings; these always work.
+#define KERNEL_TABLE_GETTER GetKernelTableBase
+#include "KernelsImpl.h"
@@ -0,0 +1,764 @@
+// Kernel implementations; included into KernelsBase.cpp, KernelsSSE41.cpp, KernelsAVX2.cpp
+// and KernelsAVX512.cpp, each of which is compiled for a different instruction set, and defines
+// KERNEL_TABLE_GETTER to be the name of the function that returns its KernelTable.
+//
+// Everything here is static, and should only use VM_INLINE helpers from the math headers: a regular
+// inline function that does not get inlined would be emitted by each of these files, and the linker
+// might pick e.g. the AVX2 copy to be used from everywhere.
+
+#include "Kernels.h"
+
+// (narrower code paths are only there when the widest one needs them for leftovers, or is not available)
+#if DO_HIT_SPHERES_SIMD && !DO_HIT_SPHERES_AVX512
+static int HitSpheresRange4(const Ray& r, const SpheresSoA& spheres, int start, int end, float tMin, float& inoutTMax)
+{
+    float4 hitT = float4(inoutTMax);
+#if USE_NEON
+    int32x4_t id = vdupq_n_s32(-1);
+#else
+    __m128i id = _mm_set1_epi32(-1);
+#endif
+
+#if DO_FLOAT3_WITH_SIMD && !USE_NEON
+    float4 rOrigX = SHUFFLE4(r.orig, 0, 0, 0, 0);
+    float4 rOrigY = SHUFFLE4(r.orig, 1, 1, 1, 1);
+    float4 rOrigZ = SHUFFLE4(r.orig, 2, 2, 2, 2);
+    float4 rDirX = SHUFFLE4(r.dir, 0, 0, 0, 0);
+    float4 rDirY = SHUFFLE4(r.dir, 1, 1, 1, 1);
+    float4 rDirZ = SHUFFLE4(r.dir, 2, 2, 2, 2);
+#elif DO_FLOAT3_WITH_SIMD
+    float4 rOrigX = splatX(r.orig.m);
+    float4 rOrigY = splatY(r.orig.m);
+    float4 rOrigZ = splatZ(r.orig.m);
+    float4 rDirX = splatX(r.dir.m);
+    float4 rDirY = splatY(r.dir.m);
+    float4 rDirZ = splatZ(r.dir.m);
+#else
+    float4 rOrigX = float4(r.orig.x);
+    float4 rOrigY = float4(r.orig.y);
+    float4 rOrigZ = float4(r.orig.z);
+    float4 rDirX = float4(r.dir.x);
+    float4 rDirY = float4(r.dir.y);
+    float4 rDirZ = float4(r.dir.z);
+#endif
+    float4 tMin4 = float4(tMin);
+#if USE_NEON
+    int32x4_t curId = vcombine_u32(vcreate_u32(0ULL | (1ULL<<32)), vcreate_u32(2ULL | (3ULL<<32)));
+    curId = vaddq_s32(curId, vdupq_n_s32(start));
+#else
+    __m128i curId = _mm_add_epi32(_mm_set_epi32(3, 2, 1, 0), _mm_set1_epi32(start));
+#endif
+    // process 4 spheres at once
+    for (int i = start; i < end; i += kSimdWidth)
+    {
+        // load data for 4 spheres
+        float4 sCenterX = float4(spheres.centerX + i);
+        float4 sCenterY = float4(spheres.centerY + i);
+        float4 sCenterZ = float4(spheres.centerZ + i);
+        float4 sSqRadius = float4(spheres.sqRadius + i);
+        // note: we flip this vector and calculate -b (nb) since that happens to be slightly preferable computationally
+        float4 coX = sCenterX - rOrigX;
+        float4 coY = sCenterY - rOrigY;
+        float4 coZ = sCenterZ - rOrigZ;
+        float4 nb = coX * rDirX + coY * rDirY + coZ * rDirZ;
+        float4 c = coX * coX + coY * coY + coZ * coZ - sSqRadius;
+        float4 discr = nb * nb - c;
+        bool4 discrPos = discr > float4(0.0f);
+        // if ray hits any of the 4 spheres
+        if (any(discrPos))
+        {
+            float4 discrSq = sqrtf(discr);
+
+            // ray could hit spheres at t0 & t1
+            float4 t0 = nb - discrSq;
+            float4 t1 = nb + discrSq;
+
+            float4 t = select(t1, t0, t0 > tMin4); // if t0 is above min, take it (since it's the earlier hit); else try t1.
+            bool4 msk = discrPos & (t > tMin4) & (t < hitT);
+            // if hit, take it
+            id = select(id, curId, msk);
+            hitT = select(hitT, t, msk);
+        }
+#if USE_NEON
+        curId = vaddq_s32(curId, vdupq_n_s32(kSimdWidth));
+#else
+        curId = _mm_add_epi32(curId, _mm_set1_epi32(kSimdWidth));
+#endif
+    }
+    // now we have up to 4 hits, find and return closest one
+    float minT = hmin(hitT);
+    if (minT < inoutTMax) // any actual hits?
+    {
+        unsigned minMask = mask(hitT == float4(minT));
+        if (minMask != 0)
+        {
+            int id_scalar[4];
+            float hitT_scalar[4];
+#if USE_NEON
+            vst1q_s32(id_scalar, id);
+            vst1q_f32(hitT_scalar, hitT.m);
+#else
+            _mm_storeu_si128((__m128i *)id_scalar, id);
+            _mm_storeu_ps(hitT_scalar, hitT.m);
+#endif
+
+            int lane = firstLane(minMask);
+            inoutTMax = hitT_scalar[lane];
+            return id_scalar[lane];
+        }
+    }
+
+    return -1;
+}
+#endif // #if DO_HIT_SPHERES_SIMD && !DO_HIT_SPHERES_AVX512
+
+
+#if DO_HIT_SPHERES_AVX2 && !DO_HIT_SPHERES_AVX512
+static int HitSpheresRange8(const Ray& r, const SpheresSoA& spheres, int start, int end, float tMin, float& inoutTMax)
+{
+    float8 hitT = float8(inoutTMax);
+    __m256i id = _mm256_set1_epi32(-1);
+
+    float8 rOrigX = float8(r.orig.getX());
+    float8 rOrigY = float8(r.orig.getY());
+    float8 rOrigZ = float8(r.orig.getZ());
+    float8 rDirX = float8(r.dir.getX());
+    float8 rDirY = float8(r.dir.getY());
+    float8 rDirZ = float8(r.dir.getZ());
+    float8 tMin8 = float8(tMin);
+    __m256i curId = _mm256_add_epi32(_mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0), _mm256_set1_epi32(start));
+    // process 8 spheres at once
+    for (int i = start; i < end; i += 8)
+    {
+        // load data for 8 spheres
+        float8 sCenterX = float8(spheres.centerX + i);
+        float8 sCenterY = float8(spheres.centerY + i);
+        float8 sCenterZ = float8(spheres.centerZ + i);
+        float8 sSqRadius = float8(spheres.sqRadius + i);
+        // same math as the 4-wide version, just with fused multiply-adds
+        float8 coX = sCenterX - rOrigX;
+        float8 coY = sCenterY - rOrigY;
+        float8 coZ = sCenterZ - rOrigZ;
+        float8 nb = mul_add(coX, rDirX, mul_add(coY, rDirY, coZ * rDirZ));
+        float8 c = mul_add(coX, coX, mul_add(coY, coY, mul_sub(coZ, coZ, sSqRadius)));
+        float8 discr = mul_sub(nb, nb, c);
+        bool8 discrPos = discr > float8(0.0f);
+        // if ray hits any of the 8 spheres
+        if (any(discrPos))
+        {
+            float8 discrSq = sqrtf(discr);
+
+            // ray could hit spheres at t0 & t1
+            float8 t0 = nb - discrSq;
+            float8 t1 = nb + discrSq;
+
+            float8 t = select(t1, t0, t0 > tMin8); // if t0 is above min, take it (since it's the earlier hit); else try t1.
+            bool8 msk = discrPos & (t > tMin8) & (t < hitT);
+            // if hit, take it
+            id = select(id, curId, msk);
+            hitT = select(hitT, t, msk);
+        }
+        curId = _mm256_add_epi32(curId, _mm256_set1_epi32(8));
+    }
+    // now we have up to 8 hits, find and return closest one
+    float minT = hmin(hitT);
+    if (minT < inoutTMax) // any actual hits?
+    {
+        unsigned minMask = mask(hitT == float8(minT));
+        if (minMask != 0)
+        {
+            int id_scalar[8];
+            float hitT_scalar[8];
+            _mm256_storeu_si256((__m256i *)id_scalar, id);
+            _mm256_storeu_ps(hitT_scalar, hitT.m);
+
+            int lane = firstLane(minMask);
+            inoutTMax = hitT_scalar[lane];
+            return id_scalar[lane];
+        }
+    }
+
+    return -1;
+}
+#endif // #if DO_HIT_SPHERES_AVX2 && !DO_HIT_SPHERES_AVX512
+
+
+#if DO_HIT_SPHERES_AVX512
+static int HitSpheresRange16(const Ray& r, const SpheresSoA& spheres, int start, int end, float tMin, float& inoutTMax)
+{
+    float16 hitT = float16(inoutTMax);
+    __m512i id = _mm512_set1_epi32(-1);
+
+    float16 rOrigX = float16(r.orig.getX());
+    float16 rOrigY = float16(r.orig.getY());
+    float16 rOrigZ = float16(r.orig.getZ());
+    float16 rDirX = float16(r.dir.getX());
+    float16 rDirY = float16(r.dir.getY());
+    float16 rDirZ = float16(r.dir.getZ());
+    float16 tMin16 = float16(tMin);
+    __m512i curId = _mm512_add_epi32(_mm512_set_epi32(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0), _mm512_set1_epi32(start));
+    // process 16 spheres at once
+    for (int i = start; i < end; i += 16)
+    {
+        // last iteration might have less than 16 spheres left; only load & consider those
+        bool16 active = end - i >= 16 ? bool16(0xFFFF) : bool16((1u << (end - i)) - 1);
+        float16 sCenterX = load(spheres.centerX + i, active);
+        float16 sCenterY = load(spheres.centerY + i, active);
+        float16 sCenterZ = load(spheres.centerZ + i, active);
+        float16 sSqRadius = load(spheres.sqRadius + i, active);
+        float16 coX = sCenterX - rOrigX;
+        float16 coY = sCenterY - rOrigY;
+        float16 coZ = sCenterZ - rOrigZ;
+        float16 nb = mul_add(coX, rDirX, mul_add(coY, rDirY, coZ * rDirZ));
+        float16 c = mul_add(coX, coX, mul_add(coY, coY, mul_sub(coZ, coZ, sSqRadius)));
+        float16 discr = mul_sub(nb, nb, c);
+        bool16 discrPos = active & (discr > float16(0.0f));
+        // if ray hits any of the 16 spheres
+        if (any(discrPos))
+        {
+            float16 discrSq = sqrtf(discr);
+
+            // ray could hit spheres at t0 & t1
+            float16 t0 = nb - discrSq;
+            float16 t1 = nb + discrSq;
+
+            float16 t = select(t1, t0, t0 > tMin16); // if t0 is above min, take it (since it's the earlier hit); else try t1.
+            bool16 msk = discrPos & (t > tMin16) & (t < hitT);
+            // if hit, take it
+            id = select(id, curId, msk);
+            hitT = select(hitT, t, msk);
+        }
+        curId = _mm512_add_epi32(curId, _mm512_set1_epi32(16));
+    }
+    // now we have up to 16 hits, find and return closest one
+    float minT = hmin(hitT);
+    if (minT < inoutTMax) // any actual hits?
+    {
+        unsigned minMask = mask(hitT == float16(minT));
+        if (minMask != 0)
+        {
+            int id_scalar[16];
+            float hitT_scalar[16];
+            _mm512_storeu_si512(id_scalar, id);
+            _mm512_storeu_ps(hitT_scalar, hitT.m);
+
+            int lane = firstLane(minMask);
+            inoutTMax = hitT_scalar[lane];
+            return id_scalar[lane];
+        }
+    }
+
+    return -1;
+}
+#endif // #if DO_HIT_SPHERES_AVX512
+
+
+static int HitSpheresRangeKernel(const Ray& r, const SpheresSoA& spheres, int start, int end, float tMin, float& inoutTMax)
+{
+#if DO_HIT_SPHERES_AVX512
+    return HitSpheresRange16(r, spheres, start, end, tMin, inoutTMax);
+#elif DO_HIT_SPHERES_AVX2
+    // bulk of the spheres 8 at a time, and the possible remaining 4 with the narrower code path
+    int end8 = start + (end - start) / 8 * 8;
+    int id = HitSpheresRange8(r, spheres, start, end8, tMin, inoutTMax);
+    if (end8 != end)
+    {
+        int id4 = HitSpheresRange4(r, spheres, end8, end, tMin, inoutTMax);
+        if (id4 != -1)
+            id = id4;
+    }
+    return id;
+#elif DO_HIT_SPHERES_SIMD
+    return HitSpheresRange4(r, spheres, start, end, tMin, inoutTMax);
+#else
+    float hitT = inoutTMax;
+    int id = -1;
+    for (int i = start; i < end; ++i)
+    {
+        float coX = spheres.centerX[i] - r.orig.getX();
+        float coY = spheres.centerY[i] - r.orig.getY();
+        float coZ = spheres.centerZ[i] - r.orig.getZ();
+        float nb = coX * r.dir.getX() + coY * r.dir.getY() + coZ * r.dir.getZ();
+        float c = coX * coX + coY * coY + coZ * coZ - spheres.sqRadius[i];
+        float discr = nb * nb - c;
+        if (discr > 0)
+        {
+            float discrSq = sqrtf(discr);
+
+            // Try earlier t
+            float t = nb - discrSq;
+            if (t <= tMin) // before min, try later t!
+                t = nb + discrSq;
+
+            if (t > tMin && t < hitT)
+            {
+                id = i;
+                hitT = t;
+            }
+        }
+    }
+    inoutTMax = hitT;
+    return id;
+#endif
+}
+
+
+
+// Any-hit versions of the above: only answer whether anything in [start,end) other than sphere
+// ignoreIndex is hit within (tMin,tMax), and stop at the first such group of spheres.
+#if DO_HIT_SPHERES_SIMD && !DO_HIT_SPHERES_AVX512
+static bool OccludedSpheresRange4(const Ray& r, const SpheresSoA& spheres, int start, int end, float tMin, float tMax, int ignoreIndex)
+{
+    float4 rOrigX = float4(r.orig.getX()), rOrigY = float4(r.orig.getY()), rOrigZ = float4(r.orig.getZ());
+    float4 rDirX = float4(r.dir.getX()), rDirY = float4(r.dir.getY()), rDirZ = float4(r.dir.getZ());
+    float4 tMin4 = float4(tMin), tMax4 = float4(tMax);
+    for (int i = start; i < end; i += 4)
+    {
+        float4 coX = float4(spheres.centerX + i) - rOrigX;
+        float4 coY = float4(spheres.centerY + i) - rOrigY;
+        float4 coZ = float4(spheres.centerZ + i) - rOrigZ;
+        float4 nb = coX * rDirX + coY * rDirY + coZ * rDirZ;
+        float4 c = coX * coX + coY * coY + coZ * coZ - float4(spheres.sqRadius + i);
+        float4 discr = nb * nb - c;
+        bool4 discrPos = discr > float4(0.0f);
+        if (any(discrPos))
+        {
+            float4 discrSq = sqrtf(discr);
+            float4 t0 = nb - discrSq;
+            float4 t1 = nb + discrSq;
+            float4 t = select(t1, t0, t0 > tMin4);
+            unsigned hits = mask(discrPos & (t > tMin4) & (t < tMax4));
+            if (ignoreIndex >= i && ignoreIndex < i + 4)
+                hits &= ~(1u << (ignoreIndex - i));
+            if (hits != 0)
+                return true;
+        }
+    }
+    return false;
+}
+#endif // #if DO_HIT_SPHERES_SIMD && !DO_HIT_SPHERES_AVX512
+
+#if DO_HIT_SPHERES_AVX2 && !DO_HIT_SPHERES_AVX512
+static bool OccludedSpheresRange8(const Ray& r, const SpheresSoA& spheres, int start, int end, float tMin, float tMax, int ignoreIndex)
+{
+    float8 rOrigX = float8(r.orig.getX()), rOrigY = float8(r.orig.getY()), rOrigZ = float8(r.orig.getZ());
+    float8 rDirX = float8(r.dir.getX()), rDirY = float8(r.dir.getY()), rDirZ = float8(r.dir.getZ());
+    float8 tMin8 = float8(tMin), tMax8 = float8(tMax);
+    for (int i = start; i < end; i += 8)
+    {
+        float8 coX = float8(spheres.centerX + i) - rOrigX;
+        float8 coY = float8(spheres.centerY + i) - rOrigY;
+        float8 coZ = float8(spheres.centerZ + i) - rOrigZ;
+        float8 nb = mul_add(coX, rDirX, mul_add(coY, rDirY, coZ * rDirZ));
+        float8 c = mul_add(coX, coX, mul_add(coY, coY, mul_sub(coZ, coZ, float8(spheres.sqRadius + i))));
+        float8 discr = mul_sub(nb, nb, c);
+        bool8 discrPos = discr > float8(0.0f);
+        if (any(discrPos))
+        {
+            float8 discrSq = sqrtf(discr);
+            float8 t0 = nb - discrSq;
+            float8 t1 = nb + discrSq;
+            float8 t = select(t1, t0, t0 > tMin8);
+            unsigned hits = mask(discrPos & (t > tMin8) & (t < tMax8));
+            if (ignoreIndex >= i && ignoreIndex < i + 8)
+                hits &= ~(1u << (ignoreIndex - i));
+            if (hits != 0)
+                return true;
+        }
+    }
+    return false;
+}
+#endif // #if DO_HIT_SPHERES_AVX2 && !DO_HIT_SPHERES_AVX512
+
+#if DO_HIT_SPHERES_AVX512
+static bool OccludedSpheresRange16(const Ray& r, const SpheresSoA& spheres, int start, int end, float tMin, float tMax, int ignoreIndex)
+{
+    float16 rOrigX = float16(r.orig.getX()), rOrigY = float16(r.orig.getY()), rOrigZ = float16(r.orig.getZ());
+    float16 rDirX = float16(r.dir.getX()), rDirY = float16(r.dir.getY()), rDirZ = float16(r.dir.getZ());
+    float16 tMin16 = float16(tMin), tMax16 = float16(tMax);
+    for (int i = start; i < end; i += 16)
+    {
+        bool16 active = end - i >= 16 ? bool16(0xFFFF) : bool16((1u << (end - i)) - 1);
+        if (ignoreIndex >= i && ignoreIndex < i + 16)
+            active &= ~(1u << (ignoreIndex - i));
+        float16 coX = load(spheres.centerX + i, active) - rOrigX;
+        float16 coY = load(spheres.centerY + i, active) - rOrigY;
+        float16 coZ = load(spheres.centerZ + i, active) - rOrigZ;
+        float16 nb = mul_add(coX, rDirX, mul_add(coY, rDirY, coZ * rDirZ));
+        float16 c = mul_add(coX, coX, mul_add(coY, coY, mul_sub(coZ, coZ, load(spheres.sqRadius + i, active))));
+        float16 discr = mul_sub(nb, nb, c);
+        bool16 discrPos = active & (discr > float16(0.0f));
+        if (any(discrPos))
+        {
+            float16 discrSq = sqrtf(discr);
+            float16 t0 = nb - discrSq;
+            float16 t1 = nb + discrSq;
+            float16 t = select(t1, t0, t0 > tMin16);
+            if (any(discrPos & (t > tMin16) & (t < tMax16)))
+                return true;
+        }
+    }
+    return false;
+}
+#endif // #if DO_HIT_SPHERES_AVX512
+
+
+static bool OccludedSpheresRangeKernel(const Ray& r, const SpheresSoA& spheres, int start, int end, float tMin, float tMax, int ignoreIndex)
+{
+#if DO_HIT_SPHERES_AVX512
+    return OccludedSpheresRange16(r, spheres, start, end, tMin, tMax, ignoreIndex);
+#elif DO_HIT_SPHERES_AVX2
+    int end8 = start + (end - start) / 8 * 8;
+    if (OccludedSpheresRange8(r, spheres, start, end8, tMin, tMax, ignoreIndex))
+        return true;
+    return end8 != end && OccludedSpheresRange4(r, spheres, end8, end, tMin, tMax, ignoreIndex);
+#elif DO_HIT_SPHERES_SIMD
+    return OccludedSpheresRange4(r, spheres, start, end, tMin, tMax, ignoreIndex);
+#else
+    for (int i = start; i < end; ++i)
+    {
+        if (i == ignoreIndex)
+            continue;
+        float coX = spheres.centerX[i] - r.orig.getX();
+        float coY = spheres.centerY[i] - r.orig.getY();
+        float coZ = spheres.centerZ[i] - r.orig.getZ();
+        float nb = coX * r.dir.getX() + coY * r.dir.getY() + coZ * r.dir.getZ();
+        float c = coX * coX + coY * coY + coZ * coZ - spheres.sqRadius[i];
+        float discr = nb * nb - c;
+        if (discr > 0)
+        {
+            float discrSq = sqrtf(discr);
+            float t = nb - discrSq;
+            if (t <= tMin)
+                t = nb + discrSq;
+            if (t > tMin && t < tMax)
+                return true;
+        }
+    }
+    return false;
+#endif
+}
+
+
+// Packet versions: kRayPacketSize rays against one sphere at a time.
+static_assert(kRayPacketSize == 8, "packet kernels are written for 8 rays");
+#if DO_HIT_SPHERES_AVX2
+static void HitSpheresPacket8(const RayPacket& rays, const SpheresSoA& spheres, int start, int end, float tMin, float* inoutTMax, int* inoutID)
+{
+    float8 rOrigX = float8(rays.origX), rOrigY = float8(rays.origY), rOrigZ = float8(rays.origZ);
+    float8 rDirX = float8(rays.dirX), rDirY = float8(rays.dirY), rDirZ = float8(rays.dirZ);
+    float8 tMin8 = float8(tMin);
+    float8 hitT = float8(inoutTMax);
+    __m256i id = _mm256_loadu_si256((const __m256i*)inoutID);
+    for (int i = start; i < end; ++i)
+    {
+        float8 coX = float8(spheres.centerX[i]) - rOrigX;
+        float8 coY = float8(spheres.centerY[i]) - rOrigY;
+        float8 coZ = float8(spheres.centerZ[i]) - rOrigZ;
+        float8 nb = mul_add(coX, rDirX, mul_add(coY, rDirY, coZ * rDirZ));
+        float8 c = mul_add(coX, coX, mul_add(coY, coY, mul_sub(coZ, coZ, float8(spheres.sqRadius[i]))));
+        float8 discr = mul_sub(nb, nb, c);
+        bool8 discrPos = discr > float8(0.0f);
+        // if any of the rays hit the sphere
+        if (any(discrPos))
+        {
+            float8 discrSq = sqrtf(discr);
+            float8 t0 = nb - discrSq;
+            float8 t1 = nb + discrSq;
+            float8 t = select(t1, t0, t0 > tMin8);
+            bool8 msk = discrPos & (t > tMin8) & (t < hitT);
+            id = select(id, _mm256_set1_epi32(i), msk);
+            hitT = select(hitT, t, msk);
+        }
+    }
+    hitT.store(inoutTMax);
+    _mm256_storeu_si256((__m256i*)inoutID, id);
+}
+#elif DO_HIT_SPHERES_SIMD
+// rays [first,first+4) of the packet
+static void HitSpheresPacket4(const RayPacket& rays, int first, const SpheresSoA& spheres, int start, int end, float tMin, float* inoutTMax, int* inoutID)
+{
+    float4 rOrigX = float4(rays.origX + first), rOrigY = float4(rays.origY + first), rOrigZ = float4(rays.origZ + first);
+    float4 rDirX = float4(rays.dirX + first), rDirY = float4(rays.dirY + first), rDirZ = float4(rays.dirZ + first);
+    float4 tMin4 = float4(tMin);
+    float4 hitT = float4(inoutTMax + first);
+#if USE_NEON
+    int32x4_t id = vld1q_s32(inoutID + first);
+#else
+    __m128i id = _mm_loadu_si128((const __m128i*)(inoutID + first));
+#endif
+    for (int i = start; i < end; ++i)
+    {
+        float4 coX = float4(spheres.centerX[i]) - rOrigX;
+        float4 coY = float4(spheres.centerY[i]) - rOrigY;
+        float4 coZ = float4(spheres.centerZ[i]) - rOrigZ;
+        float4 nb = coX * rDirX + coY * rDirY + coZ * rDirZ;
+        float4 c = coX * coX + coY * coY + coZ * coZ - float4(spheres.sqRadius[i]);
+        float4 discr = nb * nb - c;
+        bool4 discrPos = discr > float4(0.0f);
+        // if any of the rays hit the sphere
+        if (any(discrPos))
+        {
+            float4 discrSq = sqrtf(discr);
+            float4 t0 = nb - discrSq;
+            float4 t1 = nb + discrSq;
+            float4 t = select(t1, t0, t0 > tMin4);
+            bool4 msk = discrPos & (t > tMin4) & (t < hitT);
+#if USE_NEON
+            id = select(id, vdupq_n_s32(i), msk);
+#else
+            id = select(id, _mm_set1_epi32(i), msk);
+#endif
+            hitT = select(hitT, t, msk);
+        }
+    }
+    hitT.store(inoutTMax + first);
+#if USE_NEON
+    vst1q_s32(inoutID + first, id);
+#else
+    _mm_storeu_si128((__m128i*)(inoutID + first), id);
+#endif
+}
+#endif
+
+static void HitSpheresPacketKernel(const RayPacket& rays, const SpheresSoA& spheres, int start, int end, float tMin, float* inoutTMax, int* inoutID)
+{
+#if DO_HIT_SPHERES_AVX2
+    HitSpheresPacket8(rays, spheres, start, end, tMin, inoutTMax, inoutID);
+#elif DO_HIT_SPHERES_SIMD
+    for (int first = 0; first < kRayPacketSize; first += 4)
+        HitSpheresPacket4(rays, first, spheres, start, end, tMin, inoutTMax, inoutID);
+#else
+    for (int j = 0; j < kRayPacketSize; ++j)
+    {
+        for (int i = start; i < end; ++i)
+        {
+            float coX = spheres.centerX[i] - rays.origX[j];
+            float coY = spheres.centerY[i] - rays.origY[j];
+            float coZ = spheres.centerZ[i] - rays.origZ[j];
+            float nb = coX * rays.dirX[j] + coY * rays.dirY[j] + coZ * rays.dirZ[j];
+            float c = coX * coX + coY * coY + coZ * coZ - spheres.sqRadius[i];
+            float discr = nb * nb - c;
+            if (discr > 0)
+            {
+                float discrSq = sqrtf(discr);
+                float t = nb - discrSq;
+                if (t <= tMin)
+                    t = nb + discrSq;
+                if (t > tMin && t < inoutTMax[j])
+                {
+                    inoutID[j] = i;
+                    inoutTMax[j] = t;
+                }
+            }
+        }
+    }
+#endif
+}
+
+
+static void AccumulatePixelsKernel(float* backbuffer, const float* colors, int pixelCount, float lerpFac)
+{
+    int count = pixelCount * 4;
+    int i = 0;
+#if CPU_CAN_DO_AVX512
+    float16 lerp16 = float16(lerpFac);
+    float16 invLerp16 = float16(1.0f - lerpFac);
+    for (; i < count; i += 16)
+    {
+        // last iteration might have less than 16 floats left
+        bool16 active = count - i >= 16 ? bool16(0xFFFF) : bool16((1u << (count - i)) - 1);
+        float16 prev = load(backbuffer + i, active);
+        float16 col = load(colors + i, active);
+        store(backbuffer + i, mul_add(prev, lerp16, col * invLerp16), active);
+    }
+#elif CPU_CAN_DO_AVX2
+    float8 lerp8 = float8(lerpFac);
+    float8 invLerp8 = float8(1.0f - lerpFac);
+    for (; i + 8 <= count; i += 8)
+    {
+        float8 prev = float8(backbuffer + i);
+        float8 col = float8(colors + i);
+        mul_add(prev, lerp8, col * invLerp8).store(backbuffer + i);
+    }
+#endif
+#if CPU_CAN_DO_SIMD
+    float4 lerp4 = float4(lerpFac);
+    float4 invLerp4 = float4(1.0f - lerpFac);
+    for (; i < count; i += 4)
+    {
+        float4 prev = float4(backbuffer + i);
+        float4 col = float4(colors + i);
+        (prev * lerp4 + col * invLerp4).store(backbuffer + i);
+    }
+#else
+    for (; i < count; ++i)
+        backbuffer[i] = backbuffer[i] * lerpFac + colors[i] * (1 - lerpFac);
+#endif
+}
+
+
+static int SampleLightsKernel(float3 pos, const Sphere* spheres, const int* lightIDs, int lightCount, int skipID, uint32_t& state, LightSample* outSamples)
+{
+    int sampleCount = 0;
+    for (int j = 0; j < lightCount; ++j)
+    {
+        int i = lightIDs[j];
+        if (i == skipID)
+            continue; // skip self
+        const Sphere& s = spheres[i];
+
+        // create a random direction towards sphere
+        // coord system for sampling: sw, su, sv
+        float3 sc = float3(s.center.x, s.center.y, s.center.z);
+        float3 sw = normalize(sc - pos);
+        float3 su = normalize(cross(fabsf(sw.getX())>0.01f ? float3(0,1,0):float3(1,0,0), sw));
+        float3 sv = cross(sw, su);
+        // sample sphere by solid angle
+        float cosAMax = sqrtf(1.0f - s.radius*s.radius / sqLength(pos-sc));
+        float eps1 = RandomFloat01(state), eps2 = RandomFloat01(state);
+        float cosA = 1.0f - eps1 + eps1 * cosAMax;
+        float sinA = sqrtf(1.0f - cosA*cosA);
+        float phi = 2 * kPI * eps2;
+        LightSample& ls = outSamples[sampleCount++];
+        ls.dir = su * (cosf(phi) * sinA) + sv * (sinf(phi) * sinA) + sw * cosA;
+        //ls.dir = normalize(ls.dir); // NOTE(fg): This is already normalized, by construction.
+        ls.omega = 2 * kPI * (1-cosAMax);
+        // distance to where the ray enters the light
+        float3 co = sc - pos;
+        float nb = dot(co, ls.dir);
+        float discr = nb * nb - (sqLength(co) - s.radius*s.radius);
+        ls.dist = nb - (discr > 0 ? sqrtf(discr) : 0.0f);
+        ls.id = i;
+    }
+    return sampleCount;
+}
+
+
+#if !CPU_CAN_DO_SIMD
+// Single lane version of the SIMD types, so that the denoiser template below works without SIMD too
+struct float1
+{
+    VM_INLINE float1() {}
+    VM_INLINE explicit float1(const float *p) { m = *p; }
+    VM_INLINE explicit float1(float v) { m = v; }
+    VM_INLINE void store(float *p) const { *p = m; }
+    float m;
+};
+VM_INLINE float1 operator+ (float1 a, float1 b) { a.m += b.m; return a; }
+VM_INLINE float1 operator- (float1 a, float1 b) { a.m -= b.m; return a; }
+VM_INLINE float1 operator* (float1 a, float1 b) { a.m *= b.m; return a; }
+VM_INLINE float1 operator/ (float1 a, float1 b) { a.m /= b.m; return a; }
+VM_INLINE float1 operator- (float1 a) { a.m = -a.m; return a; }
+VM_INLINE float1 max(float1 a, float1 b) { a.m = a.m > b.m ? a.m : b.m; return a; }
+VM_INLINE float1 sqrtf(float1 v) { v.m = sqrtf(v.m); return v; }
+#endif
+
+// how much the denoiser lets differences in luminance (relative to its standard deviation) and depth (relative
+// to the depth gradient) reduce the weight of a neighbor; normals are compared with dot(n,q)^128
+const float kDenoiseSigmaLum = 4.0f;
+const float kDenoiseSigmaDepth = 1.0f;
+const float kDenoiseNormalPower = 128.0f;
+
+// exp(-x) for x >= 0, as (1-x/64)^64: just multiplies, and close enough for filter weights. Goes to
+// exactly zero at x=14 instead of ever smaller values, which would become denormals (very slow).
+template<typename F>
+static VM_INLINE F DenoiseExpNeg(F x)
+{
+    const float kCutoff = 1.4092e-7f; // (1-14/64)^64
+    F t = max(F(1.0f) - x * F(1.0f / 64), F(1.0f - 14.0f / 64));
+    for (int i = 0; i < 6; ++i)
+        t = t * t;
+    return max(t - F(kCutoff), F(0.0f));
+}
+
+template<typename F>
+static VM_INLINE F DenoiseAbs(F x)
+{
+    return max(x, -x);
+}
+
+// filters pixels x..x+lanes-1 of row y
+template<typename F>
+static VM_INLINE void DenoiseLanes(const DenoisePass& p, int x, int y)
+{
+    static const float kTapWeights[5] = { 1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16 };
+    int i = y * p.stride + x;
+    F lumR(0.2126f), lumG(0.7152f), lumB(0.0722f);
+    F lum = F(p.color[0] + i) * lumR + F(p.color[1] + i) * lumG + F(p.color[2] + i) * lumB;
+    F nX(p.normal[0] + i), nY(p.normal[1] + i), nZ(p.normal[2] + i);
+    F z(p.depth + i);
+    // luminance that is within a few standard deviations of noise is mixed in; depth that is within what
+    // a plane would do at that distance
+    F lumScale = F(1.0f) / (F(kDenoiseSigmaLum) * sqrtf(F(p.variance + i) + F(1.0e-10f)) + F(1.0e-4f));
+    F depthScale = F(1.0f) / (F(kDenoiseSigmaDepth * p.step) * F(p.depthGradient + i) + F(1.0e-4f));
+
+    F sumW(0.0f), sumR(0.0f), sumG(0.0f), sumB(0.0f), sumVar(0.0f);
+    for (int ty = 0; ty < 5; ++ty)
+    {
+        int qy = y + (ty - 2) * p.step;
+        if (qy < 0 || qy >= p.height)
+            continue;
+        for (int tx = 0; tx < 5; ++tx)
+        {
+            int j = qy * p.stride + x + (tx - 2) * p.step;
+            F qR(p.color[0] + j), qG(p.color[1] + j), qB(p.color[2] + j);
+            F w(kTapWeights[tx] * kTapWeights[ty]);
+            if (tx != 2 || ty != 2)
+            {
+                F qLum = qR * lumR + qG * lumG + qB * lumB;
+                F nDot = nX * F(p.normal[0] + j) + nY * F(p.normal[1] + j) + nZ * F(p.normal[2] + j);
+                float tapDistance = float((tx > 2 ? tx - 2 : 2 - tx) + (ty > 2 ? ty - 2 : 2 - ty));
+                // exp(-128*(1-nDot)) is about nDot^128
+                F e = (F(1.0f) - nDot) * F(kDenoiseNormalPower);
+                e = e + DenoiseAbs(qLum - lum) * lumScale;
+                e = e + DenoiseAbs(F(p.depth + j) - z) * depthScale * F(1.0f / tapDistance);
+                w = w * DenoiseExpNeg(e);
+            }
+            sumW = sumW + w;
+            sumR = sumR + qR * w;
+            sumG = sumG + qG * w;
+            sumB = sumB + qB * w;
+            sumVar = sumVar + F(p.variance + j) * w * w;
+        }
+    }
+    F invW = F(1.0f) / sumW;
+    (sumR * invW).store(p.outColor[0] + i);
+    (sumG * invW).store(p.outColor[1] + i);
+    (sumB * invW).store(p.outColor[2] + i);
+    (sumVar * invW * invW).store(p.outVariance + i);
+}
+
+static void DenoiseRowKernel(const DenoisePass& p, int y)
+{
+    // last iteration can go into the padding
+#if CPU_CAN_DO_AVX512
+    for (int x = 0; x < p.width; x += 16)
+        DenoiseLanes<float16>(p, x, y);
+#elif CPU_CAN_DO_AVX2
+    for (int x = 0; x < p.width; x += 8)
+        DenoiseLanes<float8>(p, x, y);
+#elif CPU_CAN_DO_SIMD
+    for (int x = 0; x < p.width; x += 4)
+        DenoiseLanes<float4>(p, x, y);
+#else
+    for (int x = 0; x < p.width; ++x)
+        DenoiseLanes<float1>(p, x, y);
+#endif
+}
+
+
+static const KernelTable s_KernelTable =
+{
+    HitSpheresRangeKernel,
+    OccludedSpheresRangeKernel,
+    HitSpheresPacketKernel,
+    AccumulatePixelsKernel,
+    SampleLightsKernel,
+    DenoiseRowKernel,
+};
+
+const KernelTable* KERNEL_TABLE_GETTER()
+{
+    return &s_KernelTable;
+}
@@ -0,0 +1,11 @@
+// Kernels compiled for SSE4.1; needs "-msse4.1" compiler flag. On Windows the default kernels
+// already assume SSE4.1 and MSVC never defines __SSE4_1__, so this is compiled there, but only
+// as the NULL stub.
+#include "Kernels.h"
+
+#if CPU_CAN_DO_SIMD && defined(__SSE4_1__)
+#define KERNEL_TABLE_GETTER GetKernelTableSSE41
+#include "KernelsImpl.h"
+#else
+const KernelTable* GetKernelTableSSE41() { return NULL; }
+#endif
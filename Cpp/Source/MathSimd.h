@@ -2,12 +2,33 @@
 
 #if defined(_MSC_VER)
 #define VM_INLINE __forceinline
-#else
+#elif defined(__clang__)
 #define VM_INLINE __attribute__((unused, always_inline, nodebug)) inline
+#else // gcc does not know about nodebug
+#define VM_INLINE __attribute__((unused, always_inline)) inline
 #endif
 
 #define kSimdWidth 4
 
+// Sphere data is padded to multiples of this, so that the widest SIMD code path can process it
+#define kSimdMaxWidth 8
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// Index of the lowest set bit (i.e. first set lane of a mask); v must not be zero
+VM_INLINE int firstLane(unsigned v)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, v);
+    return (int)index;
+#else
+    return __builtin_ctz(v);
+#endif
+}
+
 #if !defined(__arm__) && !defined(__arm64__) && !defined(__EMSCRIPTEN__)
 
 // ---- SSE implementation
@@ -30,6 +51,8 @@ struct float4
     VM_INLINE float getY() const { return _mm_cvtss_f32(_mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 1, 1, 1))); }
     VM_INLINE float getZ() const { return _mm_cvtss_f32(_mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 2, 2, 2))); }
     VM_INLINE float getW() const { return _mm_cvtss_f32(_mm_shuffle_ps(m, m, _MM_SHUFFLE(3, 3, 3, 3))); }
+
+    VM_INLINE void store(float *p) const { _mm_storeu_ps(p, m); }
     
     __m128 m;
 };
@@ -39,6 +62,7 @@ typedef float4 bool4;
 VM_INLINE float4 operator+ (float4 a, float4 b) { a.m = _mm_add_ps(a.m, b.m); return a; }
 VM_INLINE float4 operator- (float4 a, float4 b) { a.m = _mm_sub_ps(a.m, b.m); return a; }
 VM_INLINE float4 operator* (float4 a, float4 b) { a.m = _mm_mul_ps(a.m, b.m); return a; }
+VM_INLINE float4 operator/ (float4 a, float4 b) { a.m = _mm_div_ps(a.m, b.m); return a; }
 VM_INLINE bool4 operator==(float4 a, float4 b) { a.m = _mm_cmpeq_ps(a.m, b.m); return a; }
 VM_INLINE bool4 operator!=(float4 a, float4 b) { a.m = _mm_cmpneq_ps(a.m, b.m); return a; }
 VM_INLINE bool4 operator< (float4 a, float4 b) { a.m = _mm_cmplt_ps(a.m, b.m); return a; }
@@ -91,6 +115,139 @@ VM_INLINE __m128i select(__m128i a, __m128i b, bool4 cond)
 
 VM_INLINE float4 sqrtf(float4 v) { return float4(_mm_sqrt_ps(v.m)); }
 
+
+#if defined(__AVX2__)
+
+// ---- AVX2 8-wide implementation
+
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ < 13
+// AVX-512 intrinsics in gcc 12 headers use "undefined" values that -Wall then warns about, wherever they are inlined
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#include <immintrin.h>
+#pragma GCC diagnostic pop
+#else
+#include <immintrin.h>
+#endif
+
+struct float8
+{
+    VM_INLINE float8() {}
+    VM_INLINE explicit float8(const float *p) { m = _mm256_loadu_ps(p); }
+    VM_INLINE explicit float8(float v) { m = _mm256_set1_ps(v); }
+    VM_INLINE explicit float8(__m256 v) { m = v; }
+
+    VM_INLINE void store(float *p) const { _mm256_storeu_ps(p, m); }
+
+    __m256 m;
+};
+
+typedef float8 bool8;
+
+VM_INLINE float8 operator+ (float8 a, float8 b) { a.m = _mm256_add_ps(a.m, b.m); return a; }
+VM_INLINE float8 operator- (float8 a, float8 b) { a.m = _mm256_sub_ps(a.m, b.m); return a; }
+VM_INLINE float8 operator* (float8 a, float8 b) { a.m = _mm256_mul_ps(a.m, b.m); return a; }
+VM_INLINE float8 operator/ (float8 a, float8 b) { a.m = _mm256_div_ps(a.m, b.m); return a; }
+VM_INLINE bool8 operator==(float8 a, float8 b) { a.m = _mm256_cmp_ps(a.m, b.m, _CMP_EQ_OQ); return a; }
+VM_INLINE bool8 operator!=(float8 a, float8 b) { a.m = _mm256_cmp_ps(a.m, b.m, _CMP_NEQ_UQ); return a; }
+VM_INLINE bool8 operator< (float8 a, float8 b) { a.m = _mm256_cmp_ps(a.m, b.m, _CMP_LT_OQ); return a; }
+VM_INLINE bool8 operator> (float8 a, float8 b) { a.m = _mm256_cmp_ps(a.m, b.m, _CMP_GT_OQ); return a; }
+VM_INLINE bool8 operator<=(float8 a, float8 b) { a.m = _mm256_cmp_ps(a.m, b.m, _CMP_LE_OQ); return a; }
+VM_INLINE bool8 operator>=(float8 a, float8 b) { a.m = _mm256_cmp_ps(a.m, b.m, _CMP_GE_OQ); return a; }
+VM_INLINE bool8 operator&(bool8 a, bool8 b) { a.m = _mm256_and_ps(a.m, b.m); return a; }
+VM_INLINE bool8 operator|(bool8 a, bool8 b) { a.m = _mm256_or_ps(a.m, b.m); return a; }
+VM_INLINE float8 operator- (float8 a) { a.m = _mm256_xor_ps(a.m, _mm256_set1_ps(-0.0f)); return a; }
+VM_INLINE float8 min(float8 a, float8 b) { a.m = _mm256_min_ps(a.m, b.m); return a; }
+VM_INLINE float8 max(float8 a, float8 b) { a.m = _mm256_max_ps(a.m, b.m); return a; }
+
+// a*b+c and a*b-c; fused on CPUs with FMA
+#if defined(__FMA__) || defined(_MSC_VER) // on windows assume AVX2 always comes with FMA
+VM_INLINE float8 mul_add(float8 a, float8 b, float8 c) { a.m = _mm256_fmadd_ps(a.m, b.m, c.m); return a; }
+VM_INLINE float8 mul_sub(float8 a, float8 b, float8 c) { a.m = _mm256_fmsub_ps(a.m, b.m, c.m); return a; }
+#else
+VM_INLINE float8 mul_add(float8 a, float8 b, float8 c) { return a * b + c; }
+VM_INLINE float8 mul_sub(float8 a, float8 b, float8 c) { return a * b - c; }
+#endif
+
+VM_INLINE float hmin(float8 v)
+{
+    __m128 m = _mm_min_ps(_mm256_castps256_ps128(v.m), _mm256_extractf128_ps(v.m, 1));
+    m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+    m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtss_f32(m);
+}
+
+// Returns a 8-bit code where bit0..bit7 is lane 0..7
+VM_INLINE unsigned mask(float8 v) { return _mm256_movemask_ps(v.m); }
+VM_INLINE bool any(bool8 v) { return mask(v) != 0; }
+VM_INLINE bool all(bool8 v) { return mask(v) == 255; }
+
+// "select", i.e. hibit(cond) ? b : a
+VM_INLINE float8 select(float8 a, float8 b, bool8 cond) { a.m = _mm256_blendv_ps(a.m, b.m, cond.m); return a; }
+VM_INLINE __m256i select(__m256i a, __m256i b, bool8 cond) { return _mm256_blendv_epi8(a, b, _mm256_castps_si256(cond.m)); }
+
+VM_INLINE float8 sqrtf(float8 v) { return float8(_mm256_sqrt_ps(v.m)); }
+
+#endif // #if defined(__AVX2__)
+
+
+#if defined(__AVX512F__)
+
+// ---- AVX-512 16-wide implementation
+// Comparisons produce __mmask16 mask registers directly, instead of all-bits-set vector lanes.
+
+struct float16
+{
+    VM_INLINE float16() {}
+    VM_INLINE explicit float16(const float *p) { m = _mm512_loadu_ps(p); }
+    VM_INLINE explicit float16(float v) { m = _mm512_set1_ps(v); }
+    VM_INLINE explicit float16(__m512 v) { m = v; }
+
+    VM_INLINE void store(float *p) const { _mm512_storeu_ps(p, m); }
+
+    __m512 m;
+};
+
+typedef __mmask16 bool16;
+
+// loads only the lanes in the mask, others are zero; stores only the lanes in the mask
+VM_INLINE float16 load(const float *p, bool16 m) { return float16(_mm512_maskz_loadu_ps(m, p)); }
+VM_INLINE void store(float *p, float16 v, bool16 m) { _mm512_mask_storeu_ps(p, m, v.m); }
+
+VM_INLINE float16 operator+ (float16 a, float16 b) { a.m = _mm512_add_ps(a.m, b.m); return a; }
+VM_INLINE float16 operator- (float16 a, float16 b) { a.m = _mm512_sub_ps(a.m, b.m); return a; }
+VM_INLINE float16 operator* (float16 a, float16 b) { a.m = _mm512_mul_ps(a.m, b.m); return a; }
+VM_INLINE float16 operator/ (float16 a, float16 b) { a.m = _mm512_div_ps(a.m, b.m); return a; }
+VM_INLINE bool16 operator==(float16 a, float16 b) { return _mm512_cmp_ps_mask(a.m, b.m, _CMP_EQ_OQ); }
+VM_INLINE bool16 operator!=(float16 a, float16 b) { return _mm512_cmp_ps_mask(a.m, b.m, _CMP_NEQ_UQ); }
+VM_INLINE bool16 operator< (float16 a, float16 b) { return _mm512_cmp_ps_mask(a.m, b.m, _CMP_LT_OQ); }
+VM_INLINE bool16 operator> (float16 a, float16 b) { return _mm512_cmp_ps_mask(a.m, b.m, _CMP_GT_OQ); }
+VM_INLINE bool16 operator<=(float16 a, float16 b) { return _mm512_cmp_ps_mask(a.m, b.m, _CMP_LE_OQ); }
+VM_INLINE bool16 operator>=(float16 a, float16 b) { return _mm512_cmp_ps_mask(a.m, b.m, _CMP_GE_OQ); }
+VM_INLINE float16 operator- (float16 a) { a.m = _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(a.m), _mm512_set1_epi32(0x80000000))); return a; }
+VM_INLINE float16 min(float16 a, float16 b) { a.m = _mm512_min_ps(a.m, b.m); return a; }
+VM_INLINE float16 max(float16 a, float16 b) { a.m = _mm512_max_ps(a.m, b.m); return a; }
+
+// a*b+c and a*b-c; AVX-512 always has FMA
+VM_INLINE float16 mul_add(float16 a, float16 b, float16 c) { a.m = _mm512_fmadd_ps(a.m, b.m, c.m); return a; }
+VM_INLINE float16 mul_sub(float16 a, float16 b, float16 c) { a.m = _mm512_fmsub_ps(a.m, b.m, c.m); return a; }
+
+VM_INLINE float hmin(float16 v) { return _mm512_reduce_min_ps(v.m); }
+
+// Returns a 16-bit code where bit0..bit15 is lane 0..15
+VM_INLINE unsigned mask(bool16 v) { return v; }
+VM_INLINE bool any(bool16 v) { return v != 0; }
+VM_INLINE bool all(bool16 v) { return v == 0xFFFF; }
+
+// "select", i.e. cond ? b : a
+VM_INLINE float16 select(float16 a, float16 b, bool16 cond) { a.m = _mm512_mask_blend_ps(cond, a.m, b.m); return a; }
+VM_INLINE __m512i select(__m512i a, __m512i b, bool16 cond) { return _mm512_mask_blend_epi32(cond, a, b); }
+
+VM_INLINE float16 sqrtf(float16 v) { return float16(_mm512_sqrt_ps(v.m)); }
+
+#endif // #if defined(__AVX512F__)
+
 #elif !defined(__EMSCRIPTEN__)
 
 // ---- NEON implementation
@@ -110,6 +267,8 @@ struct float4
     VM_INLINE float getY() const { return vgetq_lane_f32(m, 1); }
     VM_INLINE float getZ() const { return vgetq_lane_f32(m, 2); }
     VM_INLINE float getW() const { return vgetq_lane_f32(m, 3); }
+
+    VM_INLINE void store(float *p) const { vst1q_f32(p, m); }
     
     float32x4_t m;
 };
@@ -119,6 +278,19 @@ typedef float4 bool4;
 VM_INLINE float4 operator+ (float4 a, float4 b) { a.m = vaddq_f32(a.m, b.m); return a; }
 VM_INLINE float4 operator- (float4 a, float4 b) { a.m = vsubq_f32(a.m, b.m); return a; }
 VM_INLINE float4 operator* (float4 a, float4 b) { a.m = vmulq_f32(a.m, b.m); return a; }
+#if defined(__aarch64__) || defined(__arm64__)
+VM_INLINE float4 operator/ (float4 a, float4 b) { a.m = vdivq_f32(a.m, b.m); return a; }
+#else
+// reciprocal estimate, refined with two Newton-Raphson steps
+VM_INLINE float4 operator/ (float4 a, float4 b)
+{
+    float32x4_t r = vrecpeq_f32(b.m);
+    r = vmulq_f32(vrecpsq_f32(b.m, r), r);
+    r = vmulq_f32(vrecpsq_f32(b.m, r), r);
+    a.m = vmulq_f32(a.m, r);
+    return a;
+}
+#endif
 VM_INLINE bool4 operator==(float4 a, float4 b) { a.m = vceqq_f32(a.m, b.m); return a; }
 VM_INLINE bool4 operator!=(float4 a, float4 b) { a.m = a.m = vmvnq_u32(vceqq_f32(a.m, b.m)); return a; }
 VM_INLINE bool4 operator< (float4 a, float4 b) { a.m = vcltq_f32(a.m, b.m); return a; }
@@ -1,27 +1,65 @@
 #include "Maths.h"
+#include "Kernels.h"
 #include <stdlib.h>
 #include <stdint.h>
 
-static uint32_t XorShift32(uint32_t& state)
+float RandomFloat01(uint32_t& state)
+{
+    return (PcgHash(state++) >> 8) / 16777216.0f;
+}
+
+static uint32_t ReverseBits(uint32_t x)
 {
-    uint32_t x = state;
-    x ^= x << 13;
-    x ^= x >> 17;
-    x ^= x << 15;
-    state = x;
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
     return x;
 }
 
-float RandomFloat01(uint32_t& state)
+// Owen scrambling of bit-reversed x: randomly flips bits, each depending on just the bits below it
+// (Laine & Karras hash). Reversing the result gives the usual Owen scrambling of x's high bits.
+static uint32_t OwenScrambleReversed(uint32_t x, uint32_t seed)
 {
-    return (XorShift32(state) & 0xFFFFFF) / 16777216.0f;
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
 }
 
+void SobolOwen2D(uint32_t index, uint32_t seed, float& outX, float& outY)
+{
+    // shuffle the order of points; scrambling the index keeps power-of-two prefixes stratified
+    index = ReverseBits(OwenScrambleReversed(ReverseBits(index), seed));
+    // First two Sobol dimensions: van der Corput (index bits reversed), and the one whose generator matrix is
+    // Pascal's triangle mod 2. Index bit j goes into output bit i when binomial(j,i) is odd, i.e. when the bits
+    // of i are a subset of those of j (Lucas' theorem), so that is a subset sum over bit positions; no loop.
+    // Both are kept bit-reversed until after scrambling.
+    uint32_t y = index;
+    y ^= (y >> 1) & 0x55555555u;
+    y ^= (y >> 2) & 0x33333333u;
+    y ^= (y >> 4) & 0x0f0f0f0fu;
+    y ^= (y >> 8) & 0x00ff00ffu;
+    y ^= y >> 16;
+    uint32_t x = ReverseBits(OwenScrambleReversed(index, PcgHash(seed ^ 0x5bd1e995u)));
+    y = ReverseBits(OwenScrambleReversed(y, PcgHash(seed ^ 0x1b873593u)));
+    outX = (x >> 8) / 16777216.0f;
+    outY = (y >> 8) / 16777216.0f;
+}
+
+thread_local SamplingCounters g_SamplingCounters;
+
 float3 RandomInUnitDisk(uint32_t& state)
 {
+    SamplingCounters& counters = g_SamplingCounters;
+    ++counters.diskCalls;
     float3 p;
     do
     {
+        ++counters.diskIterations;
         p = 2.0 * float3(RandomFloat01(state),RandomFloat01(state),0) - float3(1,1,0);
     } while (dot(p,p) >= 1.0);
     return p;
@@ -29,8 +67,11 @@ float3 RandomInUnitDisk(uint32_t& state)
 
 float3 RandomInUnitSphere(uint32_t& state)
 {
+    SamplingCounters& counters = g_SamplingCounters;
+    ++counters.sphereCalls;
     float3 p;
     do {
+        ++counters.sphereIterations;
         p = 2.0*float3(RandomFloat01(state),RandomFloat01(state),RandomFloat01(state)) - float3(1,1,1);
     } while (sqLength(p) >= 1.0);
     return p;
@@ -46,158 +87,97 @@ float3 RandomUnitVector(uint32_t& state)
     return float3(x, y, z);
 }
 
+void SampleConcentricDisk(float u1, float u2, float& outX, float& outY)
+{
+    // Point is at angle a = +-pi/4 around the major axis, so short series for sin & cos are accurate enough.
+    // No trig calls, and the choice of major axis (random, so a branch would be mispredicted half the time)
+    // is done by blending.
+    float sx = 2.0f * u1 - 1.0f, sy = 2.0f * u2 - 1.0f;
+    float xMajor = fabsf(sx) > fabsf(sy) ? 1.0f : 0.0f;
+    float r = sy + xMajor * (sx - sy);
+    float minor = sx + xMajor * (sy - sx);
+    float a = (kPI / 4) * minor / (r + copysignf(1.0e-30f, r)); // both are zero only in the very center
+    float a2 = a * a;
+    float sinA = a * (1.0f - a2 * (1.0f / 6) * (1.0f - a2 * (1.0f / 20) * (1.0f - a2 * (1.0f / 42))));
+    float cosA = 1.0f - a2 * 0.5f * (1.0f - a2 * (1.0f / 12) * (1.0f - a2 * (1.0f / 30) * (1.0f - a2 * (1.0f / 56))));
+    outX = r * (sinA + xMajor * (cosA - sinA));
+    outY = r * (cosA + xMajor * (sinA - cosA));
+}
+
+float3 SampleCosineHemisphere(const float3& n, float u1, float u2, float& outPdf)
+{
+    float x, y;
+    SampleConcentricDisk(u1, u2, x, y);
+    float zSq = 1.0f - x * x - y * y;
+    float z = sqrtf(zSq > 0 ? zSq : 0.0f);
+    float3 t, b;
+    OrthonormalBasis(n, t, b);
+    outPdf = z * (1.0f / kPI);
+    return t * x + b * y + n * z;
+}
+
+
+int HitSpheresRange(const Ray& r, const SpheresSoA& spheres, int start, int end, float tMin, float& inoutTMax)
+{
+    return g_Kernels.hitSpheresRange(r, spheres, start, end, tMin, inoutTMax);
+}
 
 int HitSpheres(const Ray& r, const SpheresSoA& spheres, float tMin, float tMax, Hit& outHit)
 {
 #if DO_HIT_SPHERES_SIMD
-    float4 hitT = float4(tMax);
-#if USE_NEON
-    int32x4_t id = vdupq_n_s32(-1);
+    int end = spheres.simdCount;
 #else
-    __m128i id = _mm_set1_epi32(-1);
+    int end = spheres.count;
 #endif
+    float hitT = tMax;
+    int id = HitSpheresRange(r, spheres, 0, end, tMin, hitT);
+    if (id != -1)
+        SetSphereHit(r, spheres, id, hitT, outHit);
+    return id;
+}
 
-#if DO_FLOAT3_WITH_SIMD && !USE_NEON
-    float4 rOrigX = SHUFFLE4(r.orig, 0, 0, 0, 0);
-    float4 rOrigY = SHUFFLE4(r.orig, 1, 1, 1, 1);
-    float4 rOrigZ = SHUFFLE4(r.orig, 2, 2, 2, 2);
-    float4 rDirX = SHUFFLE4(r.dir, 0, 0, 0, 0);
-    float4 rDirY = SHUFFLE4(r.dir, 1, 1, 1, 1);
-    float4 rDirZ = SHUFFLE4(r.dir, 2, 2, 2, 2);
-#elif DO_FLOAT3_WITH_SIMD
-    float4 rOrigX = splatX(r.orig.m);
-    float4 rOrigY = splatY(r.orig.m);
-    float4 rOrigZ = splatZ(r.orig.m);
-    float4 rDirX = splatX(r.dir.m);
-    float4 rDirY = splatY(r.dir.m);
-    float4 rDirZ = splatZ(r.dir.m);
-#else
-    float4 rOrigX = float4(r.orig.x);
-    float4 rOrigY = float4(r.orig.y);
-    float4 rOrigZ = float4(r.orig.z);
-    float4 rDirX = float4(r.dir.x);
-    float4 rDirY = float4(r.dir.y);
-    float4 rDirZ = float4(r.dir.z);
-#endif
-    float4 tMin4 = float4(tMin);
-#if USE_NEON
-    int32x4_t curId = vcombine_u32(vcreate_u32(0ULL | (1ULL<<32)), vcreate_u32(2ULL | (3ULL<<32)));
-#else
-    __m128i curId = _mm_set_epi32(3, 2, 1, 0);
-#endif
-    // process 4 spheres at once
-    for (int i = 0; i < spheres.simdCount; i += kSimdWidth)
-    {
-        // load data for 4 spheres
-        float4 sCenterX = float4(spheres.centerX + i);
-        float4 sCenterY = float4(spheres.centerY + i);
-        float4 sCenterZ = float4(spheres.centerZ + i);
-        float4 sSqRadius = float4(spheres.sqRadius + i);
-        // note: we flip this vector and calculate -b (nb) since that happens to be slightly preferable computationally
-        float4 coX = sCenterX - rOrigX;
-        float4 coY = sCenterY - rOrigY;
-        float4 coZ = sCenterZ - rOrigZ;
-        float4 nb = coX * rDirX + coY * rDirY + coZ * rDirZ;
-        float4 c = coX * coX + coY * coY + coZ * coZ - sSqRadius;
-        float4 discr = nb * nb - c;
-        bool4 discrPos = discr > float4(0.0f);
-        // if ray hits any of the 4 spheres
-        if (any(discrPos))
-        {
-            float4 discrSq = sqrtf(discr);
 
-            // ray could hit spheres at t0 & t1
-            float4 t0 = nb - discrSq;
-            float4 t1 = nb + discrSq;
+bool OccludedSpheresRange(const Ray& r, const SpheresSoA& spheres, int start, int end, float tMin, float tMax, int ignoreIndex)
+{
+    return g_Kernels.occludedSpheresRange(r, spheres, start, end, tMin, tMax, ignoreIndex);
+}
 
-            float4 t = select(t1, t0, t0 > tMin4); // if t0 is above min, take it (since it's the earlier hit); else try t1.
-            bool4 msk = discrPos & (t > tMin4) & (t < hitT);
-            // if hit, take it
-            id = select(id, curId, msk);
-            hitT = select(hitT, t, msk);
-        }
-#if USE_NEON
-        curId = vaddq_s32(curId, vdupq_n_s32(kSimdWidth));
-#else
-        curId = _mm_add_epi32(curId, _mm_set1_epi32(kSimdWidth));
-#endif
-    }
-    // now we have up to 4 hits, find and return closest one
-    float minT = hmin(hitT);
-    if (minT < tMax) // any actual hits?
-    {
-        int minMask = mask(hitT == float4(minT));
-        if (minMask != 0)
-        {
-            int id_scalar[4];
-            float hitT_scalar[4];
-#if USE_NEON
-            vst1q_s32(id_scalar, id);
-            vst1q_f32(hitT_scalar, hitT.m);
+
+bool OccludedSpheres(const Ray& r, const SpheresSoA& spheres, float tMin, float tMax, int ignoreID)
+{
+#if DO_HIT_SPHERES_SIMD
+    int end = spheres.simdCount;
 #else
-            _mm_storeu_si128((__m128i *)id_scalar, id);
-            _mm_storeu_ps(hitT_scalar, hitT.m);
+    int end = spheres.count;
 #endif
+    return OccludedSpheresRange(r, spheres, 0, end, tMin, tMax, ignoreID);
+}
 
-            // In general, you would do this with a bit scan (first set/trailing zero count).
-            // But who cares, it's only 16 options.
-            static const int laneId[16] =
-            {
-                0, 0, 1, 0, // 00xx
-                2, 0, 1, 0, // 01xx
-                3, 0, 1, 0, // 10xx
-                2, 0, 1, 0, // 11xx
-            };
-
-            int lane = laneId[minMask];
-            int hitId = id_scalar[lane];
-            float finalHitT = hitT_scalar[lane];
-
-            outHit.pos = r.pointAt(finalHitT);
-            outHit.normal = (outHit.pos - float3(spheres.centerX[hitId], spheres.centerY[hitId], spheres.centerZ[hitId])) * spheres.invRadius[hitId];
-            outHit.t = finalHitT;
-            return hitId;
-        }
-    }
 
-    return -1;
+void HitSpheresPacketRange(const RayPacket& rays, const SpheresSoA& spheres, int start, int end, float tMin, float* inoutTMax, int* inoutID)
+{
+    g_Kernels.hitSpheresPacket(rays, spheres, start, end, tMin, inoutTMax, inoutID);
+}
 
-#else // #if DO_HIT_SPHERES_SIMD
 
-    float hitT = tMax;
-    int id = -1;
-    for (int i = 0; i < spheres.count; ++i)
+unsigned HitSpheresPacket(const RayPacket& rays, const SpheresSoA& spheres, float tMin, float tMax, Hit* outHits, int* outIDs)
+{
+    float hitT[kRayPacketSize];
+    for (int i = 0; i < kRayPacketSize; ++i)
     {
-        float coX = spheres.centerX[i] - r.orig.getX();
-        float coY = spheres.centerY[i] - r.orig.getY();
-        float coZ = spheres.centerZ[i] - r.orig.getZ();
-        float nb = coX * r.dir.getX() + coY * r.dir.getY() + coZ * r.dir.getZ();
-        float c = coX * coX + coY * coY + coZ * coZ - spheres.sqRadius[i];
-        float discr = nb * nb - c;
-        if (discr > 0)
-        {
-            float discrSq = sqrtf(discr);
-
-            // Try earlier t
-            float t = nb - discrSq;
-            if (t <= tMin) // before min, try later t!
-                t = nb + discrSq;
-
-            if (t > tMin && t < hitT)
-            {
-                id = i;
-                hitT = t;
-            }
-        }
+        hitT[i] = tMax;
+        outIDs[i] = -1;
     }
-    if (id != -1)
+    // padding spheres can never be hit, so no need to care about the packet kernel width here
+    HitSpheresPacketRange(rays, spheres, 0, spheres.count, tMin, hitT, outIDs);
+    unsigned hitMask = 0;
+    for (int i = 0; i < kRayPacketSize; ++i)
     {
-        outHit.pos = r.pointAt(hitT);
-        outHit.normal = (outHit.pos - float3(spheres.centerX[id], spheres.centerY[id], spheres.centerZ[id])) * spheres.invRadius[id];
-        outHit.t = hitT;
-        return id;
+        if (outIDs[i] != -1)
+        {
+            SetSphereHit(rays.Get(i), spheres, outIDs[i], hitT[i], outHits[i]);
+            hitMask |= 1 << i;
+        }
     }
-    else
-        return -1;
-#endif // #else of #if DO_HIT_SPHERES_SIMD
+    return hitMask;
 }
@@ -370,9 +370,9 @@ struct SpheresSoA
     SpheresSoA(int c)
     {
         count = c;
-        // we'll be processing spheres in kSimdWidth chunks, so make sure to allocate
+        // we'll be processing spheres in up to kSimdMaxWidth chunks, so make sure to allocate
         // enough space
-        simdCount = (c + (kSimdWidth - 1)) / kSimdWidth * kSimdWidth;
+        simdCount = (c + (kSimdMaxWidth - 1)) / kSimdMaxWidth * kSimdMaxWidth;
         centerX = new float[simdCount];
         centerY = new float[simdCount];
         centerZ = new float[simdCount];
@@ -404,13 +404,98 @@ struct SpheresSoA
 };
 
 
+// Fills in hit position & normal for a ray that hit sphere "id" at distance t
+inline void SetSphereHit(const Ray& r, const SpheresSoA& spheres, int id, float t, Hit& outHit)
+{
+    outHit.pos = r.pointAt(t);
+    outHit.normal = (outHit.pos - float3(spheres.centerX[id], spheres.centerY[id], spheres.centerZ[id])) * spheres.invRadius[id];
+    outHit.t = t;
+}
+
+// Finds closest hit against [start,end) range of spheres (for SIMD code path both have to be multiples of kSimdWidth).
+// Returns index of hit sphere (and reduces inoutTMax to hit distance), or -1 if nothing was hit.
+// Uses the widest SIMD kernel picked at startup (see Kernels.h).
+int HitSpheresRange(const Ray& r, const SpheresSoA& spheres, int start, int end, float tMin, float& inoutTMax);
 int HitSpheres(const Ray& r, const SpheresSoA& spheres, float tMin, float tMax, Hit& outHit);
 
+// Returns whether any sphere in [start,end) range, other than ignoreIndex, is hit within (tMin,tMax).
+// Stops at the first one found, and does not compute any hit data; for shadow rays.
+bool OccludedSpheresRange(const Ray& r, const SpheresSoA& spheres, int start, int end, float tMin, float tMax, int ignoreIndex);
+bool OccludedSpheres(const Ray& r, const SpheresSoA& spheres, float tMin, float tMax, int ignoreID);
+
+
+// kRayPacketSize rays in "structure of arrays" layout, so that a bunch of coherent rays (e.g. primary
+// camera rays) can be tested against one sphere at once; the transposed version of HitSpheres.
+#define kRayPacketSize 8
+struct RayPacket
+{
+    void Set(int index, const Ray& r)
+    {
+        origX[index] = r.orig.getX(); origY[index] = r.orig.getY(); origZ[index] = r.orig.getZ();
+        dirX[index] = r.dir.getX(); dirY[index] = r.dir.getY(); dirZ[index] = r.dir.getZ();
+    }
+    Ray Get(int index) const
+    {
+        return Ray(float3(origX[index], origY[index], origZ[index]), float3(dirX[index], dirY[index], dirZ[index]));
+    }
+
+    float origX[kRayPacketSize], origY[kRayPacketSize], origZ[kRayPacketSize];
+    float dirX[kRayPacketSize], dirY[kRayPacketSize], dirZ[kRayPacketSize];
+};
+
+// Finds closest hits for all rays of the packet against [start,end) range of spheres. inoutTMax and
+// inoutID are per-ray arrays; for rays that hit something closer they get the new distance & sphere index.
+void HitSpheresPacketRange(const RayPacket& rays, const SpheresSoA& spheres, int start, int end, float tMin, float* inoutTMax, int* inoutID);
+// HitSpheres for all rays of the packet; returns bit mask of rays that hit anything.
+unsigned HitSpheresPacket(const RayPacket& rays, const SpheresSoA& spheres, float tMin, float tMax, Hit* outHits, int* outIDs);
+
+// Hash for counter-based random numbers: PCG output permutation of an LCG step (Jarzynski & Olano 2020,
+// "Hash Functions for GPU Rendering").
+inline uint32_t PcgHash(uint32_t x)
+{
+    uint32_t state = x * 747796405u + 2891336453u;
+    uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+// Random number in [0,1). state is just a counter: each call hashes it and then increments it, so the numbers only
+// depend on what the counter got started from (e.g. a hash of pixel, sample & bounce; see PathID in Test.cpp).
 float RandomFloat01(uint32_t& state);
 float3 RandomInUnitDisk(uint32_t& state);
 float3 RandomInUnitSphere(uint32_t& state);
 float3 RandomUnitVector(uint32_t& state);
 
+// Point number index of a 2D Owen-scrambled Sobol sequence, in [0,1)^2 (Burley 2020, "Practical Hash-based
+// Owen Scrambling"). Each seed gives a differently scrambled & shuffled sequence; any 2^k consecutive points
+// from the start are well stratified, so use indices 0,1,2,... for the samples of one pixel.
+void SobolOwen2D(uint32_t index, uint32_t seed, float& outX, float& outY);
+
+// Unit vectors outT, outB that together with unit vector n make an orthonormal basis; no branches or
+// normalization (Duff et al. 2017, "Building an Orthonormal Basis, Revisited").
+inline void OrthonormalBasis(const float3& n, float3& outT, float3& outB)
+{
+    float nx = n.getX(), ny = n.getY(), nz = n.getZ();
+    float sign = copysignf(1.0f, nz);
+    float a = -1.0f / (sign + nz);
+    float b = nx * ny * a;
+    outT = float3(1.0f + sign * nx * nx * a, sign * b, -sign * nx);
+    outB = float3(b, sign + ny * ny * a, -ny);
+}
+// Point in the unit disk from two uniform [0,1) numbers, keeping areas (concentric mapping, Shirley & Chiu 1997)
+void SampleConcentricDisk(float u1, float u2, float& outX, float& outY);
+// Cosine-weighted direction in the hemisphere around unit vector n, from two uniform [0,1) numbers:
+// concentric mapping onto a disk, projected up onto the hemisphere. outPdf is its density over solid angle, cos/pi.
+float3 SampleCosineHemisphere(const float3& n, float u1, float u2, float& outPdf);
+
+// How many times RandomInUnitDisk / RandomInUnitSphere were called, and how many rejection sampling
+// loop iterations that took, on the current thread (for statistics).
+struct SamplingCounters
+{
+    uint64_t diskCalls, diskIterations;
+    uint64_t sphereCalls, sphereIterations;
+};
+extern thread_local SamplingCounters g_SamplingCounters;
+
 struct Camera
 {
     Camera() {}
@@ -440,6 +525,14 @@ struct Camera
         float3 offset = uu.toFloat3() * rd.getX() + vv.toFloat3() * rd.getY();
         return Ray(origin.toFloat3() + offset, normalize(lowerLeftCorner.toFloat3() + s*horizontal.toFloat3() + t*vertical.toFloat3() - origin.toFloat3() - offset));
     }
+    // same, with the point on the lens coming from a 2D sample (lensU, lensV in [0,1)) instead of random
+    Ray GetRay(float s, float t, float lensU, float lensV) const
+    {
+        float dx, dy;
+        SampleConcentricDisk(lensU, lensV, dx, dy);
+        float3 offset = uu.toFloat3() * (lensRadius * dx) + vv.toFloat3() * (lensRadius * dy);
+        return Ray(origin.toFloat3() + offset, normalize(lowerLeftCorner.toFloat3() + s*horizontal.toFloat3() + t*vertical.toFloat3() - origin.toFloat3() - offset));
+    }
 
     float3pack origin;
     float3pack lowerLeftCorner;
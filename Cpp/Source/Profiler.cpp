@@ -0,0 +1,142 @@
+#define _CRT_SECURE_NO_WARNINGS // fopen
+#include "Profiler.h"
+#include <atomic>
+#include <chrono>
+#include <stdio.h>
+
+struct ProfilerEvent
+{
+    uint64_t start; // nanoseconds since ProfilerInit
+    uint64_t duration;
+    const char* name;
+    int frame;
+    int arg0, arg1;
+    bool instant; // point in time instead of a zone
+};
+
+// Written only by the thread that owns it; read when writing out the trace, between frames.
+struct ProfilerThread
+{
+    ProfilerEvent* events;
+    uint64_t count; // total ever written; index into events is count % kProfilerEventsPerThread
+    // start times of the enkiTS wait states currently in progress
+    uint64_t suspendStart, waitStart, waitSuspendStart;
+    char padding[64];
+};
+
+static ProfilerThread* s_Threads;
+static int s_ThreadCount;
+static std::atomic<bool> s_Enabled;
+static std::atomic<int> s_Frame;
+static std::chrono::steady_clock::time_point s_StartTime;
+
+void ProfilerInit(int threadCount)
+{
+    s_ThreadCount = threadCount;
+    s_Threads = new ProfilerThread[threadCount];
+    for (int i = 0; i < threadCount; ++i)
+    {
+        s_Threads[i].events = new ProfilerEvent[kProfilerEventsPerThread];
+        s_Threads[i].count = 0;
+        s_Threads[i].suspendStart = s_Threads[i].waitStart = s_Threads[i].waitSuspendStart = 0;
+    }
+    s_Frame = -1;
+    s_StartTime = std::chrono::steady_clock::now();
+}
+
+void ProfilerShutdown()
+{
+    for (int i = 0; i < s_ThreadCount; ++i)
+        delete[] s_Threads[i].events;
+    delete[] s_Threads;
+    s_Threads = NULL;
+    s_ThreadCount = 0;
+}
+
+void ProfilerSetEnabled(bool enabled)
+{
+    s_Enabled = enabled;
+}
+
+bool ProfilerIsEnabled()
+{
+    return s_Enabled.load(std::memory_order_relaxed);
+}
+
+int ProfilerBeginFrame()
+{
+    return ++s_Frame;
+}
+
+uint64_t ProfilerGetTime()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - s_StartTime).count();
+}
+
+static void AddEvent(int threadnum, const char* name, uint64_t start, uint64_t duration, int arg0, int arg1, bool instant)
+{
+    if (!ProfilerIsEnabled() || threadnum < 0 || threadnum >= s_ThreadCount)
+        return;
+    ProfilerThread& t = s_Threads[threadnum];
+    ProfilerEvent& e = t.events[t.count % kProfilerEventsPerThread];
+    e.start = start;
+    e.duration = duration;
+    e.name = name;
+    e.frame = s_Frame.load(std::memory_order_relaxed);
+    e.arg0 = arg0;
+    e.arg1 = arg1;
+    e.instant = instant;
+    ++t.count;
+}
+
+void ProfilerZone(int threadnum, const char* name, uint64_t startTime, int arg0, int arg1)
+{
+    AddEvent(threadnum, name, startTime, ProfilerGetTime() - startTime, arg0, arg1, false);
+}
+
+
+void ProfilerThreadStart(uint32_t threadnum) { AddEvent(threadnum, "thread start", ProfilerGetTime(), 0, -1, -1, true); }
+void ProfilerThreadStop(uint32_t threadnum) { AddEvent(threadnum, "thread stop", ProfilerGetTime(), 0, -1, -1, true); }
+
+// ignore threads that were not accounted for in ProfilerInit
+#define PROFILER_THREAD_OR_RETURN(threadnum) if ((int)threadnum >= s_ThreadCount || s_Threads == NULL) return; ProfilerThread& t = s_Threads[threadnum]
+
+void ProfilerWaitForNewTaskSuspendStart(uint32_t threadnum) { PROFILER_THREAD_OR_RETURN(threadnum); t.suspendStart = ProfilerGetTime(); }
+void ProfilerWaitForNewTaskSuspendStop(uint32_t threadnum) { PROFILER_THREAD_OR_RETURN(threadnum); ProfilerZone(threadnum, "sleep (no tasks)", t.suspendStart); }
+void ProfilerWaitForTaskCompleteStart(uint32_t threadnum) { PROFILER_THREAD_OR_RETURN(threadnum); t.waitStart = ProfilerGetTime(); }
+void ProfilerWaitForTaskCompleteStop(uint32_t threadnum) { PROFILER_THREAD_OR_RETURN(threadnum); ProfilerZone(threadnum, "wait for tasks", t.waitStart); }
+void ProfilerWaitForTaskCompleteSuspendStart(uint32_t threadnum) { PROFILER_THREAD_OR_RETURN(threadnum); t.waitSuspendStart = ProfilerGetTime(); }
+void ProfilerWaitForTaskCompleteSuspendStop(uint32_t threadnum) { PROFILER_THREAD_OR_RETURN(threadnum); ProfilerZone(threadnum, "sleep (waiting for tasks)", t.waitSuspendStart); }
+
+
+bool ProfilerWriteChromeTrace(const char* path, int firstFrame, int lastFrame)
+{
+    FILE* f = fopen(path, "wb");
+    if (!f)
+        return false;
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"ToyPathTracer\"}}");
+    for (int i = 0; i < s_ThreadCount; ++i)
+    {
+        fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%i,\"args\":{\"name\":\"%s %i\"}}", i, i == 0 ? "main" : "worker", i);
+        const ProfilerThread& t = s_Threads[i];
+        uint64_t first = t.count > kProfilerEventsPerThread ? t.count - kProfilerEventsPerThread : 0;
+        for (uint64_t j = first; j < t.count; ++j)
+        {
+            const ProfilerEvent& e = t.events[j % kProfilerEventsPerThread];
+            if (e.frame < firstFrame || e.frame > lastFrame)
+                continue;
+            // chrome trace times are in microseconds
+            if (e.instant)
+                fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%i,\"ts\":%.3f", e.name, i, e.start * 1.0e-3);
+            else
+                fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%i,\"ts\":%.3f,\"dur\":%.3f", e.name, i, e.start * 1.0e-3, e.duration * 1.0e-3);
+            fprintf(f, ",\"args\":{\"frame\":%i", e.frame);
+            if (e.arg0 >= 0)
+                fprintf(f, ",\"start\":%i,\"end\":%i", e.arg0, e.arg1);
+            fprintf(f, "}}");
+        }
+    }
+    fprintf(f, "\n]}\n");
+    return fclose(f) == 0;
+}
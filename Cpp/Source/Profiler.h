@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+
+// Optional recorder of what the worker threads are doing: enkiTS scheduler events (waiting, sleeping)
+// and tracing job zones. Each thread writes into its own ring buffer (oldest events get overwritten),
+// and the recorded events can be written out as Chrome trace event JSON, for viewing in
+// https://ui.perfetto.dev or chrome://tracing. Recording is off until ProfilerSetEnabled(true).
+
+// events kept per thread
+#define kProfilerEventsPerThread (1 << 16)
+
+void ProfilerInit(int threadCount);
+void ProfilerShutdown();
+
+void ProfilerSetEnabled(bool enabled);
+bool ProfilerIsEnabled();
+
+// Starts a new frame (DrawTest call); events are tagged with the frame they happened in.
+// Returns the frame index, counting from 0.
+int ProfilerBeginFrame();
+
+// Time stamp for zone start
+uint64_t ProfilerGetTime();
+// A zone (name must be a string literal or otherwise stay alive) from startTime until now on the
+// given thread. Two optional integer arguments, e.g. range of rows or tiles.
+void ProfilerZone(int threadnum, const char* name, uint64_t startTime, int arg0 = -1, int arg1 = -1);
+
+// Matching start/stop functions for enkiProfilerCallbacks
+void ProfilerThreadStart(uint32_t threadnum);
+void ProfilerThreadStop(uint32_t threadnum);
+void ProfilerWaitForNewTaskSuspendStart(uint32_t threadnum);
+void ProfilerWaitForNewTaskSuspendStop(uint32_t threadnum);
+void ProfilerWaitForTaskCompleteStart(uint32_t threadnum);
+void ProfilerWaitForTaskCompleteStop(uint32_t threadnum);
+void ProfilerWaitForTaskCompleteSuspendStart(uint32_t threadnum);
+void ProfilerWaitForTaskCompleteSuspendStop(uint32_t threadnum);
+
+// Writes events of frames [firstFrame, lastFrame] that are still in the ring buffers into a JSON file.
+bool ProfilerWriteChromeTrace(const char* path, int firstFrame, int lastFrame);
@@ -1,16 +1,28 @@
 #include "Config.h"
 #include "Test.h"
 #include "Maths.h"
+#include "Bvh.h"
+#include "Kernels.h"
+#include "Profiler.h"
 #include <algorithm>
+#include <string.h>
+#include <vector>
 #if CPU_CAN_DO_THREADS
 #include "enkiTS/TaskScheduler_c.h"
 #endif
-#include <atomic>
+#include <chrono>
 
 // 46 spheres (2 emissive) when enabled; 9 spheres (1 emissive) when disabled
 #define DO_BIG_SCENE 1
+const int kSceneSphereCount = DO_BIG_SCENE ? 46 : 9;
 
-static Sphere s_Spheres[] =
+// Adds this many small emissive spheres floating above the scene, to test light sampling with lots of
+// lights (e.g. -DDO_MANY_LIGHTS=256). CPU only; GPU code can't handle more than kCSMaxObjects spheres.
+#ifndef DO_MANY_LIGHTS
+#define DO_MANY_LIGHTS 0
+#endif
+
+static Sphere s_Spheres[kSceneSphereCount + DO_MANY_LIGHTS] =
 {
     {float3(0,-100.5,-1), 100},
     {float3(2,0,-1), 0.5f},
@@ -32,6 +44,9 @@ static Sphere s_Spheres[] =
 const int kSphereCount = sizeof(s_Spheres) / sizeof(s_Spheres[0]);
 
 static SpheresSoA s_SpheresSoA(kSphereCount);
+#if DO_BVH
+static SphereBvh s_SpheresBvh;
+#endif
 
 struct Material
 {
@@ -66,6 +81,35 @@ static Material s_SphereMats[kSphereCount] =
 static int s_EmissiveSpheres[kSphereCount];
 static int s_EmissiveSphereCount;
 
+// fills in the DO_MANY_LIGHTS spheres after the regular scene ones
+static void InitManyLights()
+{
+    // one light at a random place within each cell of a grid over the scene, so that they don't overlap
+    const int count = kSphereCount - kSceneSphereCount;
+    int gridX = std::max(1, int(ceilf(sqrtf(count * 8.0f / 7.5f))));
+    int gridZ = (count + gridX - 1) / std::max(gridX, 1);
+    float cellX = 8.0f / gridX, cellZ = 7.5f / std::max(gridZ, 1);
+    float radius = std::min(0.04f, 0.4f * std::min(cellX, cellZ));
+    uint32_t state = 0x1234567;
+    for (int i = kSceneSphereCount; i < kSphereCount; ++i)
+    {
+        int cell = i - kSceneSphereCount;
+        float x = -4.0f + ((cell % gridX) + 0.5f) * cellX + (RandomFloat01(state) - 0.5f) * (cellX - 2 * radius);
+        float y = RandomFloat01(state) * 0.8f + 2.0f;
+        float z = -6.0f + ((cell / gridX) + 0.5f) * cellZ + (RandomFloat01(state) - 0.5f) * (cellZ - 2 * radius);
+        s_Spheres[i] = Sphere(float3(x, y, z), radius);
+        // random color, and brightness that varies a lot between lights
+        float3 color = float3(RandomFloat01(state), RandomFloat01(state), RandomFloat01(state)) * 0.5f + float3(0.5f, 0.5f, 0.5f);
+        float brightness = 2.0f + 60.0f * powf(RandomFloat01(state), 4.0f);
+        Material& mat = s_SphereMats[i];
+        mat.type = Material::Lambert;
+        mat.albedo = float3(0.5f, 0.5f, 0.5f);
+        mat.emissive = color * brightness;
+        mat.roughness = 0;
+        mat.ri = 0;
+    }
+}
+
 static Camera s_Cam;
 
 const float kMinT = 0.001f;
@@ -75,63 +119,396 @@ const int kMaxDepth = 10;
 
 bool HitWorld(const Ray& r, float tMin, float tMax, Hit& outHit, int& outID)
 {
+#if DO_BVH4
+    outID = HitBvh4(r, s_SpheresBvh, tMin, tMax, outHit);
+#elif DO_BVH
+    outID = HitBvh(r, s_SpheresBvh, tMin, tMax, outHit);
+#else
     outID = HitSpheres(r, s_SpheresSoA, tMin, tMax, outHit);
+#endif
     return outID != -1;
 }
 
+#if DO_RAY_PACKETS
+// Closest hits for all rays of the packet; outIDs are -1 for rays that did not hit anything
+static void HitWorldPacket(const RayPacket& rays, float tMin, float tMax, Hit* outHits, int* outIDs)
+{
+#if DO_BVH
+    HitBvhPacket(rays, s_SpheresBvh, tMin, tMax, outHits, outIDs);
+#else
+    HitSpheresPacket(rays, s_SpheresSoA, tMin, tMax, outHits, outIDs);
+#endif
+}
+#endif
 
-static bool Scatter(const Material& mat, const Ray& r_in, const Hit& rec, float3& attenuation, Ray& scattered, float3& outLightE, int& inoutRayCount, uint32_t& state)
+// Is anything other than ignoreID hit within (tMin,tMax)?
+static bool OccludedWorld(const Ray& r, float tMin, float tMax, int ignoreID)
 {
-    outLightE = float3(0,0,0);
-    if (mat.type == Material::Lambert)
-    {
-        // random point on unit sphere that is tangent to the hit point
-        float3 target = rec.pos + rec.normal + RandomUnitVector(state);
-        scattered = Ray(rec.pos, normalize(target - rec.pos));
-        float3 matAlbedo = mat.albedo.toFloat3();
-        attenuation = matAlbedo;
+#if DO_BVH4
+    return OccludedBvh4(r, s_SpheresBvh, tMin, tMax, ignoreID);
+#elif DO_BVH
+    return OccludedBvh(r, s_SpheresBvh, tMin, tMax, ignoreID);
+#else
+    return OccludedSpheres(r, s_SpheresSoA, tMin, tMax, ignoreID);
+#endif
+}
+
+
+static float Luminance(const float3& c)
+{
+    return dot(c, float3(0.2126f, 0.7152f, 0.0722f));
+}
+
+// Density of metal reflection directions: normalize(refl + roughness * p), with p uniform inside unit sphere.
+// That is the part of the ray along dir that is inside the sphere of radius roughness around refl, weighted by t^2.
+static float MetalScatterPdf(float3 refl, float roughness, float3 dir)
+{
+    float b = dot(dir, refl);
+    float discr = b * b - 1.0f + roughness * roughness;
+    if (discr <= 0)
+        return 0;
+    float sq = sqrtf(discr);
+    float t0 = std::max(b - sq, 0.0f), t1 = b + sq;
+    if (t1 <= 0)
+        return 0;
+    return (t1 * t1 * t1 - t0 * t0 * t0) / (4 * kPI * roughness * roughness * roughness);
+}
 
-        // sample lights
 #if DO_LIGHT_SAMPLING
-        for (int j = 0; j < s_EmissiveSphereCount; ++j)
-        {
-            int i = s_EmissiveSpheres[j];
-            const Material& smat = s_SphereMats[i];
-            if (&mat == &smat)
-                continue; // skip self
-            const Sphere& s = s_Spheres[i];
-
-            // create a random direction towards sphere
-            // coord system for sampling: sw, su, sv
-            float3 sc = s.center.toFloat3();
-            float3 sw = normalize(sc - rec.pos);
-            float3 su = normalize(cross(fabs(sw.getX())>0.01f ? float3(0,1,0):float3(1,0,0), sw));
-            float3 sv = cross(sw, su);
-            // sample sphere by solid angle
-            float cosAMax = sqrtf(1.0f - s.radius*s.radius / sqLength(rec.pos-sc));
-            float eps1 = RandomFloat01(state), eps2 = RandomFloat01(state);
-            float cosA = 1.0f - eps1 + eps1 * cosAMax;
-            float sinA = sqrtf(1.0f - cosA*cosA);
-            float phi = 2 * kPI * eps2;
-            float3 l = su * (cosf(phi) * sinA) + sv * (sinf(phi) * sinA) + sw * cosA;
-            //l = normalize(l); // NOTE(fg): This is already normalized, by construction.
-
-            // shoot shadow ray
-            Hit lightHit;
-            int hitID;
-            ++inoutRayCount;
-            if (HitWorld(Ray(rec.pos, l), kMinT, kMaxT, lightHit, hitID) && hitID == i)
-            {
-                float omega = 2 * kPI * (1-cosAMax);
+static LightSampling s_LightSampling = kLightSamplingAll;
+static int s_LightSamplesPerHit = 1;
+const int kMaxLightSamplesPerHit = 8;
 
-                float3 rdir = r_in.dir;
-                AssertUnit(rdir);
-                float3 nl = dot(rec.normal, rdir) < 0 ? rec.normal : -rec.normal;
-                float3 smatEmissive = smat.emissive.toFloat3();
-                outLightE += (matAlbedo * smatEmissive) * (std::max(0.0f, dot(l, nl)) * omega / kPI);
-            }
+// Alias table (Vose's method) for picking a light proportional to its emitted power, in constant time:
+// pick a random slot, then either its light or the alias, based on the slot probability.
+struct LightAlias
+{
+    float prob;
+    int alias;
+};
+static LightAlias s_LightAlias[kSphereCount];
+static float s_LightPowerPdf[kSphereCount]; // by index into s_EmissiveSpheres
+static int s_LightIndices[kSphereCount]; // sphere ID -> index into s_EmissiveSpheres, -1 if not a light
+#if DO_BVH
+static LightBvh s_LightBvh;
+#endif
+static bool s_LightSamplingBuilt;
+
+// Alias table & light hierarchy for randomly picking lights
+static void BuildLightSampling()
+{
+    int n = s_EmissiveSphereCount;
+    float total = 0;
+    for (int i = 0; i < kSphereCount; ++i)
+        s_LightIndices[i] = -1;
+    for (int i = 0; i < n; ++i)
+    {
+        s_LightIndices[s_EmissiveSpheres[i]] = i;
+        const Sphere& s = s_Spheres[s_EmissiveSpheres[i]];
+        // emitted power is proportional to radiance times surface area
+        s_LightPowerPdf[i] = Luminance(s_SphereMats[s_EmissiveSpheres[i]].emissive.toFloat3()) * s.radius * s.radius;
+        total += s_LightPowerPdf[i];
+    }
+    int small[kSphereCount], large[kSphereCount];
+    float scaled[kSphereCount];
+    int smallCount = 0, largeCount = 0;
+    for (int i = 0; i < n; ++i)
+    {
+        s_LightPowerPdf[i] = total > 0 ? s_LightPowerPdf[i] / total : 1.0f / n;
+        scaled[i] = s_LightPowerPdf[i] * n;
+        if (scaled[i] < 1.0f)
+            small[smallCount++] = i;
+        else
+            large[largeCount++] = i;
+    }
+    while (smallCount > 0 && largeCount > 0)
+    {
+        int l = small[--smallCount];
+        int g = large[--largeCount];
+        s_LightAlias[l].prob = scaled[l];
+        s_LightAlias[l].alias = g;
+        scaled[g] = (scaled[g] + scaled[l]) - 1.0f;
+        if (scaled[g] < 1.0f)
+            small[smallCount++] = g;
+        else
+            large[largeCount++] = g;
+    }
+    // leftovers are 1 up to floating point error
+    while (largeCount > 0)
+    {
+        int g = large[--largeCount];
+        s_LightAlias[g].prob = 1.0f;
+        s_LightAlias[g].alias = g;
+    }
+    while (smallCount > 0)
+    {
+        int l = small[--smallCount];
+        s_LightAlias[l].prob = 1.0f;
+        s_LightAlias[l].alias = l;
+    }
+
+#if DO_BVH
+    BuildLightBvh(s_LightBvh, s_Spheres, s_EmissiveSpheres, s_LightPowerPdf, n);
+#endif
+}
+
+// solid angle that sphere id covers as seen from pos
+static float SphereSolidAngle(float3 pos, int id)
+{
+    const Sphere& s = s_Spheres[id];
+    float sinSq = std::min(s.radius * s.radius / sqLength(pos - float3(s.center.x, s.center.y, s.center.z)), 1.0f);
+    return 2 * kPI * (1.0f - sqrtf(1.0f - sinSq));
+}
+
+static float SolidAngleLightWeight(float3 pos, int id, int selfID)
+{
+    if (id == selfID)
+        return 0;
+    return Luminance(s_SphereMats[id].emissive.toFloat3()) * SphereSolidAngle(pos, id);
+}
+
+// Picks up to s_LightSamplesPerHit lights (sphere IDs, with repetition) for shading point pos with normal,
+// and the probability of picking each (by sphere ID). Returns number of picked lights.
+static int SelectLights(float3 pos, float3 normal, int selfID, uint32_t& state, int* outIDs, float* outPdfs)
+{
+    int n = s_EmissiveSphereCount;
+    if (n == 0)
+        return 0;
+    int count = s_LightSamplesPerHit;
+#if DO_BVH
+    if (s_LightSampling == kLightSamplingBvh)
+    {
+        // traversal can find that no light can reach the point, so there can be fewer
+        int selected = 0;
+        for (int k = 0; k < count; ++k)
+        {
+            float pdf;
+            int i = SampleLightBvh(s_LightBvh, pos, normal, s_LightIndices[selfID], state, pdf);
+            if (i < 0)
+                continue;
+            outIDs[selected] = s_EmissiveSpheres[i];
+            outPdfs[outIDs[selected]] = pdf;
+            ++selected;
+        }
+        return selected;
+    }
+#endif
+    if (s_LightSampling == kLightSamplingPower)
+    {
+        for (int k = 0; k < count; ++k)
+        {
+            float u = RandomFloat01(state) * n;
+            int i = std::min(int(u), n - 1);
+            if (u - i >= s_LightAlias[i].prob)
+                i = s_LightAlias[i].alias;
+            outIDs[k] = s_EmissiveSpheres[i];
+            outPdfs[outIDs[k]] = s_LightPowerPdf[i];
+        }
+        return count;
+    }
+
+    // proportional to radiance times the solid angle that the light covers from pos; a rough estimate
+    // of how much it contributes here. Has to look at all the lights, but shoots only a few shadow rays.
+    float weights[kSphereCount];
+    float total = 0;
+    for (int i = 0; i < n; ++i)
+    {
+        weights[i] = SolidAngleLightWeight(pos, s_EmissiveSpheres[i], selfID);
+        total += weights[i];
+    }
+    if (total <= 0)
+        return 0;
+    for (int k = 0; k < count; ++k)
+    {
+        float u = RandomFloat01(state) * total;
+        int i = 0;
+        while (i < n - 1 && (u >= weights[i] || weights[i] == 0))
+            u -= weights[i++];
+        outIDs[k] = s_EmissiveSpheres[i];
+        outPdfs[outIDs[k]] = weights[i] / total;
+    }
+    return count;
+}
+
+// How many times, on average, SampleLights at pos picks light id
+static float LightSelectCount(float3 pos, float3 normal, int selfID, int id)
+{
+    int i = s_LightIndices[id];
+    if (i < 0 || id == selfID)
+        return 0;
+    switch (s_LightSampling)
+    {
+    case kLightSamplingAll:
+        return 1;
+    case kLightSamplingPower:
+        return s_LightSamplesPerHit * s_LightPowerPdf[i];
+#if DO_BVH
+    case kLightSamplingBvh:
+        return s_LightSamplesPerHit * LightBvhPdf(s_LightBvh, pos, normal, s_LightIndices[selfID], i);
+#endif
+    default:
+        {
+            float total = 0;
+            for (int j = 0; j < s_EmissiveSphereCount; ++j)
+                total += SolidAngleLightWeight(pos, s_EmissiveSpheres[j], selfID);
+            return total > 0 ? s_LightSamplesPerHit * SolidAngleLightWeight(pos, id, selfID) / total : 0;
         }
+    }
+}
+
+static MisHeuristic s_Mis = (MisHeuristic)DO_MIS_HEURISTIC;
+
+// Multiple importance sampling: weight of a sample from a strategy with density pdfA (over solid angle), when
+// another strategy with density pdfB could have produced it too; the weights of both add up to one.
+static float MisWeight(float pdfA, float pdfB)
+{
+    if (pdfA <= 0)
+        return 0;
+    float ratio = pdfB / pdfA;
+    if (s_Mis == kMisPower)
+        ratio *= ratio;
+    return 1.0f / (1.0f + ratio);
+}
+
+// Density (over solid angle) of Scatter picking direction dir; 0 where it can't go there, or for
+// materials that reflect into just one direction.
+static float ScatterPdf(const Material& mat, const Ray& r_in, const Hit& rec, float3 dir)
+{
+    if (mat.type == Material::Lambert)
+        return std::max(0.0f, dot(dir, rec.normal)) / kPI;
+    if (mat.type == Material::Metal && mat.roughness > 0 && !DO_MITSUBA_COMPARE && dot(dir, rec.normal) > 0)
+        return MetalScatterPdf(reflect(r_in.dir, rec.normal), mat.roughness, dir);
+    return 0;
+}
+
+// Lambert surfaces always get light samples; rough metals only with MIS, since a shiny one would rarely
+// reflect in the sampled light direction (and then the light hit by its own reflection should count instead).
+static bool HasLightSamples(const Material& mat)
+{
+    if (mat.type == Material::Lambert)
+        return true;
+    return s_Mis != kMisOff && mat.type == Material::Metal && mat.roughness > 0 && !DO_MITSUBA_COMPARE;
+}
+
+// Explicit light (emissive) sampling for a surface hit: picks a direction towards each light
+// (or a few randomly selected ones, see SetLightSampling), and how much it would contribute if the shadow
+// ray towards it is not occluded. Returns sample count.
+static int SampleLights(const Material& mat, const Ray& r_in, const Hit& rec, uint32_t& state, LightSample* outSamples, float3* outLightE)
+{
+    int selfID = int(&mat - s_SphereMats);
+    float3 rdir = r_in.dir;
+    AssertUnit(rdir);
+    float3 nl = dot(rec.normal, rdir) < 0 ? rec.normal : -rec.normal;
+    int lightSampleCount;
+    int selectedIDs[kMaxLightSamplesPerHit];
+    float selectPdf[kSphereCount];
+    bool selected = s_LightSampling != kLightSamplingAll;
+    if (!selected)
+        lightSampleCount = g_Kernels.sampleLights(rec.pos, s_Spheres, s_EmissiveSpheres, s_EmissiveSphereCount, selfID, state, outSamples);
+    else
+    {
+        int selectedCount = SelectLights(rec.pos, nl, selfID, state, selectedIDs, selectPdf);
+        lightSampleCount = g_Kernels.sampleLights(rec.pos, s_Spheres, selectedIDs, selectedCount, selfID, state, outSamples);
+    }
+    float3 matAlbedo = mat.albedo.toFloat3();
+    for (int j = 0; j < lightSampleCount; ++j)
+    {
+        const LightSample& ls = outSamples[j];
+        float3 smatEmissive = s_SphereMats[ls.id].emissive.toFloat3();
+        // light direction is uniform within the cone towards the light, i.e. density 1/omega;
+        // randomly selected lights stand in for all of them
+        float selectCount = selected ? s_LightSamplesPerHit * selectPdf[ls.id] : 1.0f;
+        float weight = ls.omega / selectCount;
+        // BRDF times cosine is albedo times scatter density, for our materials
+        float scatterPdf = ScatterPdf(mat, r_in, rec, ls.dir);
+        if (s_Mis != kMisOff)
+            weight *= MisWeight(selectCount / ls.omega, scatterPdf);
+        outLightE[j] = (matAlbedo * smatEmissive) * (scatterPdf * weight);
+    }
+    return lightSampleCount;
+}
+
+// Previous vertex of a path, for weighting emission that its bounce ray hits against the light samples taken there
+struct PathVertex
+{
+    float3pack pos;
+    float3pack normal; // facing the incoming ray
+    int id;
+    float scatterPdf; // density of the bounce direction
+    bool lightSampled;
+};
+
+static void SetPathVertex(PathVertex& v, const Material& mat, const Ray& r_in, const Hit& rec, float scatterPdf)
+{
+    v.lightSampled = HasLightSamples(mat);
+    if (!v.lightSampled)
+        return;
+    v.pos = rec.pos;
+    v.normal = dot(rec.normal, r_in.dir) < 0 ? rec.normal : -rec.normal;
+    v.id = int(&mat - s_SphereMats);
+    v.scatterPdf = scatterPdf;
+}
+
+static float EmissionWeight(const PathVertex& prev, int id)
+{
+    if (!prev.lightSampled)
+        return 1;
+    // without MIS, light samples alone account for all the light
+    if (s_Mis == kMisOff)
+        return 0;
+    float3 pos = prev.pos.toFloat3();
+    float selectCount = LightSelectCount(pos, prev.normal.toFloat3(), prev.id, id);
+    if (selectCount <= 0)
+        return 1;
+    return MisWeight(prev.scatterPdf, selectCount / SphereSolidAngle(pos, id));
+}
+
+// Light sampling with shadow rays shot right away
+static float3 TraceLights(const Material& mat, const Ray& r_in, const Hit& rec, RayStats& stats, uint32_t& state)
+{
+    LightSample lightSamples[kSphereCount];
+    float3 lightSampleE[kSphereCount];
+    int lightSampleCount = SampleLights(mat, r_in, rec, state, lightSamples, lightSampleE);
+    float3 lightE(0,0,0);
+    for (int j = 0; j < lightSampleCount; ++j)
+    {
+        const LightSample& ls = lightSamples[j];
+        // shoot shadow ray; anything in front of the light blocks it
+        ++stats.shadowRays;
+        if (!OccludedWorld(Ray(rec.pos, ls.dir), kMinT, ls.dist, ls.id))
+            lightE += lightSampleE[j];
+        else
+            ++stats.shadowRaysOccluded;
+    }
+    return lightE;
+}
+#endif // #if DO_LIGHT_SAMPLING
+
+// most light samples (shadow rays) that a surface hit can have
+static int GetLightSamplesPerHit()
+{
+#if DO_LIGHT_SAMPLING
+    return s_LightSampling == kLightSamplingAll ? s_EmissiveSphereCount : s_LightSamplesPerHit;
+#else
+    return 0;
 #endif
+}
+
+
+// Picks the direction that the ray continues in after hitting a surface, and its density over solid angle
+// (outPdf; 0 for materials that reflect into just one direction). Returns false if the ray got absorbed.
+// Diffuse directions come from the 2D sample u1, u2; other random choices from state.
+static bool Scatter(const Material& mat, const Ray& r_in, const Hit& rec, float u1, float u2, float3& attenuation, Ray& scattered, float& outPdf, uint32_t& state)
+{
+    outPdf = 0;
+    if (mat.type == Material::Lambert)
+    {
+        // cosine weighted direction; same distribution as the direction towards a random point
+        // on unit sphere that is tangent to the hit point. Normalized since hit normals are only
+        // roughly unit length, and grazing rays are sensitive to that.
+        scattered = Ray(rec.pos, normalize(SampleCosineHemisphere(rec.normal, u1, u2, outPdf)));
+        float3 matAlbedo = mat.albedo.toFloat3();
+        attenuation = matAlbedo;
         return true;
     }
     else if (mat.type == Material::Metal)
@@ -144,6 +521,8 @@ static bool Scatter(const Material& mat, const Ray& r_in, const Hit& rec, float3
         roughness = 0; // until we get better BRDF for metals
 #endif
         scattered = Ray(rec.pos, normalize(refl + roughness*RandomInUnitSphere(state)));
+        if (roughness > 0)
+            outPdf = MetalScatterPdf(refl, roughness, scattered.dir);
         float3 matAlbedo = mat.albedo.toFloat3();
         attenuation = matAlbedo;
         return dot(scattered.dir, rec.normal) > 0;
@@ -156,7 +535,7 @@ static bool Scatter(const Material& mat, const Ray& r_in, const Hit& rec, float3
         float3 refl = reflect(rdir, rec.normal);
         float nint;
         attenuation = float3(1,1,1);
-        float3 refr;
+        float3 refr(0, 0, 0);
         float reflProb;
         float cosine;
         if (dot(rdir, rec.normal) > 0)
@@ -192,57 +571,233 @@ static bool Scatter(const Material& mat, const Ray& r_in, const Hit& rec, float3
     return true;
 }
 
-static float3 Trace(const Ray& r, int depth, int& inoutRayCount, uint32_t& state, bool doMaterialE = true)
+static float3 SkyColor(const float3& unitDir)
+{
+#if DO_MITSUBA_COMPARE
+    return float3(0.15f,0.21f,0.3f); // easier compare with Mitsuba's constant environment light
+#else
+    float t = 0.5f*(unitDir.getY() + 1.0f);
+    return ((1.0f-t)*float3(1.0f, 1.0f, 1.0f) + t*float3(0.5f, 0.7f, 1.0f)) * 0.3f;
+#endif
+}
+
+// Random numbers are counter-based (see RandomFloat01): each path gets a key from its pixel & sample index,
+// and at each bounce the counter starts from a hash of that & the bounce. So every random number depends only on
+// where it is used, not on what got traced before it or by which thread; images come out the same no matter
+// how the work is split up. Wavefront tracing uses the same numbers as path-at-a-time tracing.
+struct PathID
+{
+    uint32_t pixel;
+    uint32_t sample; // index among all samples of the pixel since accumulation started
+    uint32_t key;
+};
+
+static PathID MakePathID(uint32_t pixel, uint32_t sample)
+{
+    PathID path;
+    path.pixel = pixel;
+    path.sample = sample;
+    path.key = PcgHash(pixel + PcgHash(sample));
+    return path;
+}
+
+// counter for RandomFloat01 at a bounce of a path; bounce 0 is the camera ray
+static uint32_t BounceRngState(const PathID& path, int bounce)
+{
+    return PcgHash(path.key ^ PcgHash(uint32_t(bounce)));
+}
+
+static Sampler s_Sampler = (Sampler)DO_SAMPLER;
+
+// Dimensions of 2D samples along a path: position in the pixel, on the lens, then the direction
+// picked at each bounce (kDimBounce + depth). Everything else uses random numbers.
+enum { kDimPixel, kDimLens, kDimBounce };
+
+// 2D sample in [0,1) for dimension dim of the path. Random ones come from state, the counter of the current
+// bounce; with Sobol, the samples of a pixel are consecutive points of a sequence scrambled per pixel & dimension.
+static void Sample2D(const PathID& path, int dim, uint32_t& state, float& outU, float& outV)
+{
+    if (s_Sampler == kSamplerSobol)
+        SobolOwen2D(path.sample, PcgHash(PcgHash(path.pixel) ^ uint32_t(dim)), outU, outV);
+    else
+    {
+        outU = RandomFloat01(state);
+        outV = RandomFloat01(state);
+    }
+}
+
+// a path just ended after this many bounces
+static void CountPathEnd(RayStats& stats, int depth)
+{
+    ++stats.pathDepth[std::min(depth, kRayStatsDepthBuckets - 1)];
+}
+
+static int s_RouletteDepth = DO_RUSSIAN_ROULETTE_DEPTH;
+
+// Russian roulette: a path that already did depth bounces continues with probability based on its
+// throughput, and if it does, throughput is scaled up to make up for the terminated ones (so the expected
+// value stays the same). Dark paths that can't contribute much get terminated early.
+static bool ContinuePath(float3& throughput, int depth, uint32_t& state)
+{
+    if (s_RouletteDepth < 0 || depth < s_RouletteDepth)
+        return true;
+    float p = std::min(std::max(throughput.getX(), std::max(throughput.getY(), throughput.getZ())), 1.0f);
+    if (RandomFloat01(state) >= p)
+        return false;
+    throughput *= 1.0f / p;
+    return true;
+}
+
+// Radiance along ray r, that was already intersected with the world (id is -1 if nothing was hit).
+// Follows the path one bounce at a time, carrying the product of attenuations along the way (throughput).
+static float3 TraceHit(Ray r, int id, Hit rec, RayStats& stats, const PathID& path)
 {
-    Hit rec;
-    int id = 0;
-    ++inoutRayCount;
-    if (HitWorld(r, kMinT, kMaxT, rec, id))
+    float3 color(0,0,0);
+    float3 throughput(1,1,1);
+#if DO_LIGHT_SAMPLING
+    PathVertex prev;
+    prev.lightSampled = false;
+#endif
+    for (int depth = 0; ; ++depth)
     {
+        if (depth == 0)
+            ++stats.primaryRays;
+        else
+            ++stats.bounceRays;
+        if (id == -1)
+        {
+            ++stats.misses;
+            CountPathEnd(stats, depth);
+            return color + throughput * SkyColor(r.dir);
+        }
+        ++stats.hits;
+        uint32_t state = BounceRngState(path, depth + 1);
+        float u1, u2;
+        Sample2D(path, kDimBounce + depth, state, u1, u2);
         Ray scattered;
         float3 attenuation;
-        float3 lightE;
+        float scatterPdf;
         const Material& mat = s_SphereMats[id];
         float3 matE = mat.emissive.toFloat3();
-        if (depth < kMaxDepth && Scatter(mat, r, rec, attenuation, scattered, lightE, inoutRayCount, state))
+#if DO_LIGHT_SAMPLING
+        // if the previous hit did explicit light sampling, that already got (some of) this emission
+        if (prev.lightSampled && (matE.getX() > 0 || matE.getY() > 0 || matE.getZ() > 0))
+            matE *= EmissionWeight(prev, id);
+#endif
+        if (depth >= kMaxDepth)
         {
+            CountPathEnd(stats, depth);
+            return color + throughput * matE;
+        }
+        bool scatterOk = Scatter(mat, r, rec, u1, u2, attenuation, scattered, scatterPdf, state);
+        float3 lightE(0,0,0);
 #if DO_LIGHT_SAMPLING
-            if (!doMaterialE) matE = float3(0,0,0); // don't add material emission if told so
-            // dor Lambert materials, we just did explicit light (emissive) sampling and already
-            // for their contribution, so if next ray bounce hits the light again, don't add
-            // emission
-            doMaterialE = (mat.type != Material::Lambert);
+        // light samples are taken even if the bounce ray got absorbed (rough metal scattering below
+        // the surface): MIS weighs them against the density of the whole lobe, not just its upper part
+        if (HasLightSamples(mat))
+            lightE = TraceLights(mat, r, rec, stats, state);
+        SetPathVertex(prev, mat, r, rec, scatterPdf);
 #endif
-            return matE + lightE + attenuation * Trace(scattered, depth+1, inoutRayCount, state, doMaterialE);
+        if (!scatterOk)
+        {
+            CountPathEnd(stats, depth);
+            return color + throughput * (matE + lightE);
         }
-        else
+        color += throughput * (matE + lightE);
+        throughput *= attenuation;
+        if (!ContinuePath(throughput, depth, state))
         {
-            return matE;
+            CountPathEnd(stats, depth);
+            return color;
         }
+        r = scattered;
+        HitWorld(r, kMinT, kMaxT, rec, id);
     }
-    else
-    {
-        // sky
-#if DO_MITSUBA_COMPARE
-        return float3(0.15f,0.21f,0.3f); // easier compare with Mitsuba's constant environment light
-#else
-        float3 unitDir = r.dir;
-        float t = 0.5f*(unitDir.getY() + 1.0f);
-        return ((1.0f-t)*float3(1.0f, 1.0f, 1.0f) + t*float3(0.5f, 0.7f, 1.0f)) * 0.3f;
+}
+
+void SetRussianRoulette(int minDepth)
+{
+    s_RouletteDepth = minDepth;
+}
+
+void SetMisHeuristic(MisHeuristic heuristic)
+{
+#if DO_LIGHT_SAMPLING
+    s_Mis = heuristic;
 #endif
-    }
+}
+
+void SetSampler(Sampler sampler)
+{
+    s_Sampler = sampler;
 }
 
 #if CPU_CAN_DO_THREADS
 static enkiTaskScheduler* g_TS;
 #endif
 
-void InitializeTest()
+static int s_TileSize = DO_TILE_SIZE;
+static TileOrder s_TileOrder = kTileOrderHilbert;
+// tile order cache, recalculated only when the screen size or tile settings change
+static int* s_Tiles;
+static int s_TilesKey[3];
+
+struct AovSums;
+
+// What each thread did during the last DrawTest. All threads keep adding to theirs, so the
+// padding keeps them on separate cache lines.
+struct ThreadFrameData
+{
+    ThreadFrameData() : busySeconds(0), colors(NULL), samplePixels(NULL), samplePaths(NULL), aovSums(NULL), rowWidth(0), aovWidth(0), sampleCapacity(0) {}
+    double busySeconds; // time spent tracing
+    RayStats stats;
+    // TraceRect row buffers; they only grow (to the widest tile and most samples per row so far),
+    // so tracing does not allocate once they are large enough
+    float* colors; // RGBA, rowWidth pixels
+    int* samplePixels; // sampleCapacity each
+    PathID* samplePaths;
+    AovSums* aovSums; // aovWidth pixels; only allocated once AOVs are used
+    int rowWidth, aovWidth, sampleCapacity;
+    char padding[64];
+};
+static ThreadFrameData* s_ThreadData;
+static int s_ThreadDataCount;
+
+static double GetSeconds()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void FreeAdaptiveSampling();
+static void FreeAOVs();
+static void FreeDenoising();
+static void FreeWavefront();
+static void FreeRowBuffers();
+
+void InitializeTest(int threadCount)
 {
+    SelectKernels(NULL);
+    InitManyLights();
     #if CPU_CAN_DO_THREADS
     g_TS = enkiNewTaskScheduler();
-    enkiInitTaskScheduler(g_TS);
+    struct enkiTaskSchedulerConfig config = enkiGetTaskSchedulerConfig(g_TS);
+    if (threadCount > 0)
+        config.numTaskThreadsToCreate = threadCount - 1;
+    ProfilerInit(config.numTaskThreadsToCreate + config.numExternalTaskThreads + 1);
+    config.profilerCallbacks.threadStart = ProfilerThreadStart;
+    config.profilerCallbacks.threadStop = ProfilerThreadStop;
+    config.profilerCallbacks.waitForNewTaskSuspendStart = ProfilerWaitForNewTaskSuspendStart;
+    config.profilerCallbacks.waitForNewTaskSuspendStop = ProfilerWaitForNewTaskSuspendStop;
+    config.profilerCallbacks.waitForTaskCompleteStart = ProfilerWaitForTaskCompleteStart;
+    config.profilerCallbacks.waitForTaskCompleteStop = ProfilerWaitForTaskCompleteStop;
+    config.profilerCallbacks.waitForTaskCompleteSuspendStart = ProfilerWaitForTaskCompleteSuspendStart;
+    config.profilerCallbacks.waitForTaskCompleteSuspendStop = ProfilerWaitForTaskCompleteSuspendStop;
+    enkiInitTaskSchedulerWithConfig(g_TS, config);
+    #else
+    ProfilerInit(1);
     #endif
+    s_ThreadDataCount = GetThreadCount();
+    s_ThreadData = new ThreadFrameData[s_ThreadDataCount];
 }
 
 void ShutdownTest()
@@ -250,6 +805,26 @@ void ShutdownTest()
     #if CPU_CAN_DO_THREADS
     enkiDeleteTaskScheduler(g_TS);
     #endif
+    ProfilerShutdown();
+    delete[] s_Tiles;
+    s_Tiles = NULL;
+    FreeAdaptiveSampling();
+    FreeAOVs();
+    FreeDenoising();
+    FreeWavefront();
+    FreeRowBuffers();
+    delete[] s_ThreadData;
+    s_ThreadData = NULL;
+    s_ThreadDataCount = 0;
+}
+
+int GetThreadCount()
+{
+    #if CPU_CAN_DO_THREADS
+    return enkiGetNumTaskThreads(g_TS);
+    #else
+    return 1;
+    #endif
 }
 
 struct JobData
@@ -259,90 +834,953 @@ struct JobData
     int screenWidth, screenHeight;
     float* backbuffer;
     Camera* cam;
-    std::atomic<int> rayCount;
     unsigned testFlags;
+    bool adaptive; // samples per pixel come from s_AdaptiveSamples
+    bool aovs; // accumulate s_Aov planes too
+    // when scheduling by tiles: tile indices (y*tilesX+x) in the order they are handed out
+    const int* tiles;
+    int tilesX;
+    int tileSize;
 };
 
-static void TraceRowJob(uint32_t start, uint32_t end, uint32_t threadnum, void* data_)
+// how much of the previous frames to keep when accumulating new frame results
+static float GetLerpFactor(const JobData& data)
 {
-    JobData& data = *(JobData*)data_;
-    float* backbuffer = data.backbuffer + start * data.screenWidth * 4;
-    float invWidth = 1.0f / data.screenWidth;
-    float invHeight = 1.0f / data.screenHeight;
     float lerpFac = float(data.frameCount) / float(data.frameCount+1);
     if (data.testFlags & kFlagAnimate)
         lerpFac *= DO_ANIMATE_SMOOTHING;
     if (!(data.testFlags & kFlagProgressive))
         lerpFac = 0;
-    int rayCount = 0;
-    for (uint32_t y = start; y < end; ++y)
-    {
-        uint32_t state = (y * 9781 + data.frameCount * 6271) | 1;
-        for (int x = 0; x < data.screenWidth; ++x)
-        {
-            float3 col(0, 0, 0);
-            for (int s = 0; s < DO_SAMPLES_PER_PIXEL; s++)
-            {
-                float u = float(x + RandomFloat01(state)) * invWidth;
-                float v = float(y + RandomFloat01(state)) * invHeight;
-                Ray r = data.cam->GetRay(u, v, state);
-                col += Trace(r, 0, rayCount, state);
-            }
-            col *= 1.0f / float(DO_SAMPLES_PER_PIXEL);
+    return lerpFac;
+}
 
-            float3 prev(backbuffer[0], backbuffer[1], backbuffer[2]);
-            col = prev * lerpFac + col * (1-lerpFac);
-            col.store(backbuffer);
-            backbuffer += 4;
-        }
-    }
-    data.rayCount += rayCount;
+// ray through a random point of pixel x,y, for a path of it
+static Ray CameraRay(const JobData& data, int x, int y, const PathID& path)
+{
+    uint32_t state = BounceRngState(path, 0);
+    float du, dv;
+    Sample2D(path, kDimPixel, state, du, dv);
+    float u = float(x + du) * (1.0f / data.screenWidth);
+    float v = float(y + dv) * (1.0f / data.screenHeight);
+    // random lens points keep using rejection sampling
+    if (s_Sampler == kSamplerRandom)
+        return data.cam->GetRay(u, v, state);
+    Sample2D(path, kDimLens, state, du, dv);
+    return data.cam->GetRay(u, v, du, dv);
 }
 
-void UpdateTest(float time, int frameCount, int screenWidth, int screenHeight, unsigned testFlags)
+
+// ---- Wavefront tracing
+//
+// Instead of following one path at a time recursively, all the paths of a tile advance one bounce
+// at a time, through separate intersect / shade / shadow stages. Each stage loops over a queue of
+// rays in "structure of arrays" layout, so the intersection stage can trace them in packets.
+
+// rows of pixels processed together; queues are sized for this many
+const int kWavefrontTileRows = 4;
+
+struct PathQueue
 {
-    if (testFlags & kFlagAnimate)
+    PathQueue()
     {
-        s_Spheres[1].center.y = cosf(time) + 1.0f;
-        s_Spheres[8].center.z = sinf(time) * 0.3f;
+        capacity = 0;
+        count = 0;
+        origX = origY = origZ = NULL;
+        dirX = dirY = dirZ = NULL;
+        throughput = NULL;
+        pixel = NULL;
+        path = NULL;
+#if DO_LIGHT_SAMPLING
+        prev = NULL;
+#endif
+        hitID = NULL;
+        hit = NULL;
     }
-    float3 lookfrom(0, 2, 3);
-    float3 lookat(0, 0, 0);
-    float distToFocus = 3;
-#if DO_MITSUBA_COMPARE
-    float aperture = 0.0f;
-#else
-    float aperture = 0.1f;
+    ~PathQueue() { Free(); }
+    // makes room for at least c paths; previous contents are not kept
+    void Reserve(int c)
+    {
+        if (c <= capacity)
+            return;
+        Free();
+        capacity = c;
+        origX = new float[c]; origY = new float[c]; origZ = new float[c];
+        dirX = new float[c]; dirY = new float[c]; dirZ = new float[c];
+        throughput = new float3pack[c];
+        pixel = new int[c];
+        path = new PathID[c];
+#if DO_LIGHT_SAMPLING
+        prev = new PathVertex[c];
 #endif
-#if DO_BIG_SCENE
-    aperture *= 0.2f;
+        hitID = new int[c];
+        hit = new Hit[c];
+    }
+    void Free()
+    {
+        delete[] origX; delete[] origY; delete[] origZ;
+        delete[] dirX; delete[] dirY; delete[] dirZ;
+        delete[] throughput;
+        delete[] pixel;
+        delete[] path;
+#if DO_LIGHT_SAMPLING
+        delete[] prev;
 #endif
-
-    s_EmissiveSphereCount = 0;
-    for (int i = 0; i < kSphereCount; ++i)
+        delete[] hitID;
+        delete[] hit;
+        capacity = 0;
+    }
+    void SetRay(int i, const Ray& r)
     {
-        Sphere& s = s_Spheres[i];
-        s.UpdateDerivedData();
-        s_SpheresSoA.centerX[i] = s.center.x;
-        s_SpheresSoA.centerY[i] = s.center.y;
-        s_SpheresSoA.centerZ[i] = s.center.z;
-        s_SpheresSoA.sqRadius[i] = s.radius * s.radius;
-        s_SpheresSoA.invRadius[i] = s.invRadius;
+        origX[i] = r.orig.getX(); origY[i] = r.orig.getY(); origZ[i] = r.orig.getZ();
+        dirX[i] = r.dir.getX(); dirY[i] = r.dir.getY(); dirZ[i] = r.dir.getZ();
+    }
+    Ray GetRay(int i) const { return Ray(float3(origX[i], origY[i], origZ[i]), float3(dirX[i], dirY[i], dirZ[i])); }
 
-        // Remember IDs of emissive spheres (light sources)
-        const Material& smat = s_SphereMats[i];
-        if (smat.emissive.x > 0 || smat.emissive.y > 0 || smat.emissive.z > 0)
-        {
-            s_EmissiveSpheres[s_EmissiveSphereCount] = i;
-            s_EmissiveSphereCount++;
+    // rays
+    float *origX, *origY, *origZ;
+    float *dirX, *dirY, *dirZ;
+    // path state
+    float3pack* throughput; // product of attenuations so far
+    int* pixel; // index into tile colors
+    PathID* path;
+#if DO_LIGHT_SAMPLING
+    PathVertex* prev;
+#endif
+    // intersection stage results
+    int* hitID;
+    Hit* hit;
+    int count;
+    int capacity;
+};
+
+struct ShadowQueue
+{
+    ShadowQueue()
+    {
+        capacity = 0;
+        count = 0;
+        origX = origY = origZ = NULL;
+        dirX = dirY = dirZ = NULL;
+        tMax = NULL;
+        lightID = NULL;
+        contribution = NULL;
+        pixel = NULL;
+    }
+    ~ShadowQueue() { Free(); }
+    // makes room for at least c rays; previous contents are not kept
+    void Reserve(int c)
+    {
+        if (c <= capacity)
+            return;
+        Free();
+        capacity = c;
+        origX = new float[c]; origY = new float[c]; origZ = new float[c];
+        dirX = new float[c]; dirY = new float[c]; dirZ = new float[c];
+        tMax = new float[c];
+        lightID = new int[c];
+        contribution = new float3pack[c];
+        pixel = new int[c];
+    }
+    void Free()
+    {
+        delete[] origX; delete[] origY; delete[] origZ;
+        delete[] dirX; delete[] dirY; delete[] dirZ;
+        delete[] tMax;
+        delete[] lightID;
+        delete[] contribution;
+        delete[] pixel;
+        capacity = 0;
+    }
+
+    float *origX, *origY, *origZ;
+    float *dirX, *dirY, *dirZ;
+    float* tMax; // distance to the light
+    int* lightID;
+    float3pack* contribution; // added to the pixel when the light is not occluded
+    int* pixel;
+    int count;
+    int capacity;
+};
+
+// Queues & pixel buffers of one worker thread. They only ever grow, so once they are large enough
+// for the widest tile, tracing does not allocate anything.
+struct WavefrontThreadData
+{
+    WavefrontThreadData() : colors(NULL), rowColors(NULL), width(0) {}
+    ~WavefrontThreadData() { delete[] colors; delete[] rowColors; }
+    void Reserve(int w)
+    {
+        int maxPaths = w * kWavefrontTileRows * DO_SAMPLES_PER_PIXEL;
+        pathsA.Reserve(maxPaths);
+        pathsB.Reserve(maxPaths);
+        shadows.Reserve(maxPaths * std::max(GetLightSamplesPerHit(), 1));
+        if (w <= width)
+            return;
+        delete[] colors;
+        delete[] rowColors;
+        width = w;
+        colors = new float3pack[w * kWavefrontTileRows];
+        rowColors = new float[w * 4];
+    }
+
+    PathQueue pathsA, pathsB;
+    ShadowQueue shadows;
+    float3pack* colors; // one per pixel of the tile
+    float* rowColors; // RGBA, one row
+    int width;
+};
+static WavefrontThreadData* s_WavefrontData; // one per thread, indexed like s_ThreadData
+
+static void FreeWavefront()
+{
+    delete[] s_WavefrontData;
+    s_WavefrontData = NULL;
+}
+
+static void IntersectStage(PathQueue& paths, int depth)
+{
+#if DO_RAY_PACKETS
+    // queue is already in SoA layout, just grab kRayPacketSize rays at a time; only worth it for
+    // camera rays though, bounced rays go all over the place
+    for (int first = 0; depth == 0 && first < paths.count; first += kRayPacketSize)
+    {
+        int packetCount = std::min(kRayPacketSize, paths.count - first);
+        RayPacket packet;
+        for (int i = 0; i < kRayPacketSize; ++i)
+        {
+            int src = first + std::min(i, packetCount - 1); // repeat last ray in unused slots
+            packet.origX[i] = paths.origX[src]; packet.origY[i] = paths.origY[src]; packet.origZ[i] = paths.origZ[src];
+            packet.dirX[i] = paths.dirX[src]; packet.dirY[i] = paths.dirY[src]; packet.dirZ[i] = paths.dirZ[src];
+        }
+        Hit hits[kRayPacketSize];
+        int ids[kRayPacketSize];
+        HitWorldPacket(packet, kMinT, kMaxT, hits, ids);
+        for (int i = 0; i < packetCount; ++i)
+        {
+            paths.hitID[first + i] = ids[i];
+            paths.hit[first + i] = hits[i];
+        }
+    }
+    if (depth == 0)
+        return;
+#endif
+    for (int i = 0; i < paths.count; ++i)
+        HitWorld(paths.GetRay(i), kMinT, kMaxT, paths.hit[i], paths.hitID[i]);
+}
+
+// Adds emission & sky to the pixels, scatters surviving paths into the next queue, and emits shadow rays
+static void ShadeStage(const PathQueue& paths, int depth, PathQueue& nextPaths, ShadowQueue& shadows, float3pack* colors, RayStats& stats)
+{
+    nextPaths.count = 0;
+    shadows.count = 0;
+    if (depth == 0)
+        stats.primaryRays += paths.count;
+    else
+        stats.bounceRays += paths.count;
+    for (int i = 0; i < paths.count; ++i)
+    {
+        Ray r = paths.GetRay(i);
+        float3 throughput = paths.throughput[i].toFloat3();
+        float3pack& col = colors[paths.pixel[i]];
+        int id = paths.hitID[i];
+        if (id == -1)
+        {
+            ++stats.misses;
+            CountPathEnd(stats, depth);
+            col = col.toFloat3() + throughput * SkyColor(r.dir);
+            continue;
+        }
+        ++stats.hits;
+
+        const Hit& rec = paths.hit[i];
+        const Material& mat = s_SphereMats[id];
+        float3 matE = mat.emissive.toFloat3();
+        uint32_t state = BounceRngState(paths.path[i], depth + 1);
+        float u1, u2;
+        Sample2D(paths.path[i], kDimBounce + depth, state, u1, u2);
+        Ray scattered;
+        float3 attenuation;
+        float scatterPdf;
+#if DO_LIGHT_SAMPLING
+        // same as in TraceHit: light samples at the previous hit might have already got this emission
+        if (paths.prev[i].lightSampled && (matE.getX() > 0 || matE.getY() > 0 || matE.getZ() > 0))
+            matE *= EmissionWeight(paths.prev[i], id);
+#endif
+        col = col.toFloat3() + throughput * matE;
+        if (depth >= kMaxDepth)
+        {
+            CountPathEnd(stats, depth);
+            continue;
+        }
+        bool scatterOk = Scatter(mat, r, rec, u1, u2, attenuation, scattered, scatterPdf, state);
+#if DO_LIGHT_SAMPLING
+        // same as in TraceHit: light samples even if the bounce ray got absorbed
+        if (HasLightSamples(mat))
+        {
+            LightSample lightSamples[kSphereCount];
+            float3 lightSampleE[kSphereCount];
+            int lightSampleCount = SampleLights(mat, r, rec, state, lightSamples, lightSampleE);
+            for (int j = 0; j < lightSampleCount; ++j)
+            {
+                int k = shadows.count++;
+                assert(k < shadows.capacity);
+                shadows.origX[k] = rec.pos.getX(); shadows.origY[k] = rec.pos.getY(); shadows.origZ[k] = rec.pos.getZ();
+                shadows.dirX[k] = lightSamples[j].dir.getX(); shadows.dirY[k] = lightSamples[j].dir.getY(); shadows.dirZ[k] = lightSamples[j].dir.getZ();
+                shadows.tMax[k] = lightSamples[j].dist;
+                shadows.lightID[k] = lightSamples[j].id;
+                shadows.contribution[k] = throughput * lightSampleE[j];
+                shadows.pixel[k] = paths.pixel[i];
+            }
+        }
+#endif
+        if (!scatterOk)
+        {
+            CountPathEnd(stats, depth);
+            continue;
         }
+
+        throughput *= attenuation;
+        if (!ContinuePath(throughput, depth, state))
+        {
+            CountPathEnd(stats, depth);
+            continue;
+        }
+        int k = nextPaths.count++;
+        nextPaths.SetRay(k, scattered);
+        nextPaths.throughput[k] = throughput;
+        nextPaths.pixel[k] = paths.pixel[i];
+        nextPaths.path[k] = paths.path[i];
+#if DO_LIGHT_SAMPLING
+        SetPathVertex(nextPaths.prev[k], mat, r, rec, scatterPdf);
+#endif
     }
+}
+
+static void ShadowStage(const ShadowQueue& shadows, float3pack* colors, RayStats& stats)
+{
+    stats.shadowRays += shadows.count;
+    for (int i = 0; i < shadows.count; ++i)
+    {
+        Ray r(float3(shadows.origX[i], shadows.origY[i], shadows.origZ[i]), float3(shadows.dirX[i], shadows.dirY[i], shadows.dirZ[i]));
+        if (!OccludedWorld(r, kMinT, shadows.tMax[i], shadows.lightID[i]))
+        {
+            float3pack& col = colors[shadows.pixel[i]];
+            col = col.toFloat3() + shadows.contribution[i].toFloat3();
+        }
+        else
+            ++stats.shadowRaysOccluded;
+    }
+}
+
+// traces pixels x0..x1 of rows y0..y1
+static void TraceRectWavefront(int x0, int x1, int y0, int y1, JobData& data, RayStats& stats, WavefrontThreadData& wf)
+{
+    float lerpFac = GetLerpFactor(data);
+
+    int width = x1 - x0;
+    wf.Reserve(width);
+    ShadowQueue& shadows = wf.shadows;
+    float3pack* colors = wf.colors;
+    float* rowColors = wf.rowColors;
+
+    for (int tileStart = y0; tileStart < y1; tileStart += kWavefrontTileRows)
+    {
+        int tileEnd = std::min(tileStart + kWavefrontTileRows, y1);
+        int pixelCount = (tileEnd - tileStart) * width;
+
+        // camera rays for all samples of all pixels in the tile
+        PathQueue* paths = &wf.pathsA;
+        PathQueue* nextPaths = &wf.pathsB;
+        paths->count = 0;
+        for (int p = 0; p < pixelCount; ++p)
+        {
+            colors[p] = float3pack(0, 0, 0);
+            int x = x0 + p % width;
+            int y = tileStart + p / width;
+            for (int s = 0; s < DO_SAMPLES_PER_PIXEL; s++)
+            {
+                PathID path = MakePathID(y * data.screenWidth + x, data.frameCount * DO_SAMPLES_PER_PIXEL + s);
+                int k = paths->count++;
+                paths->SetRay(k, CameraRay(data, x, y, path));
+                paths->throughput[k] = float3pack(1, 1, 1);
+                paths->pixel[k] = p;
+                paths->path[k] = path;
+#if DO_LIGHT_SAMPLING
+                paths->prev[k].lightSampled = false;
+#endif
+            }
+        }
+
+        // bounce until all paths are terminated
+        for (int depth = 0; paths->count > 0; ++depth)
+        {
+            IntersectStage(*paths, depth);
+            ShadeStage(*paths, depth, *nextPaths, shadows, colors, stats);
+            ShadowStage(shadows, colors, stats);
+            std::swap(paths, nextPaths);
+        }
+
+        // blend with previous frames, row by row
+        for (int y = tileStart; y < tileEnd; ++y)
+        {
+            const float3pack* src = colors + (y - tileStart) * width;
+            for (int x = 0; x < width; ++x)
+            {
+                float3 col = src[x].toFloat3() * (1.0f / float(DO_SAMPLES_PER_PIXEL));
+                col.store(rowColors + x * 4);
+                rowColors[x * 4 + 3] = 1.0f;
+            }
+            g_Kernels.accumulatePixels(data.backbuffer + (y * data.screenWidth + x0) * 4, rowColors, width, lerpFac);
+        }
+    }
+}
+
+
+// ---- Adaptive sampling
+//
+// With kFlagAdaptive (progressive, non-animated rendering), each pixel tracks the mean & variance
+// of its sample luminances. Every frame, the usual sample budget (DO_SAMPLES_PER_PIXEL per pixel)
+// is redistributed: pixels with a high error estimate get more samples, and pixels whose error is
+// below DO_ADAPTIVE_THRESHOLD only a few. Frames are then accumulated weighted by sample count.
+
+// samples a pixel needs before its error estimate is trusted (too few, and pixels that just
+// have not hit a small bright thing yet look converged)
+const int kAdaptiveMinSamples = 64;
+// most samples a pixel can get in one frame
+const int kAdaptiveMaxSamples = DO_SAMPLES_PER_PIXEL * 16;
+// samples a converged pixel still gets every frame; the error estimate can be too low (a pixel that
+// has not hit a rare bright path yet), and with none at all such pixels would stay too dark forever
+const int kAdaptiveConvergedSamples = 1;
+
+static int s_AdaptivePixelCount;
+static int* s_AdaptiveTotal; // samples accumulated into the pixel so far
+static float* s_AdaptiveLum; // sum of sample luminances
+static float* s_AdaptiveLumSq; // sum of squared sample luminances
+static float* s_AdaptiveError;
+static uint16_t* s_AdaptiveSamples; // samples to take this frame
+static_assert(kAdaptiveMaxSamples <= 0xFFFF, "per frame sample counts are stored in 16 bits");
+
+static void FreeAdaptiveSampling()
+{
+    delete[] s_AdaptiveTotal;
+    delete[] s_AdaptiveLum;
+    delete[] s_AdaptiveLumSq;
+    delete[] s_AdaptiveError;
+    delete[] s_AdaptiveSamples;
+    s_AdaptiveTotal = NULL; s_AdaptiveLum = NULL; s_AdaptiveLumSq = NULL; s_AdaptiveError = NULL; s_AdaptiveSamples = NULL;
+    s_AdaptivePixelCount = 0;
+}
+
+// Fills s_AdaptiveSamples for this frame
+static void AllocateAdaptiveSamples(int pixelCount, int frameCount)
+{
+    if (pixelCount != s_AdaptivePixelCount)
+    {
+        FreeAdaptiveSampling();
+        s_AdaptivePixelCount = pixelCount;
+        s_AdaptiveTotal = new int[pixelCount];
+        s_AdaptiveLum = new float[pixelCount];
+        s_AdaptiveLumSq = new float[pixelCount];
+        s_AdaptiveError = new float[pixelCount];
+        s_AdaptiveSamples = new uint16_t[pixelCount];
+        frameCount = 0;
+    }
+    if (frameCount == 0)
+    {
+        memset(s_AdaptiveTotal, 0, pixelCount * sizeof(s_AdaptiveTotal[0]));
+        memset(s_AdaptiveLum, 0, pixelCount * sizeof(s_AdaptiveLum[0]));
+        memset(s_AdaptiveLumSq, 0, pixelCount * sizeof(s_AdaptiveLumSq[0]));
+    }
+
+    // pixels without enough samples yet get the regular amount, converged ones kAdaptiveConvergedSamples;
+    // the rest of the budget goes to the others, proportionally to their error
+    int budget = pixelCount * DO_SAMPLES_PER_PIXEL;
+    float errorSum = 0;
+    for (int i = 0; i < pixelCount; ++i)
+    {
+        int n = s_AdaptiveTotal[i];
+        float err = 0;
+        if (n < kAdaptiveMinSamples)
+        {
+            budget -= DO_SAMPLES_PER_PIXEL;
+            err = -1;
+        }
+        else
+        {
+            // standard error of the mean luminance, relative to the luminance (only very dark pixels
+            // are held to an absolute error, like the relative MSE in BenchConvergence does)
+            float mean = s_AdaptiveLum[i] / n;
+            float variance = std::max(0.0f, s_AdaptiveLumSq[i] / n - mean * mean);
+            err = sqrtf(variance / n) / (mean + 0.1f);
+            if (err < DO_ADAPTIVE_THRESHOLD)
+            {
+                budget -= kAdaptiveConvergedSamples;
+                err = 0;
+            }
+            else
+                errorSum += err;
+        }
+        s_AdaptiveError[i] = err;
+    }
+
+    float scale = errorSum > 0 ? std::max(budget, 0) / errorSum : 0;
+    uint32_t state = PcgHash(frameCount);
+    for (int i = 0; i < pixelCount; ++i)
+    {
+        float err = s_AdaptiveError[i];
+        int n = 0;
+        if (err < 0)
+            n = DO_SAMPLES_PER_PIXEL;
+        else if (err == 0)
+            n = kAdaptiveConvergedSamples;
+        else
+        {
+            // random rounding keeps the total close to the budget
+            n = int(err * scale + RandomFloat01(state));
+            n = std::min(std::max(n, 1), kAdaptiveMaxSamples);
+        }
+        s_AdaptiveSamples[i] = (uint16_t)n;
+    }
+}
+
+// Adds this frame's sample sums of a row of pixels into the backbuffer, weighted by sample counts
+static void AccumulateAdaptive(float* backbuffer, const float* colors, int pixelIndex, int width)
+{
+    for (int x = 0; x < width; ++x, backbuffer += 4, colors += 4)
+    {
+        int n = s_AdaptiveSamples[pixelIndex + x];
+        if (n == 0)
+            continue;
+        int prev = s_AdaptiveTotal[pixelIndex + x];
+        float invTotal = 1.0f / float(prev + n);
+        for (int c = 0; c < 3; ++c)
+            backbuffer[c] = (backbuffer[c] * prev + colors[c]) * invTotal;
+        backbuffer[3] = 1.0f;
+        s_AdaptiveTotal[pixelIndex + x] = prev + n;
+    }
+}
+
+
+// ---- AOVs for denoising
+//
+// With kFlagAOVs, path-at-a-time tracing also accumulates, for each pixel, albedo, normal & depth where
+// camera rays first hit something ("arbitrary output variables"), blended over frames just like the colors.
+// Alongside goes an estimate of how noisy the accumulated color still is: variance of its luminance, from
+// the spread of sample luminances within each frame. DenoiseTest uses all that to know what it can blur.
+
+enum { kAovAlbedoR, kAovAlbedoG, kAovAlbedoB, kAovNormalX, kAovNormalY, kAovNormalZ, kAovDepth, kAovVariance, kAovCount };
+
+static int s_AovPixelCount;
+static float* s_AovData;
+static float* s_Aov[kAovCount]; // planes of pixel count floats each, pointing into s_AovData
+
+static void FreeAOVs()
+{
+    delete[] s_AovData;
+    s_AovData = NULL;
+    s_AovPixelCount = 0;
+}
+
+static void AllocateAOVs(int pixelCount)
+{
+    if (pixelCount == s_AovPixelCount)
+        return;
+    FreeAOVs();
+    s_AovPixelCount = pixelCount;
+    s_AovData = new float[pixelCount * kAovCount];
+    memset(s_AovData, 0, pixelCount * kAovCount * sizeof(s_AovData[0]));
+    for (int i = 0; i < kAovCount; ++i)
+        s_Aov[i] = s_AovData + i * pixelCount;
+}
+
+// sums over this frame's samples of a pixel; sky adds nothing but the luminance
+struct AovSums
+{
+    float albedo[3], normal[3], depth;
+    float lum, lumSq;
+};
+
+static void AddAovSample(AovSums& sums, int id, const Hit& rec, const float3& sample)
+{
+    float lum = Luminance(sample);
+    sums.lum += lum;
+    sums.lumSq += lum * lum;
+    if (id == -1)
+        return;
+    const Material& mat = s_SphereMats[id];
+    // glass shows what is behind it, so "albedo" is white
+    float3 albedo = mat.type == Material::Dielectric ? float3(1, 1, 1) : mat.albedo.toFloat3();
+    sums.albedo[0] += albedo.getX(); sums.albedo[1] += albedo.getY(); sums.albedo[2] += albedo.getZ();
+    sums.normal[0] += rec.normal.getX(); sums.normal[1] += rec.normal.getY(); sums.normal[2] += rec.normal.getZ();
+    sums.depth += rec.t;
+}
+
+// Blends this frame's sums of a row of pixels into the AOV planes, with the same weights as colors get
+// (lerpFac, or by sample counts when adaptive; so this has to happen before AccumulateAdaptive).
+static void AccumulateAOVs(const AovSums* sums, int pixelIndex, int width, const JobData& data, float lerpFac)
+{
+    for (int x = 0; x < width; ++x)
+    {
+        int i = pixelIndex + x;
+        int n = data.adaptive ? s_AdaptiveSamples[i] : DO_SAMPLES_PER_PIXEL;
+        if (n == 0)
+            continue;
+        float keep = data.adaptive ? float(s_AdaptiveTotal[i]) / float(s_AdaptiveTotal[i] + n) : lerpFac;
+        float add = (1.0f - keep) / n;
+        const AovSums& sum = sums[x];
+        const float values[kAovDepth + 1] = { sum.albedo[0], sum.albedo[1], sum.albedo[2], sum.normal[0], sum.normal[1], sum.normal[2], sum.depth };
+        for (int k = 0; k <= kAovDepth; ++k)
+            s_Aov[k][i] = s_Aov[k][i] * keep + values[k] * add;
+        // variance of a weighted sum of frame means: squared weights times variances of those (sample variance / n)
+        float sampleVar = n > 1 ? std::max(sum.lumSq - sum.lum * sum.lum / n, 0.0f) / (n - 1) : 0.0f;
+        s_Aov[kAovVariance][i] = s_Aov[kAovVariance][i] * keep * keep + sampleVar * add * (1.0f - keep);
+    }
+}
+
+
+static void ReserveRowBuffers(ThreadFrameData& t, int width, int maxSamples, bool aovs)
+{
+    if (width > t.rowWidth)
+    {
+        delete[] t.colors;
+        t.colors = new float[width * 4];
+        t.rowWidth = width;
+    }
+    if (maxSamples > t.sampleCapacity)
+    {
+        delete[] t.samplePixels;
+        delete[] t.samplePaths;
+        t.samplePixels = new int[maxSamples];
+        t.samplePaths = new PathID[maxSamples];
+        t.sampleCapacity = maxSamples;
+    }
+    if (aovs && width > t.aovWidth)
+    {
+        delete[] t.aovSums;
+        t.aovSums = new AovSums[width];
+        t.aovWidth = width;
+    }
+}
+
+static void FreeRowBuffers()
+{
+    for (int i = 0; i < s_ThreadDataCount; ++i)
+    {
+        ThreadFrameData& t = s_ThreadData[i];
+        delete[] t.colors;
+        delete[] t.samplePixels;
+        delete[] t.samplePaths;
+        delete[] t.aovSums;
+        t.colors = NULL; t.samplePixels = NULL; t.samplePaths = NULL; t.aovSums = NULL;
+        t.rowWidth = t.aovWidth = t.sampleCapacity = 0;
+    }
+}
+
+// traces pixels x0..x1 of rows y0..y1, one row at a time
+static void TraceRect(int x0, int x1, int y0, int y1, JobData& data, RayStats& stats, int threadIndex)
+{
+    if (data.testFlags & kFlagWavefront)
+    {
+        TraceRectWavefront(x0, x1, y0, y1, data, stats, s_WavefrontData[threadIndex]);
+        return;
+    }
+    float lerpFac = GetLerpFactor(data);
+    int width = x1 - x0;
+    int maxSamples = width * (data.adaptive ? kAdaptiveMaxSamples : DO_SAMPLES_PER_PIXEL);
+    ThreadFrameData& thread = s_ThreadData[threadIndex];
+    ReserveRowBuffers(thread, width, maxSamples, data.aovs);
+    float* colors = thread.colors;
+    int* samplePixels = thread.samplePixels;
+    PathID* samplePaths = thread.samplePaths;
+    AovSums* aovSums = data.aovs ? thread.aovSums : NULL;
+    for (int y = y0; y < y1; ++y)
+    {
+        int pixelIndex = y * data.screenWidth + x0;
+        memset(colors, 0, width * 4 * sizeof(colors[0]));
+        if (aovSums)
+            memset(aovSums, 0, width * sizeof(aovSums[0]));
+
+        // which pixel each of the samples in this row is for, and their paths; sample indices continue
+        // from what previous frames accumulated
+        int sampleCount = 0;
+        for (int x = 0; x < width; ++x)
+        {
+            int n = data.adaptive ? s_AdaptiveSamples[pixelIndex + x] : DO_SAMPLES_PER_PIXEL;
+            int prev = data.adaptive ? s_AdaptiveTotal[pixelIndex + x] : data.frameCount * DO_SAMPLES_PER_PIXEL;
+            for (int s = 0; s < n; ++s)
+            {
+                samplePixels[sampleCount] = x;
+                samplePaths[sampleCount++] = MakePathID(pixelIndex + x, prev + s);
+            }
+        }
+#if DO_RAY_PACKETS
+        // primary rays of the whole row, kRayPacketSize at a time (samples of a pixel are next to each other)
+        for (int first = 0; first < sampleCount; first += kRayPacketSize)
+        {
+            int packetCount = std::min(kRayPacketSize, sampleCount - first);
+            RayPacket packet;
+            Ray r;
+            for (int i = 0; i < kRayPacketSize; ++i)
+            {
+                // unused slots at the end of the row just repeat the last ray
+                if (i < packetCount)
+                {
+                    r = CameraRay(data, x0 + samplePixels[first + i], y, samplePaths[first + i]);
+                }
+                packet.Set(i, r);
+            }
+            Hit hits[kRayPacketSize];
+            int ids[kRayPacketSize];
+            HitWorldPacket(packet, kMinT, kMaxT, hits, ids);
+            for (int i = 0; i < packetCount; ++i)
+            {
+                int x = samplePixels[first + i];
+                float* pixel = colors + x * 4;
+                float3 sample = TraceHit(packet.Get(i), ids[i], hits[i], stats, samplePaths[first + i]);
+                float3 col = float3(pixel[0], pixel[1], pixel[2]) + sample;
+                col.store(pixel);
+                if (aovSums)
+                    AddAovSample(aovSums[x], ids[i], hits[i], sample);
+                if (data.adaptive)
+                {
+                    float lum = Luminance(sample);
+                    s_AdaptiveLum[pixelIndex + x] += lum;
+                    s_AdaptiveLumSq[pixelIndex + x] += lum * lum;
+                }
+            }
+        }
+#else
+        for (int i = 0; i < sampleCount; ++i)
+        {
+            int x = samplePixels[i];
+            float* pixel = colors + x * 4;
+            Ray r = CameraRay(data, x0 + x, y, samplePaths[i]);
+            Hit rec;
+            int id = 0;
+            HitWorld(r, kMinT, kMaxT, rec, id);
+            float3 sample = TraceHit(r, id, rec, stats, samplePaths[i]);
+            float3 col = float3(pixel[0], pixel[1], pixel[2]) + sample;
+            col.store(pixel);
+            if (aovSums)
+                AddAovSample(aovSums[x], id, rec, sample);
+            if (data.adaptive)
+            {
+                float lum = Luminance(sample);
+                s_AdaptiveLum[pixelIndex + x] += lum;
+                s_AdaptiveLumSq[pixelIndex + x] += lum * lum;
+            }
+        }
+#endif
+        if (aovSums)
+            AccumulateAOVs(aovSums, pixelIndex, width, data, lerpFac);
+        if (data.adaptive)
+        {
+            AccumulateAdaptive(data.backbuffer + pixelIndex * 4, colors, pixelIndex, width);
+            continue;
+        }
+        for (int x = 0; x < width; ++x)
+        {
+            float* pixel = colors + x * 4;
+            float3 col = float3(pixel[0], pixel[1], pixel[2]) * (1.0f / float(DO_SAMPLES_PER_PIXEL));
+            col.store(pixel);
+            colors[x * 4 + 3] = 1.0f;
+        }
+        // blend the whole row with previous frames
+        g_Kernels.accumulatePixels(data.backbuffer + pixelIndex * 4, colors, width, lerpFac);
+    }
+}
+
+// sampling counters are global per thread; only add what happened during a job to the frame stats
+static void AddSamplingCounters(RayStats& stats, const SamplingCounters& start)
+{
+    const SamplingCounters& end = g_SamplingCounters;
+    stats.diskCalls += end.diskCalls - start.diskCalls;
+    stats.diskIterations += end.diskIterations - start.diskIterations;
+    stats.sphereCalls += end.sphereCalls - start.sphereCalls;
+    stats.sphereIterations += end.sphereIterations - start.sphereIterations;
+}
+
+static void TraceRowJob(uint32_t start, uint32_t end, uint32_t threadnum, void* data_)
+{
+    uint64_t zoneStart = ProfilerGetTime();
+    double t0 = GetSeconds();
+    SamplingCounters counters = g_SamplingCounters;
+    ThreadFrameData& thread = s_ThreadData[threadnum];
+    JobData& data = *(JobData*)data_;
+    TraceRect(0, data.screenWidth, start, end, data, thread.stats, threadnum);
+    AddSamplingCounters(thread.stats, counters);
+    thread.busySeconds += GetSeconds() - t0;
+    ProfilerZone(threadnum, "TraceRows", zoneStart, start, end);
+}
+
+static void TraceTileJob(uint32_t start, uint32_t end, uint32_t threadnum, void* data_)
+{
+    uint64_t zoneStart = ProfilerGetTime();
+    double t0 = GetSeconds();
+    SamplingCounters counters = g_SamplingCounters;
+    ThreadFrameData& thread = s_ThreadData[threadnum];
+    JobData& data = *(JobData*)data_;
+    for (uint32_t i = start; i < end; ++i)
+    {
+        int tileX = data.tiles[i] % data.tilesX;
+        int tileY = data.tiles[i] / data.tilesX;
+        int x0 = tileX * data.tileSize, y0 = tileY * data.tileSize;
+        TraceRect(x0, std::min(x0 + data.tileSize, data.screenWidth), y0, std::min(y0 + data.tileSize, data.screenHeight), data, thread.stats, threadnum);
+    }
+    AddSamplingCounters(thread.stats, counters);
+    thread.busySeconds += GetSeconds() - t0;
+    ProfilerZone(threadnum, "TraceTiles", zoneStart, start, end);
+}
+
+int GetThreadBusyTimes(double* outSeconds, int maxCount)
+{
+    int count = std::min(s_ThreadDataCount, maxCount);
+    for (int i = 0; i < count; ++i)
+        outSeconds[i] = s_ThreadData[i].busySeconds;
+    return count;
+}
+
+void UpdateTest(float time, int frameCount, int screenWidth, int screenHeight, unsigned testFlags)
+{
+    if (testFlags & kFlagAnimate)
+    {
+        s_Spheres[1].center.y = cosf(time) + 1.0f;
+        s_Spheres[8].center.z = sinf(time) * 0.3f;
+    }
+    float3 lookfrom(0, 2, 3);
+    float3 lookat(0, 0, 0);
+    float distToFocus = 3;
+#if DO_MITSUBA_COMPARE
+    float aperture = 0.0f;
+#else
+    float aperture = 0.1f;
+#endif
+#if DO_BIG_SCENE
+    aperture *= 0.2f;
+#endif
+
+    s_EmissiveSphereCount = 0;
+    for (int i = 0; i < kSphereCount; ++i)
+    {
+        Sphere& s = s_Spheres[i];
+        s.UpdateDerivedData();
+        s_SpheresSoA.centerX[i] = s.center.x;
+        s_SpheresSoA.centerY[i] = s.center.y;
+        s_SpheresSoA.centerZ[i] = s.center.z;
+        s_SpheresSoA.sqRadius[i] = s.radius * s.radius;
+        s_SpheresSoA.invRadius[i] = s.invRadius;
+
+        // Remember IDs of emissive spheres (light sources)
+        const Material& smat = s_SphereMats[i];
+        if (smat.emissive.x > 0 || smat.emissive.y > 0 || smat.emissive.z > 0)
+        {
+            s_EmissiveSpheres[s_EmissiveSphereCount] = i;
+            s_EmissiveSphereCount++;
+        }
+    }
+#if DO_LIGHT_SAMPLING
+    // same as the BVH below: lights only move when animating
+    if ((testFlags & kFlagAnimate) || !s_LightSamplingBuilt)
+    {
+        BuildLightSampling();
+        s_LightSamplingBuilt = true;
+    }
+#endif
+#if DO_BVH
+    // spheres only move when animating
+    if ((testFlags & kFlagAnimate) || s_SpheresBvh.nodeCount == 0)
+        BuildBvh(s_SpheresBvh, s_SpheresSoA);
+#endif
 
     s_Cam = Camera(lookfrom, lookat, float3(0, 1, 0), 60, float(screenWidth) / float(screenHeight), aperture, distToFocus);
 }
 
-void DrawTest(float time, int frameCount, int screenWidth, int screenHeight, float* backbuffer, int& outRayCount, unsigned testFlags)
+
+void SetLightSampling(LightSampling mode, int samplesPerHit)
+{
+#if DO_LIGHT_SAMPLING
+    s_LightSampling = mode;
+#if !DO_BVH
+    if (mode == kLightSamplingBvh)
+        s_LightSampling = kLightSamplingSolidAngle;
+#endif
+    s_LightSamplesPerHit = std::min(std::max(samplesPerHit, 1), kMaxLightSamplesPerHit);
+#endif
+}
+
+void SetTileScheduling(int tileSize, TileOrder order)
+{
+    s_TileSize = tileSize;
+    s_TileOrder = order;
+}
+
+// distance of (x,y) along a Hilbert curve that fills n x n grid (n power of two)
+static uint32_t HilbertIndex(uint32_t n, uint32_t x, uint32_t y)
+{
+    uint32_t d = 0;
+    for (uint32_t s = n / 2; s > 0; s /= 2)
+    {
+        uint32_t rx = (x & s) > 0;
+        uint32_t ry = (y & s) > 0;
+        d += s * s * ((3 * rx) ^ ry);
+        // rotate the quadrant
+        if (ry == 0)
+        {
+            if (rx == 1)
+            {
+                x = s - 1 - x;
+                y = s - 1 - y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return d;
+}
+
+// bits of x and y interleaved
+static uint32_t MortonIndex(uint32_t x, uint32_t y)
+{
+    uint32_t d = 0;
+    for (int i = 0; i < 16; ++i)
+        d |= ((x >> i) & 1) << (2 * i) | ((y >> i) & 1) << (2 * i + 1);
+    return d;
+}
+
+// tile indices sorted along a space filling curve, so that tiles traced at the same time are close to each other on screen
+static const int* GetTileOrder(int tilesX, int tilesY)
+{
+    if (s_Tiles != NULL && s_TilesKey[0] == tilesX && s_TilesKey[1] == tilesY && s_TilesKey[2] == s_TileOrder)
+        return s_Tiles;
+    delete[] s_Tiles;
+    int count = tilesX * tilesY;
+    s_Tiles = new int[count];
+    uint32_t n = 1;
+    while (n < (uint32_t)std::max(tilesX, tilesY))
+        n *= 2;
+    std::vector<std::pair<uint32_t, int>> keys(count);
+    for (int i = 0; i < count; ++i)
+    {
+        uint32_t x = i % tilesX, y = i / tilesX;
+        uint32_t key = i;
+        if (s_TileOrder == kTileOrderHilbert)
+            key = HilbertIndex(n, x, y);
+        else if (s_TileOrder == kTileOrderMorton)
+            key = MortonIndex(x, y);
+        keys[i] = std::make_pair(key, i);
+    }
+    std::sort(keys.begin(), keys.end());
+    for (int i = 0; i < count; ++i)
+        s_Tiles[i] = keys[i].second;
+    s_TilesKey[0] = tilesX;
+    s_TilesKey[1] = tilesY;
+    s_TilesKey[2] = s_TileOrder;
+    return s_Tiles;
+}
+
+void DrawTest(float time, int frameCount, int screenWidth, int screenHeight, float* backbuffer, RayStats& outStats, unsigned testFlags)
 {
+    ProfilerBeginFrame();
+    uint64_t zoneStart = ProfilerGetTime();
     JobData args;
     args.time = time;
     args.frameCount = frameCount;
@@ -351,19 +1789,245 @@ void DrawTest(float time, int frameCount, int screenWidth, int screenHeight, flo
     args.backbuffer = backbuffer;
     args.cam = &s_Cam;
     args.testFlags = testFlags;
-    args.rayCount = 0;
+    args.adaptive = false;
+    args.aovs = (testFlags & kFlagAOVs) && !(testFlags & kFlagWavefront);
+    if (args.aovs)
+        AllocateAOVs(screenWidth * screenHeight);
+    if ((testFlags & kFlagWavefront) && !s_WavefrontData)
+        s_WavefrontData = new WavefrontThreadData[s_ThreadDataCount];
+    for (int i = 0; i < s_ThreadDataCount; ++i)
+    {
+        s_ThreadData[i].busySeconds = 0;
+        s_ThreadData[i].stats.Clear();
+    }
+    outStats.Clear();
+    args.tiles = NULL;
+    args.tilesX = 0;
+    args.tileSize = s_TileSize;
+
+    // adaptive sampling only makes sense when accumulating a still image; the wavefront tracer does not do it
+    if ((testFlags & kFlagAdaptive) && (testFlags & kFlagProgressive) && !(testFlags & (kFlagAnimate | kFlagWavefront)))
+    {
+        args.adaptive = true;
+        AllocateAdaptiveSamples(screenWidth * screenHeight, frameCount);
+    }
 
     #if CPU_CAN_DO_THREADS
-    enkiTaskSet* task = enkiCreateTaskSet(g_TS, TraceRowJob);
     bool threaded = true;
-    enkiAddTaskSetMinRange(g_TS, task, &args, screenHeight, threaded ? 4 : screenHeight);
+    enkiTaskSet* task;
+    if (s_TileSize > 0)
+    {
+        // square tiles, each one a task of its own
+        args.tilesX = (screenWidth + s_TileSize - 1) / s_TileSize;
+        int tilesY = (screenHeight + s_TileSize - 1) / s_TileSize;
+        args.tiles = GetTileOrder(args.tilesX, tilesY);
+        task = enkiCreateTaskSet(g_TS, TraceTileJob);
+        enkiAddTaskSetMinRange(g_TS, task, &args, args.tilesX * tilesY, threaded ? 1 : args.tilesX * tilesY);
+    }
+    else
+    {
+        task = enkiCreateTaskSet(g_TS, TraceRowJob);
+        enkiAddTaskSetMinRange(g_TS, task, &args, screenHeight, threaded ? 4 : screenHeight);
+    }
     enkiWaitForTaskSet(g_TS, task);
     enkiDeleteTaskSet(g_TS, task);
     #else
     TraceRowJob(0, screenHeight, 0, &args);
     #endif
 
-    outRayCount = args.rayCount;
+    // merge stats of all threads
+    for (int i = 0; i < s_ThreadDataCount; ++i)
+        outStats.Add(s_ThreadData[i].stats);
+    ProfilerZone(0, "DrawTest", zoneStart);
+}
+
+
+// ---- Denoising
+//
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010), with luminance weights driven by the
+// estimated noise of each pixel as in SVGF (Schied et al. 2017): a few passes of a 5x5 filter, each with
+// taps twice as far apart, on planes of floats so that the filter can do a whole SIMD register of pixels
+// at once. Before that, one pass makes the planes it needs from the backbuffer & AOVs.
+
+enum
+{
+    kDenoiseR, kDenoiseG, kDenoiseB, kDenoiseVariance, kDenoiseImagePlanes, // two sets of these, for ping-ponging
+    kDenoiseNormalX = kDenoiseImagePlanes * 2, kDenoiseNormalY, kDenoiseNormalZ,
+    kDenoiseDepth, kDenoiseDepthGradient,
+    kDenoisePlaneCount
+};
+
+static int s_DenoiseWidth, s_DenoiseHeight, s_DenoisePadding;
+static float* s_DenoiseData;
+static float* s_DenoisePlanes[kDenoisePlaneCount]; // first pixel of each plane, in s_DenoiseData
+
+static void FreeDenoising()
+{
+    delete[] s_DenoiseData;
+    s_DenoiseData = NULL;
+    s_DenoiseWidth = s_DenoiseHeight = s_DenoisePadding = 0;
+}
+
+static void AllocateDenoising(int width, int height, int padding)
+{
+    if (width == s_DenoiseWidth && height == s_DenoiseHeight && padding <= s_DenoisePadding)
+        return;
+    FreeDenoising();
+    s_DenoiseWidth = width;
+    s_DenoiseHeight = height;
+    s_DenoisePadding = padding;
+    int planeSize = (width + 2 * padding) * height;
+    s_DenoiseData = new float[planeSize * kDenoisePlaneCount];
+    // DenoiseRowKernel writes filtered color & variance into the right padding of the ping-pong planes
+    // (its last SIMD iteration runs past the row), so only the normal & depth planes keep zero padding.
+    // That is what makes taps that land in the padding harmless: a zero normal gets weight
+    // exp(-kDenoiseNormalPower), i.e. zero. Keep the normal planes' padding zeroed.
+    memset(s_DenoiseData, 0, planeSize * kDenoisePlaneCount * sizeof(s_DenoiseData[0]));
+    for (int i = 0; i < kDenoisePlaneCount; ++i)
+        s_DenoisePlanes[i] = s_DenoiseData + i * planeSize + padding;
+}
+
+struct DenoiseJobData
+{
+    DenoisePass pass;
+    const float* backbuffer;
+    float* outImage; // written by the last pass
+};
+
+// What colors get divided by before filtering, and multiplied with after: that way the filter only has
+// to blur lighting, and keeps texture & material edges sharp without having to look for them. Sky has
+// no albedo, so it stays as is.
+static float3 DemodulationAlbedo(int i)
+{
+    float r = s_Aov[kAovAlbedoR][i], g = s_Aov[kAovAlbedoG][i], b = s_Aov[kAovAlbedoB][i];
+    return float3(r > 0.01f ? r : 1.0f, g > 0.01f ? g : 1.0f, b > 0.01f ? b : 1.0f);
+}
+
+// Planes from the backbuffer & AOVs: colors without albedo, unit length normals, depth gradient, and
+// luminance variance blurred a bit, since from a few samples it is a noisy estimate itself.
+static void DenoisePrepareJob(uint32_t start, uint32_t end, uint32_t threadnum, void* data_)
+{
+    uint64_t zoneStart = ProfilerGetTime();
+    const DenoiseJobData& data = *(const DenoiseJobData*)data_;
+    int width = data.pass.width, height = data.pass.height;
+    const float* depth = s_Aov[kAovDepth];
+    const float* variance = s_Aov[kAovVariance];
+    for (int y = start; y < (int)end; ++y)
+    {
+        for (int x = 0; x < width; ++x)
+        {
+            int i = y * width + x;
+            int o = y * data.pass.stride + x;
+            float3 albedo = DemodulationAlbedo(i);
+            s_DenoisePlanes[kDenoiseR][o] = data.backbuffer[i * 4 + 0] / albedo.getX();
+            s_DenoisePlanes[kDenoiseG][o] = data.backbuffer[i * 4 + 1] / albedo.getY();
+            s_DenoisePlanes[kDenoiseB][o] = data.backbuffer[i * 4 + 2] / albedo.getZ();
+
+            float3 n(s_Aov[kAovNormalX][i], s_Aov[kAovNormalY][i], s_Aov[kAovNormalZ][i]);
+            float len = length(n);
+            n = len > 0 ? n * (1.0f / len) : float3(0, 0, 0);
+            s_DenoisePlanes[kDenoiseNormalX][o] = n.getX();
+            s_DenoisePlanes[kDenoiseNormalY][o] = n.getY();
+            s_DenoisePlanes[kDenoiseNormalZ][o] = n.getZ();
+
+            // smaller of the one sided differences, so that it does not jump up next to silhouettes
+            int x0 = std::max(x - 1, 0), x1 = std::min(x + 1, width - 1);
+            int y0 = std::max(y - 1, 0), y1 = std::min(y + 1, height - 1);
+            float z = depth[i];
+            float dx = std::min(fabsf(depth[y * width + x0] - z), fabsf(depth[y * width + x1] - z));
+            float dy = std::min(fabsf(depth[y0 * width + x] - z), fabsf(depth[y1 * width + x] - z));
+            s_DenoisePlanes[kDenoiseDepth][o] = z;
+            s_DenoisePlanes[kDenoiseDepthGradient][o] = std::max(dx, dy);
+
+            float var = 4 * variance[i];
+            var += 2 * (variance[y * width + x0] + variance[y * width + x1] + variance[y0 * width + x] + variance[y1 * width + x]);
+            var += variance[y0 * width + x0] + variance[y0 * width + x1] + variance[y1 * width + x0] + variance[y1 * width + x1];
+            float albedoLum = Luminance(albedo);
+            s_DenoisePlanes[kDenoiseVariance][o] = var * (1.0f / 16) / (albedoLum * albedoLum);
+        }
+    }
+    ProfilerZone(threadnum, "DenoisePrepare", zoneStart, start, end);
+}
+
+static void DenoisePassJob(uint32_t start, uint32_t end, uint32_t threadnum, void* data_)
+{
+    uint64_t zoneStart = ProfilerGetTime();
+    const DenoiseJobData& data = *(const DenoiseJobData*)data_;
+    const DenoisePass& pass = data.pass;
+    for (int y = start; y < (int)end; ++y)
+    {
+        g_Kernels.denoiseRow(pass, y);
+        if (!data.outImage)
+            continue;
+        float* dst = data.outImage + y * pass.width * 4;
+        for (int x = 0; x < pass.width; ++x, dst += 4)
+        {
+            int i = y * pass.stride + x;
+            float3 col = float3(pass.outColor[0][i], pass.outColor[1][i], pass.outColor[2][i]) * DemodulationAlbedo(y * pass.width + x);
+            dst[0] = col.getX();
+            dst[1] = col.getY();
+            dst[2] = col.getZ();
+            dst[3] = 1.0f;
+        }
+    }
+    ProfilerZone(threadnum, "DenoisePass", zoneStart, start, end);
+}
+
+static void RunDenoiseJob(void (*job)(uint32_t start, uint32_t end, uint32_t threadnum, void* data), DenoiseJobData& data)
+{
+    #if CPU_CAN_DO_THREADS
+    enkiTaskSet* task = enkiCreateTaskSet(g_TS, job);
+    enkiAddTaskSetMinRange(g_TS, task, &data, data.pass.height, 4);
+    enkiWaitForTaskSet(g_TS, task);
+    enkiDeleteTaskSet(g_TS, task);
+    #else
+    job(0, data.pass.height, 0, &data);
+    #endif
+}
+
+void DenoiseTest(int screenWidth, int screenHeight, const float* backbuffer, float* outImage, int passes)
+{
+    uint64_t zoneStart = ProfilerGetTime();
+    if (passes < 0)
+        passes = DO_DENOISE_PASSES;
+    passes = std::min(passes, 10);
+    if (screenWidth * screenHeight != s_AovPixelCount || passes == 0)
+    {
+        // no AOVs to guide the filter (or nothing to do); leave the image as is
+        memcpy(outImage, backbuffer, screenWidth * screenHeight * 4 * sizeof(backbuffer[0]));
+        return;
+    }
+    int padding = 2 * (1 << (passes - 1)) + 16;
+    AllocateDenoising(screenWidth, screenHeight, padding);
+
+    DenoiseJobData data;
+    DenoisePass& pass = data.pass;
+    pass.width = screenWidth;
+    pass.height = screenHeight;
+    pass.stride = screenWidth + 2 * s_DenoisePadding;
+    for (int c = 0; c < 3; ++c)
+        pass.normal[c] = s_DenoisePlanes[kDenoiseNormalX + c];
+    pass.depth = s_DenoisePlanes[kDenoiseDepth];
+    pass.depthGradient = s_DenoisePlanes[kDenoiseDepthGradient];
+    data.backbuffer = backbuffer;
+    data.outImage = NULL;
+    RunDenoiseJob(DenoisePrepareJob, data);
+    for (int p = 0; p < passes; ++p)
+    {
+        float** src = s_DenoisePlanes + (p & 1) * kDenoiseImagePlanes;
+        float** dst = s_DenoisePlanes + (~p & 1) * kDenoiseImagePlanes;
+        pass.step = 1 << p;
+        for (int c = 0; c < 3; ++c)
+        {
+            pass.color[c] = src[kDenoiseR + c];
+            pass.outColor[c] = dst[kDenoiseR + c];
+        }
+        pass.variance = src[kDenoiseVariance];
+        pass.outVariance = dst[kDenoiseVariance];
+        data.outImage = p == passes - 1 ? outImage : NULL;
+        RunDenoiseJob(DenoisePassJob, data);
+    }
+    ProfilerZone(0, "DenoiseTest", zoneStart);
 }
 
 void GetObjectCount(int& outCount, int& outObjectSize, int& outMaterialSize, int& outCamSize)
@@ -5,13 +5,105 @@ enum TestFlags
 {
     kFlagAnimate = (1 << 0),
     kFlagProgressive = (1 << 1),
+    kFlagWavefront = (1 << 2), // trace all paths of a tile bounce by bounce through ray queues, instead of one path at a time
+    kFlagAdaptive = (1 << 3), // with progressive & no animation: spend samples where the image is still noisy
+    kFlagAOVs = (1 << 4), // also accumulate first hit albedo, normal & depth of each pixel, for DenoiseTest (not with wavefront)
 };
 
-void InitializeTest();
+// Counters gathered while tracing a frame; 64 bit so they don't overflow at high resolutions & sample counts
+enum { kRayStatsDepthBuckets = 16 };
+struct RayStats
+{
+    RayStats() { Clear(); }
+    void Clear()
+    {
+        primaryRays = bounceRays = shadowRays = shadowRaysOccluded = hits = misses = 0;
+        for (int i = 0; i < kRayStatsDepthBuckets; ++i)
+            pathDepth[i] = 0;
+        diskCalls = diskIterations = sphereCalls = sphereIterations = 0;
+    }
+    void Add(const RayStats& o)
+    {
+        primaryRays += o.primaryRays; bounceRays += o.bounceRays;
+        shadowRays += o.shadowRays; shadowRaysOccluded += o.shadowRaysOccluded;
+        hits += o.hits; misses += o.misses;
+        for (int i = 0; i < kRayStatsDepthBuckets; ++i)
+            pathDepth[i] += o.pathDepth[i];
+        diskCalls += o.diskCalls; diskIterations += o.diskIterations;
+        sphereCalls += o.sphereCalls; sphereIterations += o.sphereIterations;
+    }
+    uint64_t TotalRays() const { return primaryRays + bounceRays + shadowRays; }
+
+    uint64_t primaryRays; // from the camera
+    uint64_t bounceRays; // scattered off surfaces
+    uint64_t shadowRays; // towards light sources...
+    uint64_t shadowRaysOccluded; // ...of which this many were blocked by something
+    uint64_t hits, misses; // primary & bounce rays that hit something, or went off into the sky
+    uint64_t pathDepth[kRayStatsDepthBuckets]; // paths by how many bounces they had when terminated (last one: that many or more)
+    uint64_t diskCalls, diskIterations; // RandomInUnitDisk calls, and rejection sampling loop iterations in them
+    uint64_t sphereCalls, sphereIterations; // same for RandomInUnitSphere
+};
+
+// threadCount 0: one worker thread per CPU core
+void InitializeTest(int threadCount = 0);
 void ShutdownTest();
+// worker threads used for tracing, including the calling thread
+int GetThreadCount();
+// Time each thread spent tracing in the last DrawTest (the rest of the frame time it was idle).
+// Returns number of threads written.
+int GetThreadBusyTimes(double* outSeconds, int maxCount);
 
 void UpdateTest(float time, int frameCount, int screenWidth, int screenHeight, unsigned testFlags);
-void DrawTest(float time, int frameCount, int screenWidth, int screenHeight, float* backbuffer, int& outRayCount, unsigned testFlags);
+void DrawTest(float time, int frameCount, int screenWidth, int screenHeight, float* backbuffer, RayStats& outStats, unsigned testFlags);
+// Edge-avoiding a-trous wavelet filter of the backbuffer that DrawTest (with kFlagAOVs) accumulated into, guided
+// by first hit albedo, normal & depth, and the noise level of each pixel. Writes the result into outImage (same
+// RGBA float layout), on the worker threads; backbuffer is left as is, so that accumulation can go on. Each pass
+// spreads taps twice as far apart; default pass count is DO_DENOISE_PASSES.
+void DenoiseTest(int screenWidth, int screenHeight, const float* backbuffer, float* outImage, int passes = -1);
+
+enum TileOrder
+{
+    kTileOrderRows, // left to right, top to bottom
+    kTileOrderHilbert,
+    kTileOrderMorton,
+};
+// Threads get work as square tiles of tileSize pixels, handed out in the given order;
+// tileSize 0 splits work into ranges of whole rows instead. Default is DO_TILE_SIZE, Hilbert order.
+void SetTileScheduling(int tileSize, TileOrder order);
+
+// Russian roulette: paths that did at least minDepth bounces get randomly terminated, the more likely
+// the less light they can carry. Negative turns it off. Default is DO_RUSSIAN_ROULETTE_DEPTH.
+void SetRussianRoulette(int minDepth);
+
+enum LightSampling
+{
+    kLightSamplingAll, // a shadow ray towards each light, from every diffuse hit
+    kLightSamplingPower, // samplesPerHit lights picked proportional to their emitted power (alias table, constant time)
+    kLightSamplingSolidAngle, // samplesPerHit lights picked by power times solid angle they cover as seen from the hit point
+    kLightSamplingBvh, // samplesPerHit lights picked by estimated contribution, through a light hierarchy (needs DO_BVH)
+};
+// How lights are sampled from each diffuse surface hit; samplesPerHit (1..8) is only used when lights
+// are randomly picked. Default is kLightSamplingAll.
+void SetLightSampling(LightSampling mode, int samplesPerHit);
+
+enum MisHeuristic
+{
+    kMisOff, // light samples alone account for light reaching diffuse surfaces; only those get them
+    kMisBalance, // light & bounce ray samples that reach a light are weighted by their densities...
+    kMisPower, // ...or by squares of them; rough metals get light samples too
+};
+// Multiple importance sampling: how light samples are combined with bounce rays that happen to hit
+// a light. Default is DO_MIS_HEURISTIC.
+void SetMisHeuristic(MisHeuristic heuristic);
+
+enum Sampler
+{
+    kSamplerRandom, // independent random numbers for everything
+    kSamplerSobol, // Owen-scrambled Sobol points for position in the pixel, on the lens & bounce directions
+};
+// Where 2D samples along a path come from; other random decisions (light picking, roulette, glass, metal
+// roughness) always use random numbers. Default is DO_SAMPLER.
+void SetSampler(Sampler sampler);
 
 void GetObjectCount(int& outCount, int& outObjectSize, int& outMaterialSize, int& outCamSize);
 void GetSceneDesc(void* outObjects, void* outMaterials, void* outCam, void* outEmissives, int* outEmissiveCount);
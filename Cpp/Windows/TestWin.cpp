@@ -28,6 +28,7 @@ static void ShutdownD3DDevice();
 static void RenderFrame();
 
 static float* g_Backbuffer;
+static float* g_Denoised;
 
 static D3D_FEATURE_LEVEL g_D3D11FeatureLevel = D3D_FEATURE_LEVEL_11_0;
 static ID3D11Device* g_D3D11Device = nullptr;
@@ -72,6 +73,7 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE, _In_ LPWSTR,
 {
     g_Backbuffer = new float[kBackbufferWidth * kBackbufferHeight * 4];
     memset(g_Backbuffer, 0, kBackbufferWidth * kBackbufferHeight * 4 * sizeof(g_Backbuffer[0]));
+    g_Denoised = new float[kBackbufferWidth * kBackbufferHeight * 4];
 
     InitializeTest();
 
@@ -207,6 +209,8 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE, _In_ LPWSTR,
 
     ShutdownTest();
     ShutdownD3DDevice();
+    delete[] g_Backbuffer;
+    delete[] g_Denoised;
 
     return (int) msg.wParam;
 }
@@ -311,11 +315,13 @@ static void RenderFrameCPU()
     QueryPerformanceCounter(&time1);
     float t = float(clock()) / CLOCKS_PER_SEC;
     static size_t s_RayCounter = 0;
-    int rayCount;
+    RayStats stats;
     UpdateTest(t, s_FrameCount, kBackbufferWidth, kBackbufferHeight, s_Flags);
-    DrawTest(t, s_FrameCount, kBackbufferWidth, kBackbufferHeight, g_Backbuffer, rayCount, s_Flags);
+    DrawTest(t, s_FrameCount, kBackbufferWidth, kBackbufferHeight, g_Backbuffer, stats, s_Flags);
+    if (s_Flags & kFlagAOVs)
+        DenoiseTest(kBackbufferWidth, kBackbufferHeight, g_Backbuffer, g_Denoised);
     s_FrameCount++;
-    s_RayCounter += rayCount;
+    s_RayCounter += stats.TotalRays();
     LARGE_INTEGER time2;
     QueryPerformanceCounter(&time2);
     uint64_t dt = time2.QuadPart - time1.QuadPart;
@@ -327,7 +333,7 @@ static void RenderFrameCPU()
         QueryPerformanceFrequency(&frequency);
 
         double s = double(s_Time) / double(frequency.QuadPart) / s_Count;
-        sprintf_s(s_Buffer, sizeof(s_Buffer), "CPU %.2fms (%.1f FPS) %.1fMrays/s %.2fMrays/frame frames %i [g: toggle GPU, a: toggle animation, p: toggle progressive]\n", s * 1000.0f, 1.f / s, s_RayCounter / s_Count / s * 1.0e-6f, s_RayCounter / s_Count * 1.0e-6f, s_FrameCount);
+        sprintf_s(s_Buffer, sizeof(s_Buffer), "CPU %.2fms (%.1f FPS) %.1fMrays/s %.2fMrays/frame frames %i [g: toggle GPU, a: toggle animation, p: toggle progressive, d: toggle denoise]\n", s * 1000.0f, 1.f / s, s_RayCounter / s_Count / s * 1.0e-6f, s_RayCounter / s_Count * 1.0e-6f, s_FrameCount);
         SetWindowTextA(g_Wnd, s_Buffer);
         OutputDebugStringA(s_Buffer);
         s_Count = 0;
@@ -336,7 +342,7 @@ static void RenderFrameCPU()
     }
 
     g_BackbufferIndex = 0;
-    g_D3D11Ctx->UpdateSubresource(g_BackbufferTexture, 0, NULL, g_Backbuffer, kBackbufferWidth * 16, 0);
+    g_D3D11Ctx->UpdateSubresource(g_BackbufferTexture, 0, NULL, (s_Flags & kFlagAOVs) ? g_Denoised : g_Backbuffer, kBackbufferWidth * 16, 0);
 }
 
 static void FrameTimingGPU()
@@ -424,6 +430,12 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
             s_Flags = s_Flags ^ kFlagProgressive;
             s_FrameCount = 0;
         }
+        if (wParam == 'd')
+        {
+            // AOVs start accumulating from scratch (CPU only)
+            s_Flags = s_Flags ^ kFlagAOVs;
+            s_FrameCount = 0;
+        }
         if (wParam == 'g')
         {
             s_TraceGPU = !s_TraceGPU;